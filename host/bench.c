@@ -0,0 +1,649 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "findfile.h"
+#include "flash.h"
+#include "flash_args.h"
+#include "image.h"
+#include "metrics_host.h"
+#include "port_host.h"
+#include "readback.h"
+#include "sdkconfig.h"
+#include "sim.h"
+#include "trace.h"
+
+// Throughput of the flashing code against simulated targets. Every case runs
+// in its own process, so no state like the negotiated rate carries over.
+
+#define LIST_MAX 16
+#define IMAGE_ADDR 0x10000
+#define JSON_NAME "flasher_args.json"
+#define IMAGE_NAME "app.bin"
+#define READBACK_NAME "readback"
+
+typedef enum {
+    DATA_RANDOM,   // incompressible
+    DATA_FIRMWARE, // deflates to roughly 60 %
+    DATA_ERASED,   // all 0xFF
+    DATA_PADDED,   // random quarter, the rest 0xFF like a partition image
+} data_kind_t;
+
+typedef struct {
+    uint32_t sizes[LIST_MAX];
+    int n_sizes;
+    uint32_t blocks[LIST_MAX];
+    int n_blocks;
+    uint32_t bauds[LIST_MAX];
+    int n_bauds;
+    bool loaders[2]; // ROM, stub
+    bool erases[3];  // indexed by flash_erase_t
+    data_kind_t data;
+    bool diff;
+    bool csv;
+    bool verbose;
+    const char *trace;
+    bool readback;
+    sim_config_t sim;
+} options_t;
+
+typedef struct {
+    uint32_t size;
+    uint32_t block_size;
+    uint32_t baud;
+    bool stub;
+    flash_erase_t erase;
+} bench_case_t;
+
+typedef struct {
+    bool done;
+    bool verified;
+    metrics_run_t run[CONFIG_FLASH_CHANNELS];
+    sim_stats_t stats;
+    bool read_back; // the whole flash of the first target, like it is
+    int64_t read_us;
+} result_t;
+
+static const char *chip_names[] = {
+    [ESP32_CHIP] = "esp32",
+    [ESP32S2_CHIP] = "esp32s2",
+    [ESP32S3_CHIP] = "esp32s3",
+};
+
+static const char *erase_names[] = {
+    [FLASH_ERASE_AUTO] = "auto",
+    [FLASH_ERASE_REGION] = "region",
+    [FLASH_ERASE_CHIP] = "chip",
+};
+
+static int parse_list(const char *str, uint32_t *list)
+{
+    int n = 0;
+    while (*str != '\0' && n < LIST_MAX) {
+        char *end;
+        uint32_t value = strtoul(str, &end, 0);
+        if (end == str) {
+            return -1;
+        }
+        if (*end == 'K' || *end == 'k') {
+            value *= 1024;
+            end++;
+        } else if (*end == 'M' || *end == 'm') {
+            value *= 1024 * 1024;
+            end++;
+        }
+        list[n++] = value;
+        str = *end == ',' ? end + 1 : end;
+        if (*end != ',' && *end != '\0') {
+            return -1;
+        }
+    }
+    return n;
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [options]\n"
+           "  -s, --sizes LIST      image sizes, K and M suffixes "
+           "(64K,256K,1M)\n"
+           "  -b, --blocks LIST     flash block sizes, 0 picks per loader "
+           "(0,0x400,0x1000,0x4000)\n"
+           "  -r, --bauds LIST      rate ceilings "
+           "(115200,460800,921600,2000000)\n"
+           "  -l, --loader LIST     rom, stub or both (rom,stub)\n"
+           "  -e, --erase LIST      auto, region or chip (auto)\n"
+           "  -d, --data KIND       random, firmware, erased or padded\n"
+           "                        (firmware)\n"
+           "  -c, --chip CHIP       esp32, esp32s2 or esp32s3 (esp32s3)\n"
+           "      --latency US      turnaround of every command (50)\n"
+           "      --ber RATE        bit error rate of the line (0)\n"
+           "      --max-baud RATE   the line errs above this rate\n"
+           "      --erase-us US     4 KiB sector erase time (30000)\n"
+           "      --program-us US   256 byte page program time (400)\n"
+           "      --diff            time a second run on the flashed "
+           "target\n"
+           "      --csv             comma separated output\n"
+           "  -v, --verbose         log the flashing\n",
+           name);
+#if CONFIG_FLASH_TRACE
+    printf("      --trace FILE      Chrome trace-event JSON of the last "
+           "case\n");
+#endif
+#if CONFIG_FLASH_READBACK
+    printf("      --readback        time reading the flash back after each "
+           "case\n");
+#endif
+}
+
+static bool parse_options(int argc, char **argv, options_t *o)
+{
+    enum {
+        OPT_LATENCY = 256,
+        OPT_BER,
+        OPT_MAX_BAUD,
+        OPT_ERASE_US,
+        OPT_PROGRAM_US,
+        OPT_DIFF,
+        OPT_CSV,
+        OPT_TRACE,
+        OPT_READBACK,
+    };
+    static const struct option long_options[] = {
+        {"sizes", required_argument, NULL, 's'},
+        {"blocks", required_argument, NULL, 'b'},
+        {"bauds", required_argument, NULL, 'r'},
+        {"loader", required_argument, NULL, 'l'},
+        {"erase", required_argument, NULL, 'e'},
+        {"data", required_argument, NULL, 'd'},
+        {"chip", required_argument, NULL, 'c'},
+        {"latency", required_argument, NULL, OPT_LATENCY},
+        {"ber", required_argument, NULL, OPT_BER},
+        {"max-baud", required_argument, NULL, OPT_MAX_BAUD},
+        {"erase-us", required_argument, NULL, OPT_ERASE_US},
+        {"program-us", required_argument, NULL, OPT_PROGRAM_US},
+        {"diff", no_argument, NULL, OPT_DIFF},
+        {"csv", no_argument, NULL, OPT_CSV},
+#if CONFIG_FLASH_TRACE
+        {"trace", required_argument, NULL, OPT_TRACE},
+#endif
+#if CONFIG_FLASH_READBACK
+        {"readback", no_argument, NULL, OPT_READBACK},
+#endif
+        {"verbose", no_argument, NULL, 'v'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    memset(o, 0, sizeof(options_t));
+    o->n_sizes = parse_list("64K,256K,1M", o->sizes);
+    o->n_blocks = parse_list("0,0x400,0x1000,0x4000", o->blocks);
+    o->n_bauds = parse_list("115200,460800,921600,2000000", o->bauds);
+    o->loaders[0] = true;
+    o->loaders[1] = CONFIG_FLASH_STUB;
+    o->erases[FLASH_ERASE_AUTO] = true;
+    o->data = DATA_FIRMWARE;
+    sim_config_default(&o->sim);
+
+    int c;
+    while ((c = getopt_long(argc, argv, "s:b:r:l:e:d:c:vh", long_options,
+                            NULL)) != -1) {
+        switch (c) {
+        case 's':
+            o->n_sizes = parse_list(optarg, o->sizes);
+            break;
+        case 'b':
+            o->n_blocks = parse_list(optarg, o->blocks);
+            break;
+        case 'r':
+            o->n_bauds = parse_list(optarg, o->bauds);
+            break;
+        case 'l':
+            o->loaders[0] = strstr(optarg, "rom") != NULL;
+            o->loaders[1] = strstr(optarg, "stub") != NULL;
+            break;
+        case 'e':
+            for (int i = 0; i < 3; i++) {
+                o->erases[i] = strstr(optarg, erase_names[i]) != NULL;
+            }
+            break;
+        case 'd':
+            if (strcmp(optarg, "random") == 0) {
+                o->data = DATA_RANDOM;
+            } else if (strcmp(optarg, "erased") == 0) {
+                o->data = DATA_ERASED;
+            } else if (strcmp(optarg, "firmware") == 0) {
+                o->data = DATA_FIRMWARE;
+            } else if (strcmp(optarg, "padded") == 0) {
+                o->data = DATA_PADDED;
+            } else {
+                return false;
+            }
+            break;
+        case 'c':
+            o->sim.chip = ESP_UNKNOWN_CHIP;
+            for (int i = 0; i < sizeof(chip_names) / sizeof(chip_names[0]);
+                 i++) {
+                if (chip_names[i] != NULL &&
+                    strcmp(optarg, chip_names[i]) == 0) {
+                    o->sim.chip = i;
+                }
+            }
+            if (o->sim.chip == ESP_UNKNOWN_CHIP) {
+                return false;
+            }
+            break;
+        case OPT_LATENCY:
+            o->sim.latency_us = strtoul(optarg, NULL, 0);
+            break;
+        case OPT_BER:
+            o->sim.ber = strtod(optarg, NULL);
+            break;
+        case OPT_MAX_BAUD:
+            o->sim.max_baud = strtoul(optarg, NULL, 0);
+            break;
+        case OPT_ERASE_US:
+            o->sim.sector_erase_us = strtoul(optarg, NULL, 0);
+            // A block erase takes about five sectors worth
+            o->sim.block_erase_us = o->sim.sector_erase_us * 5;
+            break;
+        case OPT_PROGRAM_US:
+            o->sim.page_program_us = strtoul(optarg, NULL, 0);
+            break;
+        case OPT_DIFF:
+            o->diff = true;
+            break;
+        case OPT_CSV:
+            o->csv = true;
+            break;
+        case OPT_TRACE:
+            o->trace = optarg;
+            break;
+        case OPT_READBACK:
+            o->readback = true;
+            break;
+        case 'v':
+            o->verbose = true;
+            break;
+        default:
+            return false;
+        }
+    }
+    return o->n_sizes > 0 && o->n_blocks > 0 && o->n_bauds > 0 &&
+           (o->loaders[0] || o->loaders[1]) &&
+           (o->erases[0] || o->erases[1] || o->erases[2]);
+}
+
+static void fill_image(uint8_t *buf, size_t size, data_kind_t kind)
+{
+    uint64_t x = 0x9E3779B97F4A7C15ULL;
+    for (size_t i = 0; i < size; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        switch (kind) {
+        case DATA_RANDOM:
+            buf[i] = x;
+            break;
+        case DATA_ERASED:
+            buf[i] = 0xff;
+            break;
+        case DATA_PADDED:
+            buf[i] = i < size / 4 ? (uint8_t)x : 0xff;
+            break;
+        case DATA_FIRMWARE:
+            // Code like runs of few distinct bytes and repeated strings
+            if (i >= 64 && (x & 0x300) == 0) {
+                buf[i] = buf[i - 64 + (x >> 58)];
+            } else {
+                buf[i] = (x >> 20) & 0x1f;
+            }
+            break;
+        }
+    }
+}
+
+static bool write_file(const char *path, const void *data, size_t size)
+{
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        return false;
+    }
+    bool ok = fwrite(data, 1, size, fp) == size;
+    return fclose(fp) == 0 && ok;
+}
+
+static bool write_job(const char *dir, const bench_case_t *c,
+                      const options_t *o)
+{
+    char path[PATH_MAX];
+    char json[512];
+
+    snprintf(path, sizeof(path), "%s/" JSON_NAME, dir);
+    int len = snprintf(json, sizeof(json),
+                       "{\"flash_files\": {\"0x%x\": \"" IMAGE_NAME "\"}, "
+                       "\"extra_esptool_args\": {\"chip\": \"%s\", "
+                       "\"stub\": %s}, "
+                       "\"flash_settings\": {\"flash_size\": \"%uMB\"}, "
+                       "\"flasher\": {\"baud\": %u, \"block_size\": %u, "
+                       "\"diff\": %s, \"erase\": \"%s\"}}\n",
+                       IMAGE_ADDR, chip_names[o->sim.chip],
+                       c->stub ? "true" : "false",
+                       o->sim.flash_size / (1024 * 1024), c->baud,
+                       c->block_size, o->diff ? "true" : "false",
+                       erase_names[c->erase]);
+    return write_file(path, json, len);
+}
+
+static bool check_image(sim_t *sim, const flash_file_t *file)
+{
+    flash_reader_t reader;
+    flash_reader_open(&reader, file, 0);
+    uint8_t *buf = malloc(MAX(file->size, 1));
+    bool same = buf != NULL &&
+                flash_reader_read(&reader, buf, file->size) == file->size &&
+                memcmp(sim_flash(sim) + file->addr, buf, file->size) == 0;
+    free(buf);
+    flash_reader_close(&reader);
+    return same;
+}
+
+#if CONFIG_FLASH_READBACK
+// Reads the whole flash of the target into the gzip image of a job and
+// compares that job with the flash
+static bool read_back(const char *dir, sim_t *sim, uint32_t flash_size,
+                      result_t *r)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/" READBACK_NAME, dir);
+    int64_t start = esp_timer_get_time();
+    if (!readback(path, 0, flash_size)) {
+        return false;
+    }
+    r->read_us = esp_timer_get_time() - start;
+    findfile_t *ff = findfile(path, JSON_NAME, NULL);
+    flash_args_t *args =
+        ff != NULL ? flash_args_from_json(ff->buf, ff->size, ff->dir) : NULL;
+    bool same = args != NULL && args->flash_files_size == 1 &&
+                args->flash_files[0].size == flash_size &&
+                check_image(sim, &args->flash_files[0]);
+    flash_args_free(args);
+    if (ff != NULL) {
+        free(ff->buf);
+        if (ff->dir != path) {
+            free(ff->dir);
+        }
+        free(ff);
+    }
+    return same;
+}
+#endif
+
+// Body of the child process of a case
+static void run_case(const char *dir, const options_t *o, uint32_t size,
+                     result_t *r)
+{
+    sim_t *sims[CONFIG_FLASH_CHANNELS];
+    sim_config_t config = o->sim;
+    config.flash_size = MAX(config.flash_size, IMAGE_ADDR + size);
+
+    for (int i = 0; i < CONFIG_FLASH_CHANNELS; i++) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+            return;
+        }
+        config.seed = o->sim.seed + i;
+        sims[i] = sim_start(&config, sv[1]);
+        if (sims[i] == NULL) {
+            return;
+        }
+        port_host_attach(i, sv[0], sims[i]);
+    }
+
+#if CONFIG_FLASH_TRACE
+    if (o->trace != NULL) {
+        trace_init();
+    }
+#endif
+    findfile_t *ff = findfile(dir, JSON_NAME, NULL);
+    if (ff == NULL) {
+        return;
+    }
+    flash_args_t *args = flash_args_from_json(ff->buf, ff->size, ff->dir);
+    if (args == NULL) {
+        return;
+    }
+    image_ingest(args);
+    metrics_init();
+    if (flash_init() != CONFIG_FLASH_CHANNELS) {
+        return;
+    }
+    if (o->diff && !flash(args, NULL)) {
+        return; // the baseline for the differential run failed
+    }
+    r->done = true;
+    r->verified = flash(args, NULL);
+    for (int i = 0; i < CONFIG_FLASH_CHANNELS; i++) {
+        metrics_last(i, &r->run[i]);
+        for (int j = 0; j < args->flash_files_size; j++) {
+            r->verified &= check_image(sims[i], &args->flash_files[j]);
+        }
+    }
+    sim_get_stats(sims[0], &r->stats);
+#if CONFIG_FLASH_READBACK
+    if (o->readback) {
+        r->read_back = read_back(dir, sims[0], config.flash_size, r);
+    }
+#endif
+#if CONFIG_FLASH_TRACE
+    FILE *out = o->trace != NULL ? fopen(o->trace, "w") : NULL;
+    if (out != NULL) {
+        trace_dump(out);
+        fclose(out);
+    }
+#endif
+}
+
+static bool fork_case(const char *dir, const options_t *o, uint32_t size,
+                      result_t *r)
+{
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return false;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        if (!o->verbose) {
+            // findfile() and the progress print to stdout
+            int null = open("/dev/null", O_WRONLY);
+            dup2(null, STDOUT_FILENO);
+        }
+        esp_log_level = o->verbose ? ESP_LOG_INFO : ESP_LOG_ERROR;
+        result_t res = {0};
+        run_case(dir, o, size, &res);
+        _exit(write(fds[1], &res, sizeof(res)) == sizeof(res) ? 0 : 1);
+    }
+    close(fds[1]);
+    memset(r, 0, sizeof(result_t));
+    bool ok = pid > 0 && read(fds[0], r, sizeof(result_t)) == sizeof(result_t);
+    close(fds[0]);
+    if (pid > 0) {
+        waitpid(pid, NULL, 0);
+    }
+    return ok;
+}
+
+static const char *error_name(esp_loader_error_t err)
+{
+    switch (err) {
+    case ESP_LOADER_SUCCESS:
+        return "ok";
+    case ESP_LOADER_ERROR_TIMEOUT:
+        return "timeout";
+    case ESP_LOADER_ERROR_INVALID_MD5:
+        return "md5";
+    case ESP_LOADER_ERROR_INVALID_RESPONSE:
+        return "response";
+    default:
+        return "fail";
+    }
+}
+
+static void print_header(const options_t *o)
+{
+    if (o->csv) {
+        printf("size,block_size,baud,loader,strategy,result,total_ms,"
+               "connect_ms,stub_ms,baud_ms,diff_ms,erase_ms,write_ms,"
+               "verify_ms,sent,bad_frames,retries,resumes,kib_per_s%s\n",
+               o->readback ? ",read_result,read_ms,read_kib_per_s" : "");
+        return;
+    }
+    printf("%8s %6s %8s %6s %8s %8s %8s %7s %6s %6s %6s %7s %7s %6s %8s "
+           "%4s %5s %6s %7s",
+           "size", "block", "baud", "loader", "strategy", "result", "total",
+           "connect", "stub", "baud", "diff", "erase", "write", "verify",
+           "sent", "bad", "retry", "resume", "KiB/s");
+    if (o->readback) {
+        printf(" %8s %7s %7s", "read", "read_ms", "KiB/s");
+    }
+    printf("\n");
+}
+
+static void print_result(const options_t *o, const bench_case_t *c,
+                         const result_t *r)
+{
+    // The slowest channel bounds the cycle
+    const metrics_run_t *run = &r->run[0];
+    for (int i = 1; i < CONFIG_FLASH_CHANNELS; i++) {
+        if (r->run[i].cycle_us > run->cycle_us) {
+            run = &r->run[i];
+        }
+    }
+    const char *result = "ok";
+    if (!r->done) {
+        result = "setup";
+    } else if (run->err != ESP_LOADER_SUCCESS) {
+        result = error_name(run->err);
+    } else if (!r->verified) {
+        result = "mismatch";
+    }
+    int64_t ms[METRICS_PHASES];
+    for (int i = 0; i < METRICS_PHASES; i++) {
+        ms[i] = run->phase_us[i] / 1000;
+    }
+    double rate = strcmp(result, "ok") == 0
+                      ? c->size * 1000000.0 * CONFIG_FLASH_CHANNELS /
+                            run->cycle_us / 1024
+                      : 0;
+    const char *format =
+        o->csv ? "%u,%u,%u,%s,%s,%s,%lld,%lld,%lld,%lld,%lld,%lld,%lld,%lld,"
+                 "%u,%u,%u,%u,%.1f"
+               : "%8u %6u %8u %6s %8s %8s %8lld %7lld %6lld %6lld %6lld "
+                 "%7lld %7lld %6lld %8u %4u %5u %6u %7.1f";
+    printf(format, c->size, c->block_size, c->baud, c->stub ? "stub" : "rom",
+           erase_names[c->erase], result, (long long)run->cycle_us / 1000,
+           (long long)ms[METRICS_CONNECT], (long long)ms[METRICS_STUB],
+           (long long)ms[METRICS_BAUD], (long long)ms[METRICS_DIFF],
+           (long long)ms[METRICS_ERASE], (long long)ms[METRICS_WRITE],
+           (long long)ms[METRICS_VERIFY], run->sent, r->stats.bad_frames,
+           run->retries, run->resumes, rate);
+    if (o->readback) {
+        // Of the whole flash, deflated into the storage on the way
+        double read_rate = r->read_back ? o->sim.flash_size * 1000000.0 /
+                                              r->read_us / 1024
+                                        : 0;
+        printf(o->csv ? ",%s,%lld,%.1f" : " %8s %7lld %7.1f",
+               r->read_back ? "ok" : "fail", (long long)r->read_us / 1000,
+               read_rate);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    options_t o;
+    if (!parse_options(argc, argv, &o)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    char root[] = "/tmp/flash_bench.XXXXXX";
+    if (mkdtemp(root) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    print_header(&o);
+    int failed = 0;
+    for (int s = 0; s < o.n_sizes; s++) {
+        char dir[64];
+        char path[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%s/%u", root, o.sizes[s]);
+        snprintf(path, sizeof(path), "%s/" IMAGE_NAME, dir);
+        uint8_t *image = malloc(MAX(o.sizes[s], 1));
+        if (image == NULL || mkdir(dir, 0755) != 0) {
+            perror(dir);
+            return 1;
+        }
+        fill_image(image, o.sizes[s], o.data);
+        if (!write_file(path, image, o.sizes[s])) {
+            perror(path);
+            return 1;
+        }
+        free(image);
+
+        for (int l = 0; l < 2; l++) {
+            for (int r = 0; r < o.n_bauds && o.loaders[l]; r++) {
+                for (int b = 0; b < o.n_blocks; b++) {
+                    for (int e = 0; e < 3; e++) {
+                        if (!o.erases[e]) {
+                            continue;
+                        }
+                        bench_case_t c = {
+                            .size = o.sizes[s],
+                            .block_size = o.blocks[b],
+                            .baud = o.bauds[r],
+                            .stub = l == 1,
+                            .erase = e,
+                        };
+                        result_t res = {0};
+                        if (!write_job(dir, &c, &o) ||
+                            !fork_case(dir, &o, c.size, &res)) {
+                            res.done = false;
+                        }
+                        print_result(&o, &c, &res);
+                        failed += !res.done || !res.verified ||
+                                  (o.readback && !res.read_back);
+                    }
+                }
+            }
+        }
+        unlink(path);
+        snprintf(path, sizeof(path), "%s/" JSON_NAME, dir);
+        unlink(path);
+        if (o.readback) {
+            snprintf(path, sizeof(path), "%s/" READBACK_NAME "/" JSON_NAME,
+                     dir);
+            unlink(path);
+            snprintf(path, sizeof(path), "%s/" READBACK_NAME "/flash.bin.gz",
+                     dir);
+            unlink(path);
+            snprintf(path, sizeof(path), "%s/" READBACK_NAME, dir);
+            rmdir(path);
+        }
+        rmdir(dir);
+    }
+    rmdir(root);
+    return failed > 0;
+}
@@ -0,0 +1,66 @@
+#include <string.h>
+#include <time.h>
+
+#include <openssl/evp.h>
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "mbedtls/base64.h"
+
+#define MBEDTLS_ERR_BASE64_BUFFER_TOO_SMALL -0x002A
+#define MBEDTLS_ERR_BASE64_INVALID_CHARACTER -0x002C
+
+esp_log_level_t esp_log_level = ESP_LOG_WARN;
+
+static int64_t boot_time = 0;
+
+int64_t esp_timer_get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    int64_t now = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+    if (boot_time == 0) {
+        boot_time = now;
+    }
+    return now - boot_time;
+}
+
+unsigned int esp_log_timestamp(void)
+{
+    return esp_timer_get_time() / 1000;
+}
+
+vprintf_like_t esp_log_set_vprintf(vprintf_like_t func)
+{
+    static vprintf_like_t hook = vprintf;
+    vprintf_like_t prev = hook;
+    hook = func;
+    return prev;
+}
+
+const char *esp_err_to_name(esp_err_t code)
+{
+    return code == ESP_OK ? "ESP_OK" : "ESP_FAIL";
+}
+
+int mbedtls_base64_decode(unsigned char *dst, size_t dlen, size_t *olen,
+                          const unsigned char *src, size_t slen)
+{
+    if (slen % 4 != 0) {
+        return MBEDTLS_ERR_BASE64_INVALID_CHARACTER;
+    }
+    size_t size = slen / 4 * 3;
+    if (size > dlen) {
+        return MBEDTLS_ERR_BASE64_BUFFER_TOO_SMALL;
+    }
+    if (EVP_DecodeBlock(dst, src, slen) < 0) {
+        return MBEDTLS_ERR_BASE64_INVALID_CHARACTER;
+    }
+    // EVP_DecodeBlock() counts the padding as decoded zeros
+    for (size_t i = slen; i > 0 && src[i - 1] == '='; i--) {
+        size--;
+    }
+    *olen = size;
+    return 0;
+}
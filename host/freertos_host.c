@@ -0,0 +1,300 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+struct host_task {
+    pthread_t thread;
+    char name[16];
+    TaskFunction_t fn;
+    void *arg;
+    UBaseType_t priority;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t notified;
+};
+
+struct host_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    UBaseType_t length;
+    UBaseType_t item_size;
+    UBaseType_t head;
+    UBaseType_t count;
+    uint8_t items[];
+};
+
+struct host_semaphore {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    UBaseType_t max;
+    UBaseType_t count;
+};
+
+static __thread struct host_task *current = NULL;
+
+static void init_cond(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static struct timespec deadline_of(TickType_t ticks)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += ticks / 1000;
+    ts.tv_nsec += (ticks % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    return ts;
+}
+
+// Wait on cond with lock held, false once the ticks elapsed
+static bool wait(pthread_cond_t *cond, pthread_mutex_t *lock,
+                 const struct timespec *deadline, TickType_t ticks)
+{
+    if (ticks == 0) {
+        return false;
+    }
+    if (ticks == portMAX_DELAY) {
+        pthread_cond_wait(cond, lock);
+        return true;
+    }
+    return pthread_cond_timedwait(cond, lock, deadline) != ETIMEDOUT;
+}
+
+static struct host_task *task_new(const char *name, TaskFunction_t fn,
+                                  void *arg, UBaseType_t priority)
+{
+    struct host_task *t = calloc(1, sizeof(struct host_task));
+    if (t == NULL) {
+        return NULL;
+    }
+    snprintf(t->name, sizeof(t->name), "%s", name);
+    t->fn = fn;
+    t->arg = arg;
+    t->priority = priority;
+    pthread_mutex_init(&t->lock, NULL);
+    init_cond(&t->cond);
+    return t;
+}
+
+// Threads not created by xTaskCreate(), like main(), become tasks on demand
+static struct host_task *current_task(void)
+{
+    if (current == NULL) {
+        current = task_new("main", NULL, NULL, 1);
+        current->thread = pthread_self();
+    }
+    return current;
+}
+
+static void *task_main(void *arg)
+{
+    current = arg;
+    current->fn(current->arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack,
+                       void *arg, UBaseType_t priority, TaskHandle_t *task)
+{
+    struct host_task *t = task_new(name, fn, arg, priority);
+    if (t == NULL) {
+        return pdFAIL;
+    }
+    if (pthread_create(&t->thread, NULL, task_main, t) != 0) {
+        free(t);
+        return pdFAIL;
+    }
+    pthread_detach(t->thread);
+    if (task != NULL) {
+        *task = t;
+    }
+    return pdPASS;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    return current_task();
+}
+
+char *pcTaskGetName(TaskHandle_t task)
+{
+    return task != NULL ? task->name : current_task()->name;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    struct host_task *t = current_task();
+    if (task != NULL && task != t) {
+        abort(); // not needed by main/
+    }
+    // Handles may still be notified, the task itself is never freed
+    pthread_exit(NULL);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    struct timespec ts = {
+        .tv_sec = ticks / 1000,
+        .tv_nsec = (ticks % 1000) * 1000000L,
+    };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+}
+
+UBaseType_t uxTaskPriorityGet(TaskHandle_t task)
+{
+    return task != NULL ? task->priority : current_task()->priority;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+    struct host_task *t = current_task();
+    struct timespec deadline = deadline_of(ticks);
+
+    pthread_mutex_lock(&t->lock);
+    while (t->notified == 0 && wait(&t->cond, &t->lock, &deadline, ticks)) {
+    }
+    uint32_t value = t->notified;
+    if (value > 0) {
+        t->notified = clear ? 0 : value - 1;
+    }
+    pthread_mutex_unlock(&t->lock);
+    return value;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    pthread_mutex_lock(&task->lock);
+    task->notified++;
+    pthread_cond_signal(&task->cond);
+    pthread_mutex_unlock(&task->lock);
+    return pdPASS;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    struct host_queue *q =
+        calloc(1, sizeof(struct host_queue) + length * item_size);
+    if (q == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&q->lock, NULL);
+    init_cond(&q->changed);
+    q->length = length;
+    q->item_size = item_size;
+    return q;
+}
+
+void vQueueDelete(QueueHandle_t q)
+{
+    pthread_cond_destroy(&q->changed);
+    pthread_mutex_destroy(&q->lock);
+    free(q);
+}
+
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t ticks)
+{
+    struct timespec deadline = deadline_of(ticks);
+
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->length) {
+        if (!wait(&q->changed, &q->lock, &deadline, ticks)) {
+            pthread_mutex_unlock(&q->lock);
+            return pdFALSE;
+        }
+    }
+    UBaseType_t tail = (q->head + q->count) % q->length;
+    memcpy(q->items + tail * q->item_size, item, q->item_size);
+    q->count++;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t ticks)
+{
+    struct timespec deadline = deadline_of(ticks);
+
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0) {
+        if (!wait(&q->changed, &q->lock, &deadline, ticks)) {
+            pthread_mutex_unlock(&q->lock);
+            return pdFALSE;
+        }
+    }
+    memcpy(item, q->items + q->head * q->item_size, q->item_size);
+    q->head = (q->head + 1) % q->length;
+    q->count--;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+    return pdTRUE;
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max,
+                                           UBaseType_t initial)
+{
+    struct host_semaphore *s = calloc(1, sizeof(struct host_semaphore));
+    if (s == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&s->lock, NULL);
+    init_cond(&s->changed);
+    s->max = max;
+    s->count = initial;
+    return s;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t s)
+{
+    pthread_cond_destroy(&s->changed);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t s, TickType_t ticks)
+{
+    struct timespec deadline = deadline_of(ticks);
+
+    pthread_mutex_lock(&s->lock);
+    while (s->count == 0) {
+        if (!wait(&s->changed, &s->lock, &deadline, ticks)) {
+            pthread_mutex_unlock(&s->lock);
+            return pdFALSE;
+        }
+    }
+    s->count--;
+    pthread_mutex_unlock(&s->lock);
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t s)
+{
+    BaseType_t ret = pdFALSE;
+
+    pthread_mutex_lock(&s->lock);
+    if (s->count < s->max) {
+        s->count++;
+        pthread_cond_signal(&s->changed);
+        ret = pdTRUE;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return ret;
+}
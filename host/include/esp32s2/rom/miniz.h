@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <zlib.h>
+
+// The tdefl and tinfl subset of the ROM miniz used by image.c and gz.c,
+// implemented on zlib
+
+typedef int mz_bool;
+typedef unsigned char mz_uint8;
+typedef unsigned int mz_uint32;
+
+#define MZ_FALSE 0
+#define MZ_TRUE 1
+
+#define TDEFL_DEFAULT_MAX_PROBES 128
+#define TDEFL_WRITE_ZLIB_HEADER 0x01000
+#define TDEFL_GREEDY_PARSING_FLAG 0x04000
+
+typedef enum {
+    TDEFL_STATUS_BAD_PARAM = -2,
+    TDEFL_STATUS_PUT_BUF_FAILED = -1,
+    TDEFL_STATUS_OKAY = 0,
+    TDEFL_STATUS_DONE = 1,
+} tdefl_status;
+
+typedef enum {
+    TDEFL_NO_FLUSH = 0,
+    TDEFL_SYNC_FLUSH = 2,
+    TDEFL_FULL_FLUSH = 3,
+    TDEFL_FINISH = 4,
+} tdefl_flush;
+
+typedef mz_bool (*tdefl_put_buf_func_ptr)(const void *buf, int len,
+                                          void *user);
+
+typedef struct {
+    z_stream z;
+    tdefl_put_buf_func_ptr put;
+    void *user;
+} tdefl_compressor;
+
+tdefl_status tdefl_init(tdefl_compressor *d, tdefl_put_buf_func_ptr put,
+                        void *user, int flags);
+tdefl_status tdefl_compress_buffer(tdefl_compressor *d, const void *buf,
+                                   size_t size, tdefl_flush flush);
+
+#define TINFL_LZ_DICT_SIZE 32768
+#define TINFL_FLAG_PARSE_ZLIB_HEADER 1
+#define TINFL_FLAG_HAS_MORE_INPUT 2
+#define TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF 4
+
+typedef enum {
+    TINFL_STATUS_BAD_PARAM = -3,
+    TINFL_STATUS_ADLER32_MISMATCH = -2,
+    TINFL_STATUS_FAILED = -1,
+    TINFL_STATUS_DONE = 0,
+    TINFL_STATUS_NEEDS_MORE_INPUT = 1,
+    TINFL_STATUS_HAS_MORE_OUTPUT = 2,
+} tinfl_status;
+
+typedef struct {
+    z_stream z;
+    int m_state; // 0 before the first call, like the ROM's
+} tinfl_decompressor;
+
+#define tinfl_init(r) ((r)->m_state = 0)
+
+// zlib keeps its own window, the output buffer need not hold it
+tinfl_status tinfl_decompress(tinfl_decompressor *r, const mz_uint8 *in,
+                              size_t *in_size, mz_uint8 *out_start,
+                              mz_uint8 *out_next, size_t *out_size,
+                              const mz_uint32 flags);
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "esp_err.h"
+
+// There is no console on the host, the commands are dropped
+
+typedef int (*esp_console_cmd_func_t)(int argc, char **argv);
+
+typedef struct {
+    const char *command;
+    const char *help;
+    const char *hint;
+    esp_console_cmd_func_t func;
+} esp_console_cmd_t;
+
+static inline esp_err_t esp_console_cmd_register(const esp_console_cmd_t *cmd)
+{
+    return ESP_OK;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Types of esp-serial-flasher used by main/, the library itself is not
+// needed since main/ talks to the loaders on its own
+
+typedef enum {
+    ESP_LOADER_SUCCESS,
+    ESP_LOADER_ERROR_FAIL,
+    ESP_LOADER_ERROR_TIMEOUT,
+    ESP_LOADER_ERROR_IMAGE_SIZE,
+    ESP_LOADER_ERROR_INVALID_MD5,
+    ESP_LOADER_ERROR_INVALID_PARAM,
+    ESP_LOADER_ERROR_INVALID_TARGET,
+    ESP_LOADER_ERROR_UNSUPPORTED_CHIP,
+    ESP_LOADER_ERROR_UNSUPPORTED_FUNC,
+    ESP_LOADER_ERROR_INVALID_RESPONSE,
+} esp_loader_error_t;
+
+typedef enum {
+    ESP8266_CHIP = 0,
+    ESP32_CHIP = 1,
+    ESP32S2_CHIP = 2,
+    ESP32C3_CHIP = 3,
+    ESP32S3_CHIP = 4,
+    ESP32C2_CHIP = 5,
+    ESP32H4_CHIP = 6,
+    ESP32H2_CHIP = 7,
+    ESP_MAX_CHIP = 8,
+    ESP_UNKNOWN_CHIP = 8,
+} target_chip_t;
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdarg.h>
+#include <stdio.h>
+
+typedef enum {
+    ESP_LOG_NONE,
+    ESP_LOG_ERROR,
+    ESP_LOG_WARN,
+    ESP_LOG_INFO,
+    ESP_LOG_DEBUG,
+    ESP_LOG_VERBOSE,
+} esp_log_level_t;
+
+// Messages above the level are dropped, all of them go to stderr
+extern esp_log_level_t esp_log_level;
+
+unsigned int esp_log_timestamp(void);
+
+// The macros below print directly, a hook set here is kept but never called
+typedef int (*vprintf_like_t)(const char *, va_list);
+vprintf_like_t esp_log_set_vprintf(vprintf_like_t func);
+
+#define ESP_LOG_LEVEL(level, letter, tag, format, ...)                         \
+    do {                                                                       \
+        if (level <= esp_log_level) {                                          \
+            fprintf(stderr, letter " (%u) %s: " format "\n",                   \
+                    esp_log_timestamp(), tag, ##__VA_ARGS__);                  \
+        }                                                                      \
+    } while (0)
+
+#define ESP_LOGE(tag, format, ...)                                             \
+    ESP_LOG_LEVEL(ESP_LOG_ERROR, "E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...)                                             \
+    ESP_LOG_LEVEL(ESP_LOG_WARN, "W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...)                                             \
+    ESP_LOG_LEVEL(ESP_LOG_INFO, "I", tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...)                                             \
+    ESP_LOG_LEVEL(ESP_LOG_DEBUG, "D", tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...)                                             \
+    ESP_LOG_LEVEL(ESP_LOG_VERBOSE, "V", tag, format, ##__VA_ARGS__)
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <zlib.h>
+
+// The ROM CRC of the targets, the same CRC-32 as zlib's
+
+static inline uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t *buf,
+                                        uint32_t len)
+{
+    return crc32(crc, buf, len);
+}
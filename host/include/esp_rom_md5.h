@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <openssl/md5.h>
+
+// The ROM digest of the targets, implemented by OpenSSL on the host
+
+typedef MD5_CTX md5_context_t;
+
+static inline void esp_rom_md5_init(md5_context_t *context)
+{
+    MD5_Init(context);
+}
+
+static inline void esp_rom_md5_update(md5_context_t *context,
+                                      const void *buf, uint32_t len)
+{
+    MD5_Update(context, buf, len);
+}
+
+static inline void esp_rom_md5_final(uint8_t *digest, md5_context_t *context)
+{
+    MD5_Final(digest, context);
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+#include <stdint.h>
+
+// Microseconds of the monotonic clock
+int64_t esp_timer_get_time(void);
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdbool.h>
+
+// The harness has no USB, the volume stays with the app
+
+static inline bool tinyusb_msc_storage_in_use_by_usb_host(void)
+{
+    return false;
+}
@@ -0,0 +1,49 @@
+#include <string.h>
+
+#include "esp_timer.h"
+#include "metrics_host.h"
+
+static metrics_run_t runs[METRICS_HOST_CHANNELS];
+static int64_t starts[METRICS_HOST_CHANNELS];
+
+void metrics_init(void)
+{
+}
+
+void metrics_begin(int channel, metrics_cycle_t cycle)
+{
+    memset(&runs[channel], 0, sizeof(metrics_run_t));
+    starts[channel] = esp_timer_get_time();
+}
+
+void metrics_phase(int channel, metrics_phase_t phase, int64_t us)
+{
+    runs[channel].phase_us[phase] += us;
+}
+
+void metrics_file(int channel, uint32_t addr, uint32_t size)
+{
+    runs[channel].size += size;
+}
+
+void metrics_sent(int channel, uint32_t bytes)
+{
+    runs[channel].sent += bytes;
+}
+
+void metrics_recovery(int channel, uint32_t retries, uint32_t resumes)
+{
+    runs[channel].retries = retries;
+    runs[channel].resumes = resumes;
+}
+
+void metrics_end(int channel, esp_loader_error_t err)
+{
+    runs[channel].err = err;
+    runs[channel].cycle_us = esp_timer_get_time() - starts[channel];
+}
+
+void metrics_last(int channel, metrics_run_t *run)
+{
+    *run = runs[channel];
+}
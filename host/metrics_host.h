@@ -0,0 +1,20 @@
+#pragma once
+
+#include "metrics.h"
+
+// metrics.h keeps the last run of every channel in memory on the host, there
+// is no NVS and no console to print it
+
+#define METRICS_HOST_CHANNELS 3
+
+typedef struct {
+    esp_loader_error_t err;
+    int64_t cycle_us;
+    int64_t phase_us[METRICS_PHASES];
+    uint32_t size; // image bytes of the files
+    uint32_t sent; // bytes on the line after compression and diff
+    uint32_t retries;
+    uint32_t resumes;
+} metrics_run_t;
+
+void metrics_last(int channel, metrics_run_t *run);
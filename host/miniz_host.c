@@ -0,0 +1,107 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "esp32s2/rom/miniz.h"
+
+#define OUT_CHUNK 4096
+
+tdefl_status tdefl_init(tdefl_compressor *d, tdefl_put_buf_func_ptr put,
+                        void *user, int flags)
+{
+    memset(d, 0, sizeof(tdefl_compressor));
+    d->put = put;
+    d->user = user;
+    // Raw deflate unless the zlib header is asked for, like the ROM
+    int bits = flags & TDEFL_WRITE_ZLIB_HEADER ? 15 : -15;
+    if (deflateInit2(&d->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, bits, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        return TDEFL_STATUS_BAD_PARAM;
+    }
+    return TDEFL_STATUS_OKAY;
+}
+
+// The stream is released once done or failed, image.c never reuses it then
+tdefl_status tdefl_compress_buffer(tdefl_compressor *d, const void *buf,
+                                   size_t size, tdefl_flush flush)
+{
+    uint8_t out[OUT_CHUNK];
+    int zflush = flush == TDEFL_FINISH ? Z_FINISH : Z_NO_FLUSH;
+    int ret;
+
+    d->z.next_in = (Bytef *)buf;
+    d->z.avail_in = size;
+    do {
+        d->z.next_out = out;
+        d->z.avail_out = sizeof(out);
+        ret = deflate(&d->z, zflush);
+        if (ret == Z_STREAM_ERROR) {
+            deflateEnd(&d->z);
+            return TDEFL_STATUS_BAD_PARAM;
+        }
+        int len = sizeof(out) - d->z.avail_out;
+        if (len > 0 && !d->put(out, len, d->user)) {
+            deflateEnd(&d->z);
+            return TDEFL_STATUS_PUT_BUF_FAILED;
+        }
+    } while (d->z.avail_out == 0 ||
+             (zflush == Z_FINISH && ret != Z_STREAM_END));
+
+    if (ret == Z_STREAM_END) {
+        deflateEnd(&d->z);
+        return TDEFL_STATUS_DONE;
+    }
+    return TDEFL_STATUS_OKAY;
+}
+
+enum {
+    TINFL_HOST_INIT,
+    TINFL_HOST_RUNNING,
+    TINFL_HOST_DONE,
+};
+
+// The ROM has no end call, a stream left before its end keeps its zlib state
+tinfl_status tinfl_decompress(tinfl_decompressor *r, const mz_uint8 *in,
+                              size_t *in_size, mz_uint8 *out_start,
+                              mz_uint8 *out_next, size_t *out_size,
+                              const mz_uint32 flags)
+{
+    if (r->m_state == TINFL_HOST_DONE) {
+        *in_size = 0;
+        *out_size = 0;
+        return TINFL_STATUS_DONE;
+    }
+    if (r->m_state == TINFL_HOST_INIT) {
+        memset(&r->z, 0, sizeof(r->z));
+        int bits = flags & TINFL_FLAG_PARSE_ZLIB_HEADER ? 15 : -15;
+        if (inflateInit2(&r->z, bits) != Z_OK) {
+            return TINFL_STATUS_BAD_PARAM;
+        }
+        r->m_state = TINFL_HOST_RUNNING;
+    }
+    r->z.next_in = (Bytef *)in;
+    r->z.avail_in = *in_size;
+    r->z.next_out = out_next;
+    r->z.avail_out = *out_size;
+    int ret = inflate(&r->z, Z_NO_FLUSH);
+    *in_size -= r->z.avail_in;
+    *out_size -= r->z.avail_out;
+    if (ret == Z_STREAM_END) {
+        inflateEnd(&r->z);
+        r->m_state = TINFL_HOST_DONE;
+        return TINFL_STATUS_DONE;
+    }
+    if (ret != Z_OK && ret != Z_BUF_ERROR) {
+        inflateEnd(&r->z);
+        r->m_state = TINFL_HOST_DONE;
+        return TINFL_STATUS_FAILED;
+    }
+    if (r->z.avail_out == 0) {
+        return TINFL_STATUS_HAS_MORE_OUTPUT;
+    }
+    if (!(flags & TINFL_FLAG_HAS_MORE_INPUT)) {
+        inflateEnd(&r->z);
+        r->m_state = TINFL_HOST_DONE;
+        return TINFL_STATUS_FAILED;
+    }
+    return TINFL_STATUS_NEEDS_MORE_INPUT;
+}
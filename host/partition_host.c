@@ -0,0 +1,119 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "partition_host.h"
+
+#define SECTOR_SIZE 0x1000
+
+typedef struct {
+    esp_partition_t part;
+    uint8_t *data;
+} host_partition_t;
+
+static host_partition_t partitions[PARTITION_HOST_MAX];
+static int n_partitions = 0;
+
+const esp_partition_t *partition_host_add(esp_partition_type_t type,
+                                          esp_partition_subtype_t subtype,
+                                          const char *label, uint32_t size)
+{
+    if (n_partitions == PARTITION_HOST_MAX) {
+        return NULL;
+    }
+    host_partition_t *p = &partitions[n_partitions];
+    p->data = malloc(size);
+    if (p->data == NULL) {
+        return NULL;
+    }
+    memset(p->data, 0xff, size);
+    p->part.type = type;
+    p->part.subtype = subtype;
+    p->part.address = 0x110000 + n_partitions * 0x100000;
+    p->part.size = size;
+    p->part.erase_size = SECTOR_SIZE;
+    strncpy(p->part.label, label, sizeof(p->part.label) - 1);
+    n_partitions++;
+    return &p->part;
+}
+
+static host_partition_t *of(const esp_partition_t *partition)
+{
+    return (host_partition_t *)partition;
+}
+
+const uint8_t *partition_host_data(const esp_partition_t *partition)
+{
+    return of(partition)->data;
+}
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type,
+                                                esp_partition_subtype_t subtype,
+                                                const char *label)
+{
+    for (int i = 0; i < n_partitions; i++) {
+        const esp_partition_t *p = &partitions[i].part;
+        if (p->type == type && p->subtype == subtype &&
+            (label == NULL || strcmp(p->label, label) == 0)) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static bool inside(const esp_partition_t *partition, size_t offset,
+                   size_t size)
+{
+    return offset <= partition->size && size <= partition->size - offset;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition,
+                             size_t src_offset, void *dst, size_t size)
+{
+    if (!inside(partition, src_offset, size)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(dst, of(partition)->data + src_offset, size);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *partition,
+                              size_t dst_offset, const void *src, size_t size)
+{
+    if (!inside(partition, dst_offset, size)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    uint8_t *dst = of(partition)->data + dst_offset;
+    for (size_t i = 0; i < size; i++) {
+        dst[i] &= ((const uint8_t *)src)[i];
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition,
+                                    size_t offset, size_t size)
+{
+    if (!inside(partition, offset, size) || offset % SECTOR_SIZE != 0 ||
+        size % SECTOR_SIZE != 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(of(partition)->data + offset, 0xff, size);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_mmap(const esp_partition_t *partition, size_t offset,
+                             size_t size, esp_partition_mmap_memory_t memory,
+                             const void **out_ptr,
+                             esp_partition_mmap_handle_t *out_handle)
+{
+    if (!inside(partition, offset, size)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    *out_ptr = of(partition)->data + offset;
+    *out_handle = 1;
+    return ESP_OK;
+}
+
+void esp_partition_munmap(esp_partition_mmap_handle_t handle)
+{
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "esp_partition.h"
+
+// Adds a partition filled with 0xFF to the ones esp_partition_find_first()
+// finds, at most PARTITION_HOST_MAX
+#define PARTITION_HOST_MAX 4
+
+const esp_partition_t *partition_host_add(esp_partition_type_t type,
+                                          esp_partition_subtype_t subtype,
+                                          const char *label, uint32_t size);
+const uint8_t *partition_host_data(const esp_partition_t *partition);
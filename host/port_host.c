@@ -0,0 +1,162 @@
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "port.h"
+#include "port_host.h"
+#include "trace.h"
+
+static const char *TAG = "port";
+
+#define PORT_RESET_HOLD_TIME_MS 100
+#define PORT_BOOT_HOLD_TIME_MS 50
+
+typedef struct {
+    int fd;
+    sim_t *sim;
+    uint8_t buf[256]; // received but not yet read
+    size_t head;
+    size_t len;
+} host_line_t;
+
+static host_line_t lines[PORT_HOST_LINES];
+
+void port_host_attach(int uart_port, int fd, sim_t *sim)
+{
+    lines[uart_port].fd = fd;
+    lines[uart_port].sim = sim;
+    lines[uart_port].len = 0;
+}
+
+static host_line_t *line_of(port_t *port)
+{
+    return &lines[port->config.uart_port];
+}
+
+esp_loader_error_t port_init(port_t *port, const port_config_t *config,
+                             uint32_t baud_rate)
+{
+    port->config = *config;
+    port->baud_rate = baud_rate;
+    port->deadline = 0;
+    if (config->uart_port < 0 || config->uart_port >= PORT_HOST_LINES ||
+        lines[config->uart_port].sim == NULL) {
+        ESP_LOGE(TAG, "No target attached to UART%d", config->uart_port);
+        return ESP_LOADER_ERROR_FAIL;
+    }
+    sim_host_rate(line_of(port)->sim, baud_rate);
+    return ESP_LOADER_SUCCESS;
+}
+
+void port_deinit(port_t *port)
+{
+}
+
+bool port_sense(port_t *port)
+{
+    return true;
+}
+
+void port_reset_target(port_t *port)
+{
+    port_delay_ms(PORT_RESET_HOLD_TIME_MS);
+    sim_reset(line_of(port)->sim, false);
+}
+
+void port_enter_bootloader(port_t *port)
+{
+    port_delay_ms(PORT_RESET_HOLD_TIME_MS);
+    sim_reset(line_of(port)->sim, true);
+    port_delay_ms(PORT_BOOT_HOLD_TIME_MS);
+}
+
+esp_loader_error_t port_change_rate(port_t *port, uint32_t baud_rate)
+{
+    sim_host_rate(line_of(port)->sim, baud_rate);
+    port->baud_rate = baud_rate;
+    return ESP_LOADER_SUCCESS;
+}
+
+esp_loader_error_t port_write(port_t *port, const uint8_t *data, size_t size,
+                              uint32_t timeout)
+{
+    // The simulation paces the bytes, the socket is the TX buffer
+    TRACE_BEGIN("uart_tx");
+    while (size > 0) {
+        ssize_t n = write(line_of(port)->fd, data, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            break;
+        }
+        data += n;
+        size -= n;
+    }
+    TRACE_END("uart_tx");
+    return size == 0 ? ESP_LOADER_SUCCESS : ESP_LOADER_ERROR_FAIL;
+}
+
+esp_loader_error_t port_read(port_t *port, uint8_t *data, size_t size,
+                             uint32_t timeout)
+{
+    host_line_t *line = line_of(port);
+    int64_t deadline = esp_timer_get_time() + timeout * 1000LL;
+
+    while (size > 0) {
+        if (line->len > 0) {
+            size_t n = size < line->len ? size : line->len;
+            memcpy(data, line->buf + line->head, n);
+            line->head += n;
+            line->len -= n;
+            data += n;
+            size -= n;
+            continue;
+        }
+        int64_t remaining = (deadline - esp_timer_get_time()) / 1000;
+        struct pollfd pfd = {.fd = line->fd, .events = POLLIN};
+        if (remaining <= 0 || poll(&pfd, 1, remaining) == 0) {
+            return ESP_LOADER_ERROR_TIMEOUT;
+        }
+        ssize_t n = read(line->fd, line->buf, sizeof(line->buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return ESP_LOADER_ERROR_FAIL;
+        }
+        line->head = 0;
+        line->len = n;
+    }
+    return ESP_LOADER_SUCCESS;
+}
+
+void port_flush(port_t *port)
+{
+    host_line_t *line = line_of(port);
+    struct pollfd pfd = {.fd = line->fd, .events = POLLIN};
+
+    line->len = 0;
+    while (poll(&pfd, 1, 0) > 0 &&
+           read(line->fd, line->buf, sizeof(line->buf)) > 0) {
+    }
+}
+
+void port_start_timer(port_t *port, uint32_t ms)
+{
+    port->deadline = esp_timer_get_time() + ms * 1000LL;
+}
+
+uint32_t port_remaining_time(port_t *port)
+{
+    int64_t remaining = (port->deadline - esp_timer_get_time()) / 1000;
+    return remaining > 0 ? remaining : 0;
+}
+
+void port_delay_ms(uint32_t ms)
+{
+    vTaskDelay(pdMS_TO_TICKS(ms));
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include "sim.h"
+
+// port.h over a socket to a simulated target, uart_port of the config picks
+// the attached line
+#define PORT_HOST_LINES 3
+
+void port_host_attach(int uart_port, int fd, sim_t *sim);
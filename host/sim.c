@@ -0,0 +1,766 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "esp_log.h"
+#include "esp_rom_md5.h"
+#include "esp_timer.h"
+#include "sim.h"
+
+static const char *TAG = "sim";
+
+#define SLIP_END 0xC0
+#define SLIP_ESC 0xDB
+#define SLIP_ESC_END 0xDC
+#define SLIP_ESC_ESC 0xDD
+
+#define CMD_FLASH_BEGIN 0x02
+#define CMD_FLASH_DATA 0x03
+#define CMD_FLASH_END 0x04
+#define CMD_MEM_BEGIN 0x05
+#define CMD_MEM_END 0x06
+#define CMD_MEM_DATA 0x07
+#define CMD_SYNC 0x08
+#define CMD_READ_REG 0x0A
+#define CMD_SPI_SET_PARAMS 0x0B
+#define CMD_SPI_ATTACH 0x0D
+#define CMD_CHANGE_BAUDRATE 0x0F
+#define CMD_FLASH_DEFL_BEGIN 0x10
+#define CMD_FLASH_DEFL_DATA 0x11
+#define CMD_FLASH_DEFL_END 0x12
+#define CMD_SPI_FLASH_MD5 0x13
+#define CMD_ERASE_FLASH 0xD0
+#define CMD_ERASE_REGION 0xD1
+#define CMD_READ_FLASH 0xD2
+
+// Error codes of the ROM loader
+#define ERR_INVALID_MESSAGE 0x05
+#define ERR_FAILED 0x06
+#define ERR_INVALID_CRC 0x07
+#define ERR_FLASH_WRITE 0x08
+#define ERR_DEFLATE 0x0B
+// and of the stub, which checks a data packet before it takes it
+#define ERR_BAD_DATA_LEN 0xC0
+#define ERR_BAD_DATA_CHECKSUM 0xC1
+
+#define ROM_BAUDRATE 115200
+#define CHECKSUM_SEED 0xEF
+#define CHIP_DETECT_MAGIC_REG 0x40001000
+#define SYNC_ANSWERS 8
+#define FRAME_MAX (8 + 16 + 0x4000 + 64)
+#define SECTOR_SIZE 0x1000
+#define BLOCK_SIZE 0x10000
+#define PAGE_SIZE 0x100
+#define READ_PACKET_MAX 0x4000
+#define READ_BYTES_PER_US 20 // MD5 over the flash contents
+#define OVERSPEED_BER 1e-3
+#define POLL_MS 10
+
+typedef struct __attribute__((packed)) {
+    uint8_t direction;
+    uint8_t command;
+    uint16_t size;
+    uint32_t value;
+} header_t;
+
+struct sim {
+    sim_config_t config;
+    int fd;
+    pthread_t thread;
+    atomic_bool stop;
+    atomic_uint generation; // bumped by every reset
+    atomic_bool boot_loader;
+    atomic_uint host_baud;
+    uint8_t *flash;
+    sim_stats_t stats;
+
+    // Everything below is owned by the simulation thread
+    unsigned int seen_generation;
+    bool loader; // the loader runs, the application never answers
+    bool stub;
+    uint32_t baud;
+    uint64_t rng;
+    int64_t rx_clock; // when the last received byte ends on the line
+    int64_t busy_until; // the stub writes in the background
+
+    uint8_t frame[FRAME_MAX];
+    size_t len;
+    bool escaped;
+    bool overflow;
+
+    // Current FLASH_BEGIN or FLASH_DEFL_BEGIN
+    bool writing;
+    bool deflate;
+    uint32_t write_addr;
+    uint32_t write_size;
+    uint32_t block_size;
+    uint32_t erase_next; // erased up to here, the stub erases on the fly
+    uint32_t erase_end;
+    // Taken so far, the loaders do not check the sequence numbers
+    uint32_t written;
+    z_stream z;
+    bool z_active;
+
+    // Current READ_FLASH, the stub sends ahead up to inflight packets
+    bool reading;
+    uint32_t read_addr;
+    uint32_t read_size;
+    uint32_t packet_size;
+    uint32_t inflight;
+    uint32_t sent;
+    uint32_t acked;
+    md5_context_t read_md5;
+
+    uint8_t tx[2 * READ_PACKET_MAX + 2];
+};
+
+static const struct {
+    target_chip_t chip;
+    uint32_t magic;
+} chip_magic[] = {
+    {ESP32_CHIP, 0x00f01d83},
+    {ESP32S2_CHIP, 0x000007c6},
+    {ESP32S3_CHIP, 0x00000009},
+};
+
+void sim_config_default(sim_config_t *config)
+{
+    memset(config, 0, sizeof(sim_config_t));
+    config->chip = ESP32S3_CHIP;
+    config->flash_size = 4 * 1024 * 1024;
+    config->latency_us = 50;
+    config->sector_erase_us = 30000;
+    config->block_erase_us = 150000;
+    config->page_program_us = 400;
+    config->seed = 1;
+}
+
+static void sleep_until(int64_t us)
+{
+    int64_t now = esp_timer_get_time();
+    if (us <= now) {
+        return;
+    }
+    struct timespec ts = {
+        .tv_sec = (us - now) / 1000000,
+        .tv_nsec = (us - now) % 1000000 * 1000,
+    };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+}
+
+static int64_t byte_time(sim_t *sim, size_t bytes)
+{
+    // Start, eight data and stop bit
+    return (int64_t)bytes * 10 * 1000000 / sim->baud;
+}
+
+static uint64_t next_random(sim_t *sim)
+{
+    // xorshift64*
+    sim->rng ^= sim->rng >> 12;
+    sim->rng ^= sim->rng << 25;
+    sim->rng ^= sim->rng >> 27;
+    return sim->rng * 0x2545F4914F6CDD1DULL;
+}
+
+// What the other end samples of a byte sent at the rate of the simulation
+static uint8_t line(sim_t *sim, uint8_t c)
+{
+    if (atomic_load(&sim->host_baud) != sim->baud) {
+        return next_random(sim);
+    }
+    double ber = sim->config.ber;
+    if (sim->config.max_baud != 0 && sim->baud > sim->config.max_baud) {
+        ber = MAX(ber, OVERSPEED_BER);
+    }
+    if (ber > 0) {
+        for (int i = 0; i < 8; i++) {
+            if ((next_random(sim) >> 11) * 0x1.0p-53 < ber) {
+                c ^= 1 << i;
+            }
+        }
+    }
+    return c;
+}
+
+static void apply_reset(sim_t *sim)
+{
+    sim->seen_generation = atomic_load(&sim->generation);
+    sim->loader = atomic_load(&sim->boot_loader);
+    sim->stub = false;
+    sim->baud = ROM_BAUDRATE;
+    sim->len = 0;
+    sim->escaped = false;
+    sim->overflow = false;
+    sim->writing = false;
+    sim->reading = false;
+    sim->busy_until = 0;
+    if (sim->z_active) {
+        inflateEnd(&sim->z);
+        sim->z_active = false;
+    }
+}
+
+static bool reset_pending(sim_t *sim)
+{
+    return atomic_load(&sim->generation) != sim->seen_generation;
+}
+
+static void send_frame(sim_t *sim, const uint8_t *data, size_t size)
+{
+    uint8_t *buf = sim->tx;
+    size_t n = 0;
+
+    buf[n++] = SLIP_END;
+    for (size_t i = 0; i < size; i++) {
+        if (data[i] == SLIP_END) {
+            buf[n++] = SLIP_ESC;
+            buf[n++] = SLIP_ESC_END;
+        } else if (data[i] == SLIP_ESC) {
+            buf[n++] = SLIP_ESC;
+            buf[n++] = SLIP_ESC_ESC;
+        } else {
+            buf[n++] = data[i];
+        }
+    }
+    buf[n++] = SLIP_END;
+
+    // The answer reaches the host once its last byte left the line
+    sleep_until(esp_timer_get_time() + byte_time(sim, n));
+    if (reset_pending(sim)) {
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        buf[i] = line(sim, buf[i]);
+    }
+    if (write(sim->fd, buf, n) == n) {
+        sim->stats.tx_bytes += n;
+    }
+}
+
+static void respond(sim_t *sim, uint8_t cmd, uint32_t value,
+                    const uint8_t *data, size_t size, uint8_t error)
+{
+    uint8_t resp[sizeof(header_t) + 32 + 4];
+    // The stub answers with two status bytes, the ROM loaders with four
+    size_t status_len = sim->stub ? 2 : 4;
+    header_t *h = (header_t *)resp;
+
+    h->direction = 1;
+    h->command = cmd;
+    h->size = size + status_len;
+    h->value = value;
+    memcpy(resp + sizeof(header_t), data, size);
+    memset(resp + sizeof(header_t) + size, 0, status_len);
+    resp[sizeof(header_t) + size] = error != 0;
+    resp[sizeof(header_t) + size + 1] = error;
+
+    sleep_until(esp_timer_get_time() + sim->config.latency_us);
+    send_frame(sim, resp, sizeof(header_t) + size + status_len);
+}
+
+static int64_t erase_step(sim_t *sim, uint32_t *addr, uint32_t end)
+{
+    uint32_t size = SECTOR_SIZE;
+    int64_t cost = sim->config.sector_erase_us;
+    if (*addr % BLOCK_SIZE == 0 && end - *addr >= BLOCK_SIZE) {
+        size = BLOCK_SIZE;
+        cost = sim->config.block_erase_us;
+    }
+    memset(sim->flash + *addr, 0xff, size);
+    sim->stats.erased_sectors += size / SECTOR_SIZE;
+    *addr += size;
+    return cost;
+}
+
+// Erase what the next write up to end needs, the whole range for the ROM
+static int64_t erase_to(sim_t *sim, uint32_t end)
+{
+    int64_t cost = 0;
+    end = (end + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+    end = MIN(end, sim->erase_end);
+    while (sim->erase_next < end) {
+        cost += erase_step(sim, &sim->erase_next, sim->erase_end);
+    }
+    return cost;
+}
+
+// Program bits from one to zero like NOR flash, unerased data shows up in
+// the digests
+static int64_t program(sim_t *sim, uint32_t addr, const uint8_t *data,
+                       size_t size)
+{
+    int64_t cost = 0;
+    if (sim->stub) {
+        cost += erase_to(sim, addr + size);
+    }
+    for (size_t i = 0; i < size; i++) {
+        sim->flash[addr + i] &= data[i];
+    }
+    uint32_t pages =
+        (addr + size + PAGE_SIZE - 1) / PAGE_SIZE - addr / PAGE_SIZE;
+    return cost + pages * sim->config.page_program_us;
+}
+
+// Only the stub knows the command, it erases block by block
+static void erase_chip(sim_t *sim)
+{
+    uint32_t addr = 0;
+    int64_t cost = 0;
+    while (addr < sim->config.flash_size) {
+        cost += erase_step(sim, &addr, sim->config.flash_size);
+    }
+    sleep_until(esp_timer_get_time() + cost);
+}
+
+// Only the stub knows the command, both ends sector aligned
+static uint8_t erase_region(sim_t *sim, const uint32_t *params)
+{
+    uint32_t addr = params[0];
+    uint32_t end = addr + params[1];
+    if (addr % SECTOR_SIZE != 0 || params[1] % SECTOR_SIZE != 0 ||
+        end > sim->config.flash_size) {
+        return ERR_FAILED;
+    }
+    int64_t cost = 0;
+    while (addr < end) {
+        cost += erase_step(sim, &addr, end);
+    }
+    sleep_until(esp_timer_get_time() + cost);
+    return 0;
+}
+
+static void finish_write(sim_t *sim, int64_t cost)
+{
+    if (sim->stub) {
+        sim->busy_until = esp_timer_get_time() + cost;
+    } else {
+        sleep_until(esp_timer_get_time() + cost);
+    }
+}
+
+static uint8_t begin_write(sim_t *sim, const uint32_t *params, size_t size,
+                           bool deflate)
+{
+    uint32_t erase = params[0];
+    uint32_t addr = params[3];
+
+    if (size < 16 || addr % SECTOR_SIZE != 0 ||
+        addr + erase > sim->config.flash_size) {
+        return ERR_FAILED;
+    }
+    if (sim->z_active) {
+        inflateEnd(&sim->z);
+        sim->z_active = false;
+    }
+    if (deflate) {
+        memset(&sim->z, 0, sizeof(sim->z));
+        if (inflateInit(&sim->z) != Z_OK) {
+            return ERR_FAILED;
+        }
+        sim->z_active = true;
+    }
+    sim->writing = true;
+    sim->deflate = deflate;
+    sim->write_addr = addr;
+    sim->write_size = erase;
+    sim->block_size = params[2];
+    sim->written = 0;
+    sim->erase_next = addr;
+    sim->erase_end = (addr + erase + SECTOR_SIZE - 1) / SECTOR_SIZE *
+                     SECTOR_SIZE;
+    sim->erase_end = MIN(sim->erase_end, sim->config.flash_size);
+    if (!sim->stub) {
+        sleep_until(esp_timer_get_time() + erase_to(sim, sim->erase_end));
+    }
+    return 0;
+}
+
+static uint8_t write_data(sim_t *sim, const uint32_t *params,
+                          const uint8_t *data, size_t size)
+{
+    if (!sim->writing || sim->deflate) {
+        return ERR_FAILED;
+    }
+    uint32_t addr = sim->write_addr + sim->written;
+    if (addr + size > sim->config.flash_size) {
+        return ERR_FLASH_WRITE;
+    }
+    sim->written += size;
+    finish_write(sim, program(sim, addr, data, size));
+    return 0;
+}
+
+static uint8_t write_deflated(sim_t *sim, const uint32_t *params,
+                              const uint8_t *data, size_t size)
+{
+    uint8_t out[SECTOR_SIZE];
+    int64_t cost = 0;
+
+    if (!sim->writing || !sim->deflate) {
+        return ERR_FAILED;
+    }
+    sim->z.next_in = (Bytef *)data;
+    sim->z.avail_in = size;
+    while (sim->z.avail_in > 0) {
+        sim->z.next_out = out;
+        sim->z.avail_out = sizeof(out);
+        int ret = inflate(&sim->z, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            return ERR_DEFLATE;
+        }
+        size_t len = sizeof(out) - sim->z.avail_out;
+        uint32_t addr = sim->write_addr + sim->written;
+        if (addr + len > sim->config.flash_size) {
+            return ERR_FLASH_WRITE;
+        }
+        cost += program(sim, addr, out, len);
+        sim->written += len;
+        if (ret == Z_STREAM_END) {
+            break;
+        }
+    }
+    finish_write(sim, cost);
+    return 0;
+}
+
+static void flash_md5(sim_t *sim, const uint32_t *params)
+{
+    uint32_t addr = params[0];
+    uint32_t size = params[1];
+    if (addr + size > sim->config.flash_size) {
+        respond(sim, CMD_SPI_FLASH_MD5, 0, NULL, 0, ERR_FAILED);
+        return;
+    }
+    uint8_t digest[16];
+    md5_context_t md5;
+    esp_rom_md5_init(&md5);
+    esp_rom_md5_update(&md5, sim->flash + addr, size);
+    esp_rom_md5_final(digest, &md5);
+    sleep_until(esp_timer_get_time() + size / READ_BYTES_PER_US);
+
+    if (sim->stub) {
+        respond(sim, CMD_SPI_FLASH_MD5, 0, digest, sizeof(digest), 0);
+        return;
+    }
+    char hex[33];
+    for (int i = 0; i < 16; i++) {
+        snprintf(hex + i * 2, 3, "%02x", digest[i]);
+    }
+    respond(sim, CMD_SPI_FLASH_MD5, 0, (const uint8_t *)hex, 32, 0);
+}
+
+static uint8_t begin_read(sim_t *sim, const uint32_t *params)
+{
+    uint32_t addr = params[0];
+    uint32_t size = params[1];
+    if (!sim->stub) {
+        return ERR_INVALID_MESSAGE;
+    }
+    if (addr > sim->config.flash_size ||
+        size > sim->config.flash_size - addr || params[2] == 0 ||
+        params[2] > READ_PACKET_MAX || params[3] == 0) {
+        return ERR_FAILED;
+    }
+    sim->reading = true;
+    sim->read_addr = addr;
+    sim->read_size = size;
+    sim->packet_size = params[2];
+    sim->inflight = params[3];
+    sim->sent = 0;
+    sim->acked = 0;
+    esp_rom_md5_init(&sim->read_md5);
+    return 0;
+}
+
+// Whether the stub may send the next packet of a READ_FLASH
+static bool read_ready(sim_t *sim)
+{
+    return sim->reading && sim->sent < sim->read_size &&
+           sim->sent - sim->acked < sim->inflight * sim->packet_size;
+}
+
+static void send_read_packet(sim_t *sim)
+{
+    uint32_t size = MIN(sim->packet_size, sim->read_size - sim->sent);
+    const uint8_t *data = sim->flash + sim->read_addr + sim->sent;
+    sleep_until(esp_timer_get_time() + size / READ_BYTES_PER_US);
+    esp_rom_md5_update(&sim->read_md5, data, size);
+    sim->sent += size;
+    send_frame(sim, data, size);
+}
+
+// The host acknowledges the bytes it received so far, the digest follows
+// the last acknowledgement
+static void read_ack(sim_t *sim)
+{
+    uint32_t acked;
+    if (sim->len != sizeof(acked)) {
+        sim->stats.bad_frames++;
+        return;
+    }
+    memcpy(&acked, sim->frame, sizeof(acked));
+    sim->stats.frames++;
+    sim->acked = MAX(sim->acked, MIN(acked, sim->sent));
+    if (sim->acked == sim->read_size) {
+        uint8_t digest[16];
+        esp_rom_md5_final(digest, &sim->read_md5);
+        sim->reading = false;
+        send_frame(sim, digest, sizeof(digest));
+    }
+}
+
+static uint32_t read_reg(sim_t *sim, uint32_t addr)
+{
+    if (addr != CHIP_DETECT_MAGIC_REG) {
+        return 0;
+    }
+    for (int i = 0; i < sizeof(chip_magic) / sizeof(chip_magic[0]); i++) {
+        if (chip_magic[i].chip == sim->config.chip) {
+            return chip_magic[i].magic;
+        }
+    }
+    return 0;
+}
+
+static void handle_frame(sim_t *sim)
+{
+    if (sim->reading) {
+        read_ack(sim);
+        return;
+    }
+    const header_t *h = (const header_t *)sim->frame;
+    if (sim->overflow || sim->len < sizeof(header_t) || h->direction != 0 ||
+        h->size != sim->len - sizeof(header_t)) {
+        sim->stats.bad_frames++;
+        return;
+    }
+    // The request is complete once its last byte arrived, and the stub
+    // takes the next one once the previous write is done
+    sleep_until(MAX(sim->rx_clock, sim->busy_until));
+    if (reset_pending(sim)) {
+        return;
+    }
+    sim->stats.frames++;
+
+    uint32_t params[6] = {0};
+    const uint8_t *payload = sim->frame + sizeof(header_t);
+    memcpy(params, payload, MIN(h->size, sizeof(params)));
+    const uint8_t *data = payload + 16;
+    size_t data_size = h->size > 16 ? h->size - 16 : 0;
+    uint8_t checksum = CHECKSUM_SEED;
+    for (size_t i = 0; i < data_size; i++) {
+        checksum ^= data[i];
+    }
+    bool has_data = h->command == CMD_FLASH_DATA ||
+                    h->command == CMD_MEM_DATA ||
+                    h->command == CMD_FLASH_DEFL_DATA;
+    if (has_data && (checksum != (h->value & 0xff) ||
+                     params[0] != data_size)) {
+        sim->stats.bad_frames++;
+        uint8_t error = ERR_INVALID_CRC;
+        if (sim->stub) {
+            error = params[0] != data_size ? ERR_BAD_DATA_LEN
+                                           : ERR_BAD_DATA_CHECKSUM;
+        }
+        respond(sim, h->command, 0, NULL, 0, error);
+        return;
+    }
+
+    uint8_t cmd = h->command;
+    uint8_t error = 0;
+    uint32_t value = 0;
+    switch (cmd) {
+    case CMD_SYNC:
+        for (int i = 0; i < SYNC_ANSWERS - 1 && !sim->stub; i++) {
+            respond(sim, cmd, 0, NULL, 0, 0);
+        }
+        break;
+    case CMD_READ_REG:
+        value = read_reg(sim, params[0]);
+        break;
+    case CMD_SPI_ATTACH:
+    case CMD_SPI_SET_PARAMS:
+    case CMD_MEM_BEGIN:
+    case CMD_MEM_DATA:
+        break;
+    case CMD_MEM_END:
+        respond(sim, cmd, 0, NULL, 0, 0);
+        if (params[0] == 0) {
+            // Whatever was downloaded is the stub, it greets once started
+            sim->stub = true;
+            send_frame(sim, (const uint8_t *)"OHAI", 4);
+        }
+        return;
+    case CMD_CHANGE_BAUDRATE:
+        // Answer at the old rate, then switch
+        respond(sim, cmd, 0, NULL, 0, 0);
+        sim->baud = params[0];
+        return;
+    case CMD_FLASH_BEGIN:
+    case CMD_FLASH_DEFL_BEGIN:
+        error = begin_write(sim, params, h->size, cmd == CMD_FLASH_DEFL_BEGIN);
+        break;
+    case CMD_FLASH_DATA:
+        error = write_data(sim, params, data, data_size);
+        break;
+    case CMD_FLASH_DEFL_DATA:
+        error = write_deflated(sim, params, data, data_size);
+        break;
+    case CMD_FLASH_END:
+    case CMD_FLASH_DEFL_END:
+        sim->writing = false;
+        break;
+    case CMD_SPI_FLASH_MD5:
+        flash_md5(sim, params);
+        return;
+    case CMD_ERASE_FLASH:
+        if (!sim->stub) {
+            error = ERR_INVALID_MESSAGE;
+            break;
+        }
+        erase_chip(sim);
+        break;
+    case CMD_ERASE_REGION:
+        error = sim->stub ? erase_region(sim, params) : ERR_INVALID_MESSAGE;
+        break;
+    case CMD_READ_FLASH:
+        error = begin_read(sim, params);
+        break;
+    default:
+        error = ERR_INVALID_MESSAGE;
+        break;
+    }
+    respond(sim, cmd, value, NULL, 0, error);
+}
+
+static void receive(sim_t *sim, const uint8_t *buf, size_t size)
+{
+    int64_t now = esp_timer_get_time();
+    sim->rx_clock = MAX(sim->rx_clock, now);
+
+    for (size_t i = 0; i < size; i++) {
+        sim->rx_clock += byte_time(sim, 1);
+        uint8_t c = line(sim, buf[i]);
+        if (c == SLIP_END) {
+            if (sim->len > 0 || sim->overflow) {
+                handle_frame(sim);
+                if (reset_pending(sim)) {
+                    return; // drop the rest, it was sent before the reset
+                }
+            }
+            sim->len = 0;
+            sim->escaped = false;
+            sim->overflow = false;
+            continue;
+        }
+        if (sim->escaped) {
+            sim->escaped = false;
+            c = c == SLIP_ESC_END ? SLIP_END : c == SLIP_ESC_ESC ? SLIP_ESC : c;
+        } else if (c == SLIP_ESC) {
+            sim->escaped = true;
+            continue;
+        }
+        if (sim->len < sizeof(sim->frame)) {
+            sim->frame[sim->len++] = c;
+        } else {
+            sim->overflow = true;
+        }
+    }
+}
+
+static void *sim_main(void *arg)
+{
+    sim_t *sim = arg;
+    uint8_t buf[4096];
+
+    while (!atomic_load(&sim->stop)) {
+        if (reset_pending(sim)) {
+            apply_reset(sim);
+        }
+        while (read_ready(sim) && !reset_pending(sim)) {
+            send_read_packet(sim);
+        }
+        struct pollfd pfd = {.fd = sim->fd, .events = POLLIN};
+        if (poll(&pfd, 1, POLL_MS) <= 0) {
+            continue;
+        }
+        ssize_t n = read(sim->fd, buf, sizeof(buf));
+        if (n <= 0) {
+            break; // the host closed its end
+        }
+        sim->stats.rx_bytes += n;
+        if (sim->loader && !reset_pending(sim)) {
+            receive(sim, buf, n);
+        }
+    }
+    return NULL;
+}
+
+sim_t *sim_start(const sim_config_t *config, int fd)
+{
+    sim_t *sim = calloc(1, sizeof(sim_t));
+    if (sim == NULL) {
+        return NULL;
+    }
+    sim->config = *config;
+    sim->fd = fd;
+    sim->baud = ROM_BAUDRATE;
+    sim->rng = config->seed ? config->seed : 1;
+    atomic_init(&sim->host_baud, ROM_BAUDRATE);
+    sim->flash = malloc(config->flash_size);
+    if (sim->flash == NULL) {
+        free(sim);
+        return NULL;
+    }
+    memset(sim->flash, 0xff, config->flash_size);
+    if (pthread_create(&sim->thread, NULL, sim_main, sim) != 0) {
+        ESP_LOGE(TAG, "Cannot start the simulation thread");
+        free(sim->flash);
+        free(sim);
+        return NULL;
+    }
+    return sim;
+}
+
+void sim_stop(sim_t *sim)
+{
+    atomic_store(&sim->stop, true);
+    pthread_join(sim->thread, NULL);
+    if (sim->z_active) {
+        inflateEnd(&sim->z);
+    }
+    free(sim->flash);
+    free(sim);
+}
+
+void sim_reset(sim_t *sim, bool bootloader)
+{
+    atomic_store(&sim->boot_loader, bootloader);
+    atomic_fetch_add(&sim->generation, 1);
+}
+
+void sim_host_rate(sim_t *sim, uint32_t baud_rate)
+{
+    atomic_store(&sim->host_baud, baud_rate);
+}
+
+const uint8_t *sim_flash(sim_t *sim)
+{
+    return sim->flash;
+}
+
+void sim_get_stats(sim_t *sim, sim_stats_t *stats)
+{
+    *stats = sim->stats;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_loader.h"
+
+// Simulated target on the other end of a socket: the serial ROM loader and,
+// once any code is downloaded and started, the flasher stub. It keeps the
+// whole flash in memory and paces every byte to the line rate.
+
+typedef struct {
+    target_chip_t chip; // ESP32, ESP32-S2 or ESP32-S3
+    uint32_t flash_size;
+    uint32_t latency_us; // turnaround of every command
+    double ber;          // bit error rate of the line
+    uint32_t max_baud;   // the line errs above this rate, 0 for none
+    uint32_t sector_erase_us;
+    uint32_t block_erase_us; // 64 KiB aligned blocks
+    uint32_t page_program_us;
+    uint64_t seed;
+} sim_config_t;
+
+typedef struct {
+    uint32_t frames;     // requests answered
+    uint32_t bad_frames; // dropped or refused for a length or checksum error
+    uint64_t rx_bytes;
+    uint64_t tx_bytes;
+    uint32_t erased_sectors;
+} sim_stats_t;
+
+typedef struct sim sim_t;
+
+void sim_config_default(sim_config_t *config);
+
+sim_t *sim_start(const sim_config_t *config, int fd);
+void sim_stop(sim_t *sim);
+
+// Pulse the reset pin, with IO0 low the target starts its serial loader,
+// otherwise the application which never answers
+void sim_reset(sim_t *sim, bool bootloader);
+// The rate the other end of the line uses, bytes garble on a mismatch
+void sim_host_rate(sim_t *sim, uint32_t baud_rate);
+
+const uint8_t *sim_flash(sim_t *sim);
+void sim_get_stats(sim_t *sim, sim_stats_t *stats);
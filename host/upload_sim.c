@@ -0,0 +1,198 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "cJSON.h"
+#include "esp_log.h"
+#include "esp_rom_md5.h"
+#include "partition_host.h"
+#include "store.h"
+#include "upload.h"
+
+// Stand-in for the CDC port of the device on a pty, for tools/upload.py. The
+// line "upload" starts a session of upload.c into an "images" partition kept
+// in memory, like the console command of the device. After every committed
+// session each file of the job is read back and checked against its digest.
+
+#define JOB_NAME "flasher_args.json"
+
+static size_t pty_read(void *ctx, uint8_t *buf, size_t size,
+                       uint32_t timeout_ms)
+{
+    struct pollfd pfd = {.fd = *(int *)ctx, .events = POLLIN};
+    if (poll(&pfd, 1, timeout_ms) <= 0) {
+        return 0;
+    }
+    ssize_t n = read(pfd.fd, buf, size);
+    return n > 0 ? n : 0;
+}
+
+static void pty_write(void *ctx, const uint8_t *buf, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = write(*(int *)ctx, buf, size);
+        if (n <= 0) {
+            return;
+        }
+        buf += n;
+        size -= n;
+    }
+}
+
+static bool check_file(const char *name)
+{
+    const store_entry_t *e = store_find(name);
+    uint8_t *buf = e != NULL ? malloc(e->size + 1) : NULL;
+    bool ok = buf != NULL && store_read(e, 0, buf, e->size) == ESP_OK;
+    if (ok) {
+        uint8_t digest[16];
+        md5_context_t ctx;
+        esp_rom_md5_init(&ctx);
+        esp_rom_md5_update(&ctx, buf, e->size);
+        esp_rom_md5_final(digest, &ctx);
+        ok = memcmp(digest, e->md5, sizeof(digest)) == 0;
+    }
+    printf("  %-40s %8ld %s\n", name, e != NULL ? e->size : 0,
+           ok ? "ok" : "BAD");
+    free(buf);
+    return ok;
+}
+
+// Every file of the committed job reads back with its digest
+static bool check_store(void)
+{
+    const store_entry_t *job = store_find(JOB_NAME);
+    if (job == NULL || !check_file(JOB_NAME)) {
+        return false;
+    }
+    char *json = malloc(job->size + 1);
+    if (json == NULL || store_read(job, 0, json, job->size) != ESP_OK) {
+        free(json);
+        return false;
+    }
+    json[job->size] = '\0';
+    cJSON *root = cJSON_Parse(json);
+    free(json);
+    const cJSON *files = cJSON_GetObjectItem(root, "flash_files");
+    bool ok = files != NULL;
+    for (const cJSON *i = ok ? files->child : NULL; i != NULL; i = i->next) {
+        ok &= check_file(i->valuestring);
+    }
+    cJSON_Delete(root);
+    return ok;
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [options]\n"
+           "  -s, --size BYTES      size of the images partition (0x170000)\n"
+           "  -n, --sessions N      exit after N sessions, 0 serves on (0)\n"
+           "  -v, --verbose         log the sessions\n"
+           "Prints the pty to pass to tools/upload.py -p, then a line per "
+           "session.\n",
+           name);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] = {
+        {"size", required_argument, NULL, 's'},
+        {"sessions", required_argument, NULL, 'n'},
+        {"verbose", no_argument, NULL, 'v'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    uint32_t size = 0x170000;
+    int sessions = 0;
+    int c;
+    while ((c = getopt_long(argc, argv, "s:n:vh", long_options, NULL)) !=
+           -1) {
+        switch (c) {
+        case 's':
+            size = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            sessions = atoi(optarg);
+            break;
+        case 'v':
+            esp_log_level = ESP_LOG_INFO;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (partition_host_add(ESP_PARTITION_TYPE_DATA, STORE_PARTITION_SUBTYPE,
+                           STORE_PARTITION_LABEL, size) == NULL ||
+        !store_init()) {
+        fprintf(stderr, "Cannot create the partition\n");
+        return 1;
+    }
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+        perror("pty");
+        return 1;
+    }
+    // Held open so the master does not hang up between clients
+    const char *slave = ptsname(master);
+    int hold = open(slave, O_RDWR | O_NOCTTY);
+    struct termios t;
+    if (hold < 0 || tcgetattr(hold, &t) != 0) {
+        perror(slave);
+        return 1;
+    }
+    cfmakeraw(&t);
+    tcsetattr(hold, TCSANOW, &t);
+    printf("%s\n", slave);
+    fflush(stdout);
+
+    const upload_port_t port = {
+        .read = pty_read,
+        .write = pty_write,
+        .ctx = &master,
+    };
+    char line[256];
+    size_t len = 0;
+    int served = 0;
+    int failed = 0;
+    while (sessions == 0 || served < sessions) {
+        uint8_t ch;
+        if (pty_read(&master, &ch, 1, 1000) == 0) {
+            continue;
+        }
+        // The console of the device, one command per line
+        if (ch != '\r' && ch != '\n') {
+            if (len < sizeof(line) - 1) {
+                line[len++] = ch;
+            }
+            continue;
+        }
+        if (len == 0) {
+            continue;
+        }
+        line[len] = '\0';
+        len = 0;
+        if (strcmp(line, "upload") != 0) {
+            dprintf(master, "Unknown command \"%s\", try \"help\"\n", line);
+            continue;
+        }
+        served++;
+        if (upload_serve(&port)) {
+            printf("session %d: committed\n", served);
+            failed += !check_store();
+        } else {
+            printf("session %d: dropped\n", served);
+        }
+        fflush(stdout);
+    }
+    close(hold);
+    close(master);
+    return failed > 0;
+}
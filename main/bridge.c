@@ -0,0 +1,215 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <sys/param.h>
+
+#include "bridge.h"
+#include "driver/gpio.h"
+#include "driver/uart.h"
+#include "esp_console.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "tusb.h"
+#include "tusb_cdc_acm.h"
+#include "usb.h"
+
+static const char *TAG = "bridge";
+
+#define BRIDGE_ITF TINYUSB_CDC_ACM_0
+#define BRIDGE_UART CONFIG_FLASH_UART_PORT_NUM
+#define BRIDGE_CHUNK_SIZE 1024
+#define BRIDGE_POLL_MS 20
+#define BRIDGE_WRITE_MS 100
+#define BRIDGE_TASK_STACK 3072
+
+static bool (*begin_cb)(void) = NULL;
+static void (*end_cb)(void) = NULL;
+
+static volatile bool active = false;
+static uint64_t to_target = 0;
+static uint64_t to_host = 0;
+static uint32_t rates = 0; // rate changes of the session
+static TaskHandle_t forwarder = NULL;
+static SemaphoreHandle_t forwarder_done = NULL;
+
+// On the tinyusb task, which must not wait for the UART
+static void cdc_rx_callback(int itf, cdcacm_event_t *event)
+{
+    xTaskNotifyGive(forwarder);
+}
+
+// Host to target. Only what fits the TX ring of the UART is taken from the
+// CDC FIFO, the rest waits there and the host is held off while it is full.
+static void forward_task(void *arg)
+{
+    uint8_t buf[BRIDGE_CHUNK_SIZE];
+    while (active) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(BRIDGE_POLL_MS));
+        size_t n;
+        do {
+            size_t room = 0;
+            uart_get_tx_buffer_free_size(BRIDGE_UART, &room);
+            n = 0;
+            if (room > 0 &&
+                tinyusb_cdcacm_read(BRIDGE_ITF, buf, MIN(room, sizeof(buf)),
+                                    &n) == ESP_OK &&
+                n > 0) {
+                uart_write_bytes(BRIDGE_UART, buf, n);
+                to_target += n;
+            }
+        } while (n > 0 && active);
+    }
+    xSemaphoreGive(forwarder_done);
+    vTaskDelete(NULL);
+}
+
+static void set_rate(uint32_t baud)
+{
+    uint32_t current = 0;
+    if (baud == 0 || (uart_get_baudrate(BRIDGE_UART, &current) == ESP_OK &&
+                      current == baud)) {
+        return;
+    }
+    // The reply to the rate change of esptool still goes out at the old rate
+    uart_wait_tx_done(BRIDGE_UART, pdMS_TO_TICKS(BRIDGE_WRITE_MS));
+    uart_set_baudrate(BRIDGE_UART, baud);
+    rates++;
+}
+
+static void cdc_line_coding_callback(int itf, cdcacm_event_t *event)
+{
+    set_rate(event->line_coding_changed_data.p_line_coding->bit_rate);
+}
+
+// The auto reset circuit of the dev boards: RTS alone pulls EN low, DTR alone
+// pulls IO0 low, both or none leave the target running
+static void line_state(bool dtr, bool rts)
+{
+    gpio_set_level(CONFIG_FLASH_UART_RESET_GPIO, !(rts && !dtr));
+    gpio_set_level(CONFIG_FLASH_UART_IO0_GPIO, !(dtr && !rts));
+}
+
+static void cdc_write(const uint8_t *buf, size_t size)
+{
+    while (size > 0) {
+        size_t n = tinyusb_cdcacm_write_queue(BRIDGE_ITF, buf, size);
+        esp_err_t err = tinyusb_cdcacm_write_flush(
+            BRIDGE_ITF, pdMS_TO_TICKS(BRIDGE_WRITE_MS));
+        if (n == 0 && err != ESP_OK) {
+            return; // nobody reads the port
+        }
+        buf += n;
+        size -= n;
+    }
+}
+
+static int log_mute(const char *fmt, va_list args)
+{
+    return 0;
+}
+
+static int bridge_cmd(int argc, char **argv)
+{
+    if (begin_cb != NULL && !begin_cb()) {
+        printf("Flashing or uploading, try again later\n");
+        return 1;
+    }
+    uint32_t baud = 0;
+    uart_get_baudrate(BRIDGE_UART, &baud);
+    printf("Bridging to UART%d, click the button to leave\n", BRIDGE_UART);
+    fflush(stdout);
+
+    cdc_line_coding_t coding;
+    tud_cdc_n_get_line_coding(BRIDGE_ITF, &coding);
+    to_target = 0;
+    to_host = 0;
+    rates = 0;
+    set_rate(coding.bit_rate);
+    uart_flush_input(BRIDGE_UART);
+    int64_t start = esp_timer_get_time();
+
+    // Anything but the target's bytes would confuse esptool
+    vprintf_like_t log = esp_log_set_vprintf(log_mute);
+    active = true;
+    if (forwarder_done == NULL ||
+        xTaskCreate(forward_task, "bridge", BRIDGE_TASK_STACK, NULL,
+                    uxTaskPriorityGet(NULL), &forwarder) != pdPASS) {
+        active = false;
+        esp_log_set_vprintf(log);
+        ESP_LOGE(TAG, "Cannot create the bridge task");
+        if (end_cb != NULL) {
+            end_cb();
+        }
+        return 1;
+    }
+    usb_line_state_hook(line_state);
+    tinyusb_cdcacm_register_callback(BRIDGE_ITF, CDC_EVENT_LINE_CODING_CHANGED,
+                                     cdc_line_coding_callback);
+    tinyusb_cdcacm_register_callback(BRIDGE_ITF, CDC_EVENT_RX,
+                                     cdc_rx_callback);
+
+    // Target to host, the first byte wakes the task and the rest of the
+    // burst goes in one chunk
+    uint8_t buf[BRIDGE_CHUNK_SIZE];
+    while (active) {
+        int n = uart_read_bytes(BRIDGE_UART, buf, 1,
+                                pdMS_TO_TICKS(BRIDGE_POLL_MS));
+        if (n <= 0) {
+            continue;
+        }
+        size_t more = 0;
+        uart_get_buffered_data_len(BRIDGE_UART, &more);
+        if (more > 0) {
+            int m = uart_read_bytes(BRIDGE_UART, buf + 1,
+                                    MIN(more, sizeof(buf) - 1), 0);
+            n += MAX(m, 0);
+        }
+        cdc_write(buf, n);
+        to_host += n;
+    }
+
+    tinyusb_cdcacm_unregister_callback(BRIDGE_ITF, CDC_EVENT_RX);
+    tinyusb_cdcacm_unregister_callback(BRIDGE_ITF,
+                                       CDC_EVENT_LINE_CODING_CHANGED);
+    xSemaphoreTake(forwarder_done, portMAX_DELAY);
+    forwarder = NULL;
+    usb_line_state_hook(NULL);
+    esp_log_set_vprintf(log);
+
+    // Leave the port as the flashing expects it
+    uart_wait_tx_done(BRIDGE_UART, pdMS_TO_TICKS(BRIDGE_WRITE_MS));
+    uart_set_baudrate(BRIDGE_UART, baud);
+    uart_flush_input(BRIDGE_UART);
+    line_state(false, false);
+    ESP_LOGI(TAG, "Bridge closed after %lld ms, %lld KiB to the target, %lld "
+             "KiB to the host, %ld rate change(s)",
+             (esp_timer_get_time() - start) / 1000, to_target / 1024,
+             to_host / 1024, rates);
+    if (end_cb != NULL) {
+        end_cb();
+    }
+    return 0;
+}
+
+void bridge_init(bool (*begin)(void), void (*end)(void))
+{
+    begin_cb = begin;
+    end_cb = end;
+    forwarder_done = xSemaphoreCreateBinary();
+    const esp_console_cmd_t cmd = {
+        .command = "bridge",
+        .help = "Forward the CDC port to the target of the first channel for "
+                "esptool.py, click the button to leave",
+        .func = bridge_cmd,
+    };
+    esp_console_cmd_register(&cmd);
+}
+
+bool bridge_stop(void)
+{
+    bool was_active = active;
+    active = false;
+    return was_active;
+}
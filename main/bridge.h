@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdbool.h>
+
+// esptool.py on the PC talks to the target of the first channel through the
+// CDC port. The console command "bridge" forwards the bytes both ways, drives
+// the reset and boot pins from DTR and RTS like the usual auto reset circuit
+// and follows the baud rate the host sets, until bridge_stop().
+
+// begin tells whether the port may be taken now, end follows the session
+void bridge_init(bool (*begin)(void), void (*end)(void));
+// Ends the session, false if none runs
+bool bridge_stop(void);
@@ -0,0 +1,62 @@
+#include <stdio.h>
+
+#include "console.h"
+#include "esp_console.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+static const char *TAG = "console";
+
+#define CONSOLE_LINE_MAX 256
+#define CONSOLE_POLL_MS 20
+
+static void console_task(void *arg)
+{
+    char line[CONSOLE_LINE_MAX];
+    size_t len = 0;
+
+    // The console may not block, poll it instead of waiting in fgets()
+    setvbuf(stdin, NULL, _IONBF, 0);
+    while (1) {
+        int c = fgetc(stdin);
+        if (c == EOF) {
+            clearerr(stdin);
+            vTaskDelay(pdMS_TO_TICKS(CONSOLE_POLL_MS));
+            continue;
+        }
+        if (c != '\r' && c != '\n') {
+            if (len < sizeof(line) - 1) {
+                line[len++] = c;
+            }
+            continue;
+        }
+        if (len == 0) {
+            continue;
+        }
+        line[len] = '\0';
+        len = 0;
+
+        int ret;
+        esp_err_t err = esp_console_run(line, &ret);
+        if (err == ESP_ERR_NOT_FOUND) {
+            printf("Unknown command \"%s\", try \"help\"\n", line);
+        } else if (err == ESP_OK && ret != 0) {
+            printf("Command failed: %d\n", ret);
+        }
+        fflush(stdout);
+    }
+}
+
+void console_init(void)
+{
+    const esp_console_config_t config = ESP_CONSOLE_CONFIG_DEFAULT();
+    if (esp_console_init(&config) != ESP_OK) {
+        ESP_LOGE(TAG, "Console initialization failed");
+        return;
+    }
+    esp_console_register_help_command();
+    if (xTaskCreate(console_task, "console", 4096, NULL, 2, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Cannot create console task");
+    }
+}
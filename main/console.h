@@ -0,0 +1,7 @@
+#pragma once
+
+// Commands read line by line from the console, which is the CDC port when
+// enabled. Modules add theirs with esp_console_cmd_register() once
+// console_init() returned.
+
+void console_init(void);
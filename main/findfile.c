@@ -7,10 +7,14 @@
 #include <sys/stat.h>
 
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "findfile.h"
+#include "trace.h"
 
 static const char *TAG = "findfile";
 
+#if CONFIG_FLASH_FIND_VERBOSE
+// List the whole tree with the size of every file, the first match wins
 static char *_findfile(const char *dir, const char *fname, size_t *size,
                        char **find_dir, int indent)
 {
@@ -28,6 +32,10 @@ static char *_findfile(const char *dir, const char *fname, size_t *size,
         return NULL;
     }
     while ((d = readdir(dh)) != NULL) {
+        // FAT never lists these, other file systems of the host build do
+        if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) {
+            continue;
+        }
         char *path = malloc(strlen(dir) + strlen(d->d_name) + 2);
         if (path != NULL) {
             strcpy(path, dir);
@@ -70,17 +78,160 @@ static char *_findfile(const char *dir, const char *fname, size_t *size,
     closedir(dh);
     return find;
 }
+#else
+// A directory waiting for the walk
+typedef struct node {
+    struct node *next;
+    int depth;
+    char path[];
+} node_t;
+
+static char *join(const char *dir, const char *name)
+{
+    char *path = malloc(strlen(dir) + strlen(name) + 2);
+    if (path != NULL) {
+        sprintf(path, "%s/%s", dir, name);
+    }
+    return path;
+}
+
+// Whether the directory holds the file, its path is returned then
+static char *probe(const char *dir, const char *fname, size_t *size)
+{
+    char *path = join(dir, fname);
+    struct stat st;
+    if (path != NULL && stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+        *size = st.st_size;
+        return path;
+    }
+    free(path);
+    return NULL;
+}
+
+static node_t *node_new(const char *dir, const char *name, int depth)
+{
+    node_t *node = malloc(sizeof(node_t) + strlen(dir) + strlen(name) + 2);
+    if (node != NULL) {
+        node->next = NULL;
+        node->depth = depth;
+        if (*name != '\0') {
+            sprintf(node->path, "%s/%s", dir, name);
+        } else {
+            strcpy(node->path, dir);
+        }
+    }
+    return node;
+}
 
-findfile_t *findfile(const char *dir, const char *fname)
+// Breadth first down to CONFIG_FLASH_FIND_DEPTH, only the names of the
+// entries are looked at until the file turns up
+static char *walk(const char *dir, const char *fname, size_t *size,
+                  char **find_dir, int *dirs)
+{
+    char *find = NULL;
+    node_t *head = node_new(dir, "", 0);
+    node_t *tail = head;
+
+    while (head != NULL && find == NULL) {
+        node_t *node = head;
+        DIR *dh = opendir(node->path);
+        if (dh == NULL) {
+            if (node->depth == 0) {
+                ESP_LOGE(TAG, "Unable to read directory %s", dir);
+            }
+        } else {
+            (*dirs)++;
+            struct dirent *d;
+            while (find == NULL && (d = readdir(dh)) != NULL) {
+                if (d->d_type == DT_REG && strcmp(d->d_name, fname) == 0) {
+                    find = probe(node->path, fname, size);
+                } else if (d->d_type == DT_DIR &&
+                           node->depth < CONFIG_FLASH_FIND_DEPTH &&
+                           strcmp(d->d_name, ".") != 0 &&
+                           strcmp(d->d_name, "..") != 0) {
+                    node_t *sub = node_new(node->path, d->d_name,
+                                           node->depth + 1);
+                    if (sub != NULL) {
+                        tail->next = sub;
+                        tail = sub;
+                    }
+                }
+            }
+            closedir(dh);
+        }
+        if (find != NULL) {
+            *find_dir = node->depth == 0 ? (char *)dir : strdup(node->path);
+        }
+        head = node->next;
+        free(node);
+    }
+    while (head != NULL) {
+        node_t *node = head;
+        head = node->next;
+        free(node);
+    }
+    return find;
+}
+
+// The directory of the last job, then CONFIG_FLASH_FIND_DIRS
+static char *known(const char *dir, const char *fname, const char *hint,
+                   size_t *size, char **find_dir)
+{
+    char *find = NULL;
+    if (hint != NULL && (find = probe(hint, fname, size)) != NULL) {
+        *find_dir = strcmp(hint, dir) == 0 ? (char *)dir : strdup(hint);
+        return find;
+    }
+    const char *str = CONFIG_FLASH_FIND_DIRS;
+    while (*str != '\0') {
+        size_t len = strcspn(str, ",");
+        if (len > 0) {
+            char name[len + 1];
+            memcpy(name, str, len);
+            name[len] = '\0';
+            char *path = join(dir, name);
+            if (path != NULL && (find = probe(path, fname, size)) != NULL) {
+                *find_dir = path;
+                return find;
+            }
+            free(path);
+        }
+        str += len + (str[len] == ',');
+    }
+    return NULL;
+}
+#endif
+
+findfile_t *findfile(const char *dir, const char *fname, const char *hint)
 {
     size_t size;
     char *find_dir = NULL;
+    int64_t start = esp_timer_get_time();
+    TRACE_BEGIN("findfile");
+#if CONFIG_FLASH_FIND_VERBOSE
     ESP_LOGI(TAG, "List file(s):");
     char *find = _findfile(dir, fname, &size, &find_dir, 0);
+    (void)hint;
+#else
+    int dirs = 0;
+    char *find = known(dir, fname, hint, &size, &find_dir);
     if (find == NULL) {
+        find = walk(dir, fname, &size, &find_dir, &dirs);
+    }
+#endif
+    int64_t elapsed = (esp_timer_get_time() - start) / 1000;
+    if (find == NULL || find_dir == NULL) {
+        ESP_LOGW(TAG, "No \"%s\" in \"%s\" (%lld ms)", fname, dir, elapsed);
+        free(find);
+        TRACE_END("findfile");
         return NULL;
     }
-    ESP_LOGI(TAG, "Found \"%s\" %d bytes", find, size);
+#if CONFIG_FLASH_FIND_VERBOSE
+    ESP_LOGI(TAG, "Found \"%s\" %d bytes in %lld ms", find, size, elapsed);
+#else
+    ESP_LOGI(TAG, "Found \"%s\" %d bytes in %lld ms, %d dir(s) scanned", find,
+             size, elapsed, dirs);
+#endif
     bool failed = true;
     findfile_t *ff = malloc(sizeof(findfile_t));
     if (ff != NULL) {
@@ -113,5 +264,6 @@ findfile_t *findfile(const char *dir, const char *fname)
             free(find_dir);
         }
     }
+    TRACE_END("findfile");
     return ff;
 }
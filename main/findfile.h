@@ -8,4 +8,6 @@ typedef struct {
     char *dir;
 } findfile_t;
 
-findfile_t *findfile(const char *dir, const char *fname);
+// Find fname in dir or below, hint is a directory to look first, may be NULL.
+// The dir of the result is dir itself or allocated.
+findfile_t *findfile(const char *dir, const char *fname, const char *hint);
@@ -3,169 +3,1615 @@
 #include <string.h>
 #include <sys/param.h>
 
-#include "esp32_port.h"
 #include "esp_err.h"
+#include "esp_heap_caps.h"
 #include "esp_loader.h"
-#include "esp_loader_io.h"
 #include "esp_log.h"
+#include "esp_rom_md5.h"
+#include "esp_timer.h"
 #include "flash.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "metrics.h"
+#include "port.h"
+#include "proto.h"
+#include "stub.h"
+#include "trace.h"
 
 static const char *TAG = "flash";
 
-// #define HIGHER_BAUDRATE 230400
-#define HIGHER_BAUDRATE 0
+#define FLASH_BLOCK_SIZE_MIN 0x400
+#define FLASH_SECTOR_SIZE 0x1000
 
-static esp_loader_error_t connect_to_target(uint32_t higher_transmission_rate)
+// flash_diff() erases and writes from the region starts
+_Static_assert(CONFIG_FLASH_DIFF_REGION_SIZE % FLASH_SECTOR_SIZE == 0,
+               "FLASH_DIFF_REGION_SIZE must be a multiple of 0x1000");
+
+#define ROM_BAUDRATE 115200
+#define BAUDRATE_LADDER_MAX 8
+#define PROBE_SIZE 0x400
+
+#define FLASH_TASK_STACK 6144
+#define FLASH_TASK_PRIORITY 5
+#define FLASH_FLASH_SIZE_DEFAULT (16 * 1024 * 1024)
+
+#define AUTO_SETTLE_MS 100
+#define AUTO_REMOVE_MISSES 2
+
+#define READ_PACKET_SIZE 0x800
+// Packets the stub sends ahead of the acks. The UART has no hardware flow
+// control, so their frames must fit the RX buffer of the port.
+#define READ_INFLIGHT 2
+#if CONFIG_FLASH_READBACK
+#define BOOTLOADER_MAGIC 0xE9
+#endif
+
+// Everything a channel touches while flashing lives here, channels only share
+// the read-only flash_args_t
+typedef struct {
+    int id;
+    char tag[12];
+    port_t port;
+    proto_t proto;
+    TaskHandle_t task;
+    bool success;
+    uint32_t units; // targets flashed in auto mode
+
+    // Highest rate the next cycle tries, 0 for the whole ladder. It drops a
+    // rung when a rate fails the probe or a write has to be resumed, and
+    // rises one again after FLASH_BAUDRATE_RETRY_CYCLES clean cycles.
+    uint32_t rate_cap;
+    uint32_t clean_cycles;
+    uint32_t current_rate;
+
+    // Bytes per FLASH_DATA packet of the current session
+    uint32_t block_size;
+
+    // Image bytes sent to or skipped on the target during the current session
+    size_t bytes_written;
+    size_t bytes_skipped;
+
+    // Cleared for the session once the loader rejects compressed writes
+    bool deflate_supported;
+
+    // Erase strategy of the current session and the time the writes waited
+    // for erasing
+    flash_erase_t erase;
+    int64_t erase_us;
+
+    // Job of the current session, a resumed write reconnects with it
+    const flash_args_t *args;
+    // Bytes of the current write the loader took, and whether a packet
+    // failed after its begin
+    size_t acked;
+    bool interrupted;
+    // A resumed write finds the rest of its range erased still
+    bool resumed;
+    // Packets sent again and writes resumed after a reconnect this session
+    uint32_t retries;
+    uint32_t resumes;
+
+    int progress;
+} channel_t;
+
+static const port_config_t port_configs[] = {
+    {
+        .uart_port = CONFIG_FLASH_UART_PORT_NUM,
+        .rx_pin = CONFIG_FLASH_UART_RX_GPIO,
+        .tx_pin = CONFIG_FALSH_UART_TX_GPIO,
+        .reset_pin = CONFIG_FLASH_UART_RESET_GPIO,
+        .io0_pin = CONFIG_FLASH_UART_IO0_GPIO,
+        .sense_pin = CONFIG_FLASH_UART_SENSE_GPIO,
+    },
+#if CONFIG_FLASH_CHANNELS >= 2
+    {
+        .uart_port = CONFIG_FLASH_UART2_PORT_NUM,
+        .rx_pin = CONFIG_FLASH_UART2_RX_GPIO,
+        .tx_pin = CONFIG_FLASH_UART2_TX_GPIO,
+        .reset_pin = CONFIG_FLASH_UART2_RESET_GPIO,
+        .io0_pin = CONFIG_FLASH_UART2_IO0_GPIO,
+        .sense_pin = CONFIG_FLASH_UART2_SENSE_GPIO,
+    },
+#endif
+#if CONFIG_FLASH_CHANNELS >= 3
+    {
+        .uart_port = CONFIG_FLASH_UART3_PORT_NUM,
+        .rx_pin = CONFIG_FLASH_UART3_RX_GPIO,
+        .tx_pin = CONFIG_FLASH_UART3_TX_GPIO,
+        .reset_pin = CONFIG_FLASH_UART3_RESET_GPIO,
+        .io0_pin = CONFIG_FLASH_UART3_IO0_GPIO,
+        .sense_pin = CONFIG_FLASH_UART3_SENSE_GPIO,
+    },
+#endif
+};
+
+#define CHANNELS (sizeof(port_configs) / sizeof(port_configs[0]))
+
+static channel_t channels[CHANNELS];
+
+// The job every channel runs when notified
+static struct {
+    flash_args_t *args;
+    flash_cb_t cb;
+    bool auto_mode;
+    bool verify;
+    volatile bool stop;
+    SemaphoreHandle_t finished;
+} job;
+
+// A target already synced by the auto mode probe skips the reset
+static esp_loader_error_t connect_to_target(channel_t *ch, bool synced)
 {
-    esp_loader_connect_args_t connect_config = ESP_LOADER_CONNECT_DEFAULT();
+    esp_loader_error_t err = synced ? proto_attach(&ch->proto)
+                                    : proto_connect(&ch->proto, &ch->port);
+    if (err != ESP_LOADER_SUCCESS) {
+        ESP_LOGE(ch->tag, "Cannot connect to target. Error: %u", err);
+        return err;
+    }
+    ESP_LOGI(ch->tag, "Connected to target");
+    return ESP_LOADER_SUCCESS;
+}
 
-    esp_loader_error_t err = esp_loader_connect(&connect_config);
+// Connect at the ROM rate and, when enabled, replace the ROM loader by the
+// flasher stub. Every later command goes through proto.c, which knows about
+// the loader that answers.
+static esp_loader_error_t open_session(channel_t *ch, const flash_args_t *args,
+                                       bool synced)
+{
+    int64_t start = esp_timer_get_time();
+
+    ch->current_rate = ROM_BAUDRATE;
+    TRACE_BEGIN("connect");
+    esp_loader_error_t err = connect_to_target(ch, synced);
+    TRACE_END("connect");
+    metrics_phase(ch->id, METRICS_CONNECT, esp_timer_get_time() - start);
     if (err != ESP_LOADER_SUCCESS) {
-        ESP_LOGE(TAG, "Cannot connect to target. Error: %u", err);
         return err;
     }
-    ESP_LOGI(TAG, "Connected to target");
+#if CONFIG_FLASH_STUB
+    if (args->stub) {
+        int64_t stub_start = esp_timer_get_time();
+        TRACE_BEGIN("stub");
+        err = stub_load(&ch->proto);
+        TRACE_END("stub");
+        metrics_phase(ch->id, METRICS_STUB,
+                      esp_timer_get_time() - stub_start);
+        if (err == ESP_LOADER_ERROR_UNSUPPORTED_CHIP) {
+            ESP_LOGW(ch->tag, "Keep using the ROM loader");
+        } else if (err != ESP_LOADER_SUCCESS) {
+            return err;
+        }
+    }
+#endif
+    ESP_LOGI(ch->tag, "Connected to %s loader in %lld ms",
+             ch->proto.stub ? "stub" : "ROM",
+             (esp_timer_get_time() - start) / 1000);
+    return ESP_LOADER_SUCCESS;
+}
 
-    if (higher_transmission_rate && esp_loader_get_target() != ESP8266_CHIP) {
-        err = esp_loader_change_transmission_rate(higher_transmission_rate);
-        if (err == ESP_LOADER_ERROR_UNSUPPORTED_FUNC) {
-            ESP_LOGE(
-                TAG,
-                "ESP8266 does not support change transmission rate command.");
+// Check the target against the job and give the ESP32 ROM the flash
+// parameters, after every connect since a reset may bring up another target
+static esp_loader_error_t check_session(channel_t *ch, const flash_args_t *args)
+{
+    if (ch->proto.chip != args->chip) {
+        ESP_LOGE(ch->tag, "Target chip error: found %d, but flash %d",
+                 ch->proto.chip, args->chip);
+        return ESP_LOADER_ERROR_INVALID_TARGET;
+    }
+    if (ch->proto.chip == ESP32_CHIP && !ch->proto.stub) {
+        esp_loader_error_t err =
+            proto_spi_set_params(&ch->proto,
+                                 args->flash_size ? args->flash_size
+                                                  : FLASH_FLASH_SIZE_DEFAULT);
+        if (err != ESP_LOADER_SUCCESS) {
+            ESP_LOGE(ch->tag, "Cannot set the flash parameters");
             return err;
-        } else if (err != ESP_LOADER_SUCCESS) {
-            ESP_LOGE(TAG, "Unable to change transmission rate on target.");
+        }
+    }
+    return ESP_LOADER_SUCCESS;
+}
+
+static esp_loader_error_t change_transmission_rate(channel_t *ch, uint32_t rate)
+{
+    esp_loader_error_t err =
+        proto_change_baudrate(&ch->proto, rate, ch->current_rate);
+    if (err != ESP_LOADER_SUCCESS) {
+        ESP_LOGE(ch->tag, "Unable to change transmission rate on target.");
+        return err;
+    }
+    err = port_change_rate(&ch->port, rate);
+    if (err != ESP_LOADER_SUCCESS) {
+        ESP_LOGE(ch->tag, "Unable to change transmission rate.");
+        return err;
+    }
+    ch->current_rate = rate;
+    port_delay_ms(50);
+    return ESP_LOADER_SUCCESS;
+}
+
+static esp_loader_error_t read_flash(channel_t *ch, uint32_t addr,
+                                     uint32_t size, uint8_t *buf,
+                                     flash_read_cb_t cb, void *ctx,
+                                     bool progress);
+
+static bool discard(const uint8_t *data, size_t size, void *ctx)
+{
+    return true;
+}
+
+// Short verified transfers at the current rate, a cheap error rate estimate.
+// The stub reads the start of the flash back, its MD5 checks every byte. The
+// ROM cannot read the flash, it hashes the same region each time instead.
+static bool probe_transmission_rate(channel_t *ch)
+{
+    uint8_t expect[16];
+    int errors = 0;
+    uint8_t *buf = ch->proto.stub ? malloc(READ_PACKET_SIZE) : NULL;
+    if (ch->proto.stub && buf == NULL) {
+        return false;
+    }
+
+    // Each failed transfer may wait out its timeout, stop once the rate fails
+    for (int i = 0; i < CONFIG_FLASH_BAUDRATE_PROBES &&
+                    errors <= CONFIG_FLASH_BAUDRATE_PROBE_ERRORS;
+         i++) {
+        uint8_t md5[16];
+        if (ch->proto.stub) {
+            errors += read_flash(ch, 0, PROBE_SIZE, buf, discard, NULL,
+                                 false) != ESP_LOADER_SUCCESS;
+        } else if (proto_flash_md5(&ch->proto, 0, PROBE_SIZE, md5) !=
+                   ESP_LOADER_SUCCESS) {
+            errors++;
+        } else if (i == 0 || errors == i) {
+            memcpy(expect, md5, sizeof(md5));
+        } else if (memcmp(md5, expect, sizeof(md5)) != 0) {
+            errors++;
+        }
+        port_flush(&ch->port);
+    }
+    free(buf);
+    if (errors > 0) {
+        ESP_LOGW(ch->tag, "%d probe(s) failed", errors);
+    }
+    return errors <= CONFIG_FLASH_BAUDRATE_PROBE_ERRORS;
+}
+
+static int parse_ladder(uint32_t *rates, int max)
+{
+    const char *str = CONFIG_FLASH_BAUDRATE_LADDER;
+    int n = 0;
+
+    while (*str != '\0' && n < max) {
+        char *end;
+        uint32_t rate = strtoul(str, &end, 0);
+        if (end == str) {
+            str++; // skip separators
+            continue;
+        }
+        if (rate > ROM_BAUDRATE) {
+            rates[n++] = rate;
+        }
+        str = end;
+    }
+    return n;
+}
+
+// The rung of the ladder next to rate, above or below it, 0 if there is none
+static uint32_t next_rate(uint32_t rate, bool up)
+{
+    uint32_t rates[BAUDRATE_LADDER_MAX];
+    int n = parse_ladder(rates, BAUDRATE_LADDER_MAX);
+    uint32_t next = 0;
+
+    for (int i = 0; i < n; i++) {
+        if (up ? rates[i] > rate && (next == 0 || rates[i] < next)
+               : rates[i] < rate && rates[i] > next) {
+            next = rates[i];
+        }
+    }
+    return next;
+}
+
+// The cap drops below the failed rate, to the ROM rate under the lowest rung
+static void lower_rate_cap(channel_t *ch, uint32_t rate)
+{
+    uint32_t next = next_rate(rate, false);
+    ch->rate_cap = next != 0 ? next : ROM_BAUDRATE;
+    ch->clean_cycles = 0;
+}
+
+// A cycle without resent packets counts towards trying a higher rate again
+static void rate_cycle_done(channel_t *ch, bool clean)
+{
+    ch->clean_cycles = clean ? ch->clean_cycles + 1 : 0;
+    if (ch->rate_cap == 0 ||
+        ch->clean_cycles < CONFIG_FLASH_BAUDRATE_RETRY_CYCLES) {
+        return;
+    }
+    ch->rate_cap = next_rate(ch->rate_cap, true);
+    ch->clean_cycles = 0;
+    if (ch->rate_cap != 0) {
+        ESP_LOGI(ch->tag, "Trying up to %ld again", ch->rate_cap);
+    }
+}
+
+// Walk the configured ladder down from the ceiling. Every step that fails the
+// probe leaves the target at an unusable rate, so it is reset and connected
+// again at the ROM rate before the next lower step is tried.
+static esp_loader_error_t negotiate_transmission_rate(channel_t *ch,
+                                                      const flash_args_t *args,
+                                                      uint32_t ceiling)
+{
+    uint32_t rates[BAUDRATE_LADDER_MAX];
+    int n = parse_ladder(rates, BAUDRATE_LADDER_MAX);
+
+    if (ceiling <= ROM_BAUDRATE ||
+        (ch->proto.chip == ESP8266_CHIP && !ch->proto.stub)) {
+        return ESP_LOADER_SUCCESS;
+    }
+    for (int i = 0; i < n; i++) {
+        if (rates[i] > ceiling ||
+            (ch->rate_cap != 0 && rates[i] > ch->rate_cap)) {
+            continue;
+        }
+        ESP_LOGI(ch->tag, "Trying transmission rate %ld", rates[i]);
+        int64_t start = esp_timer_get_time();
+        TRACE_BEGIN("baud");
+        bool reliable =
+            change_transmission_rate(ch, rates[i]) == ESP_LOADER_SUCCESS &&
+            probe_transmission_rate(ch);
+        TRACE_END("baud");
+        metrics_phase(ch->id, METRICS_BAUD, esp_timer_get_time() - start);
+        if (reliable) {
+            ESP_LOGI(ch->tag, "Transmission rate changed to %ld", rates[i]);
+            return ESP_LOADER_SUCCESS;
+        }
+        ESP_LOGW(ch->tag, "Transmission rate %ld is unreliable, falling back",
+                 rates[i]);
+        lower_rate_cap(ch, rates[i]);
+        port_change_rate(&ch->port, ROM_BAUDRATE);
+        esp_loader_error_t err = open_session(ch, args, false);
+        if (err == ESP_LOADER_SUCCESS) {
+            err = check_session(ch, args);
+        }
+        if (err != ESP_LOADER_SUCCESS) {
             return err;
-        } else {
-            err =
-                loader_port_change_transmission_rate(higher_transmission_rate);
-            if (err != ESP_LOADER_SUCCESS) {
-                ESP_LOGE(TAG, "Unable to change transmission rate.");
-                return err;
-            }
-            ESP_LOGI(TAG, "Transmission rate changed changed");
         }
     }
+    ESP_LOGW(ch->tag, "Keep transmission rate %d", ROM_BAUDRATE);
+    return ESP_LOADER_SUCCESS;
+}
+
+#if CONFIG_FLASH_PIPELINE
+// The reader task fills free blocks from the file while the caller drains
+// filled blocks to the loader, so storage and UART are busy at the same time.
+typedef struct {
+    uint8_t *buf;
+    size_t len; // 0 means end of file or read error
+} block_t;
+
+typedef struct {
+    flash_reader_t *reader;
+    size_t size;
+    size_t block_size;
+    uint8_t *mem;
+    QueueHandle_t free_q; // uint8_t *, blocks ready to be filled
+    QueueHandle_t full_q; // block_t, blocks ready to be written
+    SemaphoreHandle_t done;
+    volatile bool abort;
+} pipeline_t;
+
+static void pipeline_reader(void *arg)
+{
+    pipeline_t *p = arg;
+    size_t size = p->size;
+
+    while (size > 0) {
+        block_t b;
+        xQueueReceive(p->free_q, &b.buf, portMAX_DELAY);
+        if (p->abort) {
+            break;
+        }
+        b.len = flash_reader_read(p->reader, b.buf, p->block_size);
+        xQueueSend(p->full_q, &b, portMAX_DELAY);
+        if (b.len == 0) {
+            break;
+        }
+        size -= MIN(size, b.len);
+    }
+    xSemaphoreGive(p->done);
+    vTaskDelete(NULL);
+}
 
+static void pipeline_free(pipeline_t *p)
+{
+    if (p->done != NULL) {
+        vSemaphoreDelete(p->done);
+    }
+    if (p->full_q != NULL) {
+        vQueueDelete(p->full_q);
+    }
+    if (p->free_q != NULL) {
+        vQueueDelete(p->free_q);
+    }
+    heap_caps_free(p->mem);
+}
+
+static bool pipeline_start(pipeline_t *p, flash_reader_t *reader, size_t size,
+                           size_t block_size)
+{
+    const int depth = CONFIG_FLASH_PIPELINE_DEPTH;
+
+    memset(p, 0, sizeof(pipeline_t));
+    p->reader = reader;
+    p->size = size;
+    p->block_size = block_size;
+    p->mem = heap_caps_malloc(depth * block_size,
+                              MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (p->mem == NULL) {
+        p->mem = heap_caps_malloc(depth * block_size, MALLOC_CAP_8BIT);
+    }
+    p->free_q = xQueueCreate(depth, sizeof(uint8_t *));
+    p->full_q = xQueueCreate(depth, sizeof(block_t));
+    p->done = xSemaphoreCreateBinary();
+    if (p->mem == NULL || p->free_q == NULL || p->full_q == NULL ||
+        p->done == NULL) {
+        ESP_LOGE(TAG, "Cannot allocate %d pipeline blocks", depth);
+        pipeline_free(p);
+        return false;
+    }
+    for (int i = 0; i < depth; i++) {
+        uint8_t *buf = p->mem + i * block_size;
+        xQueueSend(p->free_q, &buf, 0);
+    }
+    if (xTaskCreate(pipeline_reader, "flash_reader", 4096, p,
+                    uxTaskPriorityGet(NULL), NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Cannot create pipeline reader task");
+        pipeline_free(p);
+        return false;
+    }
+    return true;
+}
+
+static void pipeline_stop(pipeline_t *p)
+{
+    // Hand every filled block back until the reader has left its loop
+    p->abort = true;
+    while (xSemaphoreTake(p->done, pdMS_TO_TICKS(10)) != pdTRUE) {
+        block_t b;
+        if (xQueueReceive(p->full_q, &b, 0) == pdTRUE) {
+            xQueueSend(p->free_q, &b.buf, 0);
+        }
+    }
+    pipeline_free(p);
+}
+#endif
+
+// The ROM loaders take small packets, the stub buffers up to 16 KiB. A job
+// may ask for another power of two within the limit of the active loader.
+static uint32_t choose_block_size(channel_t *ch, const flash_args_t *args)
+{
+    uint32_t max = CONFIG_FLASH_BLOCK_SIZE_ROM;
+#if CONFIG_FLASH_STUB
+    if (ch->proto.stub) {
+        max = CONFIG_FLASH_BLOCK_SIZE_STUB;
+    }
+#endif
+    uint32_t size = max;
+
+    if (args->block_size != 0) {
+        size = FLASH_BLOCK_SIZE_MIN;
+        while (size * 2 <= MIN(args->block_size, max)) {
+            size *= 2;
+        }
+    }
+    return MAX(size, FLASH_BLOCK_SIZE_MIN);
+}
+
+static esp_loader_error_t verify_md5(channel_t *ch, uint32_t addr,
+                                     uint32_t size, const uint8_t expect[16])
+{
+#ifdef CONFIG_SERIAL_FLASHER_MD5_ENABLED
+    uint8_t md5[16];
+    int64_t start = esp_timer_get_time();
+    TRACE_BEGIN("verify");
+    esp_loader_error_t err = proto_flash_md5(&ch->proto, addr, size, md5);
+    TRACE_END("verify");
+    metrics_phase(ch->id, METRICS_VERIFY, esp_timer_get_time() - start);
+    if (err == ESP_LOADER_ERROR_UNSUPPORTED_FUNC) {
+        ESP_LOGW(ch->tag, "Loader does not support flash verify command");
+        return ESP_LOADER_SUCCESS;
+    } else if (err != ESP_LOADER_SUCCESS) {
+        ESP_LOGE(ch->tag, "Cannot read MD5 from target. err: %d", err);
+        return err;
+    } else if (memcmp(md5, expect, sizeof(md5)) != 0) {
+        ESP_LOGE(ch->tag, "MD5 does not match");
+        return ESP_LOADER_ERROR_INVALID_MD5;
+    }
+    ESP_LOGI(ch->tag, "Flash verified");
+#endif
     return ESP_LOADER_SUCCESS;
 }
 
-static esp_loader_error_t flash_binary(const char *fname, size_t size,
-                                       size_t address)
+static void log_timing(channel_t *ch, int64_t erase, int64_t write,
+                       size_t size, size_t sent)
 {
-    esp_loader_error_t err;
-    static uint8_t payload[1024];
+    ch->erase_us += erase;
+    metrics_phase(ch->id, METRICS_ERASE, erase);
+    metrics_phase(ch->id, METRICS_WRITE, write);
+    metrics_sent(ch->id, sent);
+    ESP_LOGI(ch->tag,
+             "%s: erase %lld ms, write %d bytes (%d sent) in %lld ms "
+             "(%lld bytes/s)",
+             ch->proto.stub ? "stub" : "ROM", erase / 1000, size, sent,
+             write / 1000, write > 0 ? size * 1000000LL / write : 0);
+}
+
+// After a chip erase nothing is left to erase, nor behind a resumed write
+static bool erase_first(channel_t *ch)
+{
+    return ch->erase != FLASH_ERASE_CHIP && !ch->resumed;
+}
+
+// The ROM erases a write before it takes the data, the stub erases ahead of
+// the data while it arrives
+static bool erases_up_front(channel_t *ch)
+{
+    return !ch->proto.stub && erase_first(ch);
+}
+
+// A packet the loader refused goes out again. The loaders write every packet
+// they take at the next offset whatever its sequence number, so one that
+// timed out or got a garbled answer may have been taken: the write is
+// resumed after a reconnect instead.
+static esp_loader_error_t send_packet(channel_t *ch, const uint8_t *data,
+                                      uint32_t size, bool deflated)
+{
+    for (int i = 0;; i++) {
+        TRACE_BEGIN("packet");
+        esp_loader_error_t err =
+            deflated ? proto_flash_defl_data(&ch->proto, data, size)
+                     : proto_flash_data(&ch->proto, data, size);
+        TRACE_END("packet");
+        if (err == ESP_LOADER_SUCCESS || !proto_data_rejected(&ch->proto) ||
+            i == CONFIG_FLASH_PACKET_RETRIES) {
+            return err;
+        }
+        ESP_LOGD(ch->tag, "Packet %ld failed with error %d, resending",
+                 ch->proto.seq, err);
+        ch->retries++;
+        port_flush(&ch->port);
+    }
+}
+
+// A single channel owns the console line, parallel channels would overwrite
+// each other's progress so they log every tenth instead
+static void progress_begin(channel_t *ch)
+{
+    ch->progress = 0;
+    if (CHANNELS == 1) {
+        printf("Start programming");
+    } else {
+        ESP_LOGI(ch->tag, "Start programming");
+    }
+}
+
+static void print_progress(channel_t *ch, size_t done, size_t total)
+{
+    int progress = (int)(((float)done / total) * 100);
+    if (CHANNELS == 1) {
+        printf("\rProgress: %d %%", progress);
+        fflush(stdout);
+    } else if (progress / 10 != ch->progress / 10) {
+        ESP_LOGI(ch->tag, "Progress: %d %%", progress);
+    }
+    ch->progress = progress;
+}
 
-    FILE *fp = fopen(fname, "rb");
-    if (fp == NULL) {
-        ESP_LOGE(TAG, "Cannot open \"%s\" to read", fname);
+static void progress_end(channel_t *ch)
+{
+    if (CHANNELS == 1) {
+        printf("\rFinished programming\n");
+    } else {
+        ESP_LOGI(ch->tag, "Finished programming");
+    }
+}
+
+static void progress_abort(channel_t *ch)
+{
+    if (CHANNELS == 1) {
+        printf("\n");
+    }
+}
+
+// Write size bytes of the file from offset on, reading it from the storage
+static esp_loader_error_t flash_stored(channel_t *ch, const flash_file_t *file,
+                                       size_t offset, size_t size)
+{
+    size_t address = file->addr + offset;
+    esp_loader_error_t err;
+#if CONFIG_FLASH_PIPELINE
+    pipeline_t pipeline;
+#else
+    uint8_t *payload = heap_caps_malloc(ch->block_size,
+                                        MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (payload == NULL) {
+        ESP_LOGE(ch->tag, "Malloc %ld bytes block failed", ch->block_size);
         return ESP_LOADER_ERROR_FAIL;
     }
+#endif
+    md5_context_t md5;
+    uint8_t digest[16];
 
-    ESP_LOGI(TAG, "Erasing flash (this may take a while)...");
-    err = esp_loader_flash_start(address, size, sizeof(payload));
+    // Files merged into the write are opened as the reader reaches them
+    flash_reader_t reader;
+    flash_reader_open(&reader, file, offset);
+
+    if (erases_up_front(ch)) {
+        ESP_LOGI(ch->tag, "Erasing flash (this may take a while)...");
+    }
+    int64_t start = esp_timer_get_time();
+    TRACE_BEGIN("erase");
+    err = proto_flash_begin(&ch->proto, address, size, ch->block_size,
+                            erase_first(ch));
+    TRACE_END("erase");
     if (err != ESP_LOADER_SUCCESS) {
-        ESP_LOGE(TAG, "Erasing flash failed with error %d", err);
-        goto failed;
+        ESP_LOGE(ch->tag, "Erasing flash failed with error %d", err);
+        goto failed_begin;
     }
-    printf("Start programming");
+    int64_t erase = esp_timer_get_time() - start;
+#if CONFIG_FLASH_PIPELINE
+    if (!pipeline_start(&pipeline, &reader, size, ch->block_size)) {
+        err = ESP_LOADER_ERROR_FAIL;
+        goto failed_begin;
+    }
+#endif
+    progress_begin(ch);
 
     size_t binary_size = size;
     size_t written = 0;
+    esp_rom_md5_init(&md5);
+    start = esp_timer_get_time();
 
     while (size > 0) {
-        size_t read = fread(payload, 1, sizeof(payload), fp);
+#if CONFIG_FLASH_PIPELINE
+        block_t b;
+        xQueueReceive(pipeline.full_q, &b, portMAX_DELAY);
+        uint8_t *payload = b.buf;
+        size_t read = b.len;
+#else
+        size_t read = flash_reader_read(&reader, payload, ch->block_size);
+#endif
         if (read == 0) {
-            printf("\n");
-            ESP_LOGE(TAG, "Flash file is too small");
+            progress_abort(ch);
+            ESP_LOGE(ch->tag, "Flash file is too small");
+            err = ESP_LOADER_ERROR_FAIL;
             goto failed;
         }
         size_t to_read = MIN(size, read);
 
-        err = esp_loader_flash_write(payload, to_read);
+        // The loaders write whole blocks, pad the last one as erased flash
+        esp_rom_md5_update(&md5, payload, to_read);
+        memset(payload + to_read, 0xff, ch->block_size - to_read);
+        err = send_packet(ch, payload, ch->block_size, false);
+#if CONFIG_FLASH_PIPELINE
+        xQueueSend(pipeline.free_q, &b.buf, 0);
+#endif
         if (err != ESP_LOADER_SUCCESS) {
-            printf("\n");
-            ESP_LOGE(TAG, "Packet could not be written! Error %d", err);
+            progress_abort(ch);
+            ESP_LOGE(ch->tag, "Packet could not be written! Error %d", err);
+            ch->interrupted = true;
             goto failed;
         }
 
         size -= to_read;
         written += to_read;
+        ch->acked = written;
 
-        int progress = (int)(((float)written / binary_size) * 100);
-        printf("\rProgress: %d %%", progress);
-        fflush(stdout);
+        print_progress(ch, written, binary_size);
     };
 
-    printf("\rFinished programming\n");
-    fclose(fp);
+    int64_t elapsed = esp_timer_get_time() - start;
+    progress_end(ch);
+#if CONFIG_FLASH_PIPELINE
+    pipeline_stop(&pipeline);
+#else
+    free(payload);
+#endif
+    flash_reader_close(&reader);
+    log_timing(ch, erase, elapsed, written, written);
+    ch->bytes_written += written;
 
-#ifdef CONFIG_SERIAL_FLASHER_MD5_ENABLED
-    err = esp_loader_flash_verify();
+    esp_rom_md5_final(digest, &md5);
+    return verify_md5(ch, address, binary_size, digest);
+
+failed:
+#if CONFIG_FLASH_PIPELINE
+    pipeline_stop(&pipeline);
+#endif
+failed_begin:
+    flash_reader_close(&reader);
+#if !CONFIG_FLASH_PIPELINE
+    free(payload);
+#endif
+    return err;
+}
+
+// Stream a range of an image cached in PSRAM, only the padded last block is
+// copied
+static esp_loader_error_t flash_cached(channel_t *ch,
+                                       const flash_file_t *file,
+                                       size_t offset, size_t size)
+{
+    size_t address = file->addr + offset;
+    uint8_t digest[16];
+    uint8_t *tail = heap_caps_malloc(ch->block_size,
+                                     MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (tail == NULL) {
+        ESP_LOGE(ch->tag, "Malloc %ld bytes block failed", ch->block_size);
+        return ESP_LOADER_ERROR_FAIL;
+    }
+
+    if (erases_up_front(ch)) {
+        ESP_LOGI(ch->tag, "Erasing flash (this may take a while)...");
+    }
+    int64_t start = esp_timer_get_time();
+    TRACE_BEGIN("erase");
+    esp_loader_error_t err = proto_flash_begin(
+        &ch->proto, address, size, ch->block_size, erase_first(ch));
+    TRACE_END("erase");
+    if (err != ESP_LOADER_SUCCESS) {
+        ESP_LOGE(ch->tag, "Erasing flash failed with error %d", err);
+        free(tail);
+        return err;
+    }
+    int64_t erase = esp_timer_get_time() - start;
+    progress_begin(ch);
+
+    const uint8_t *data = file->data + offset;
+    size_t written = 0;
+    start = esp_timer_get_time();
+
+    while (written < size) {
+        size_t to_write = MIN(size - written, ch->block_size);
+        const uint8_t *payload = data + written;
+        if (to_write < ch->block_size) {
+            // The loaders write whole blocks, pad the last one as erased
+            memcpy(tail, payload, to_write);
+            memset(tail + to_write, 0xff, ch->block_size - to_write);
+            payload = tail;
+        }
+        err = send_packet(ch, payload, ch->block_size, false);
+        if (err != ESP_LOADER_SUCCESS) {
+            progress_abort(ch);
+            ESP_LOGE(ch->tag, "Packet could not be written! Error %d", err);
+            ch->interrupted = true;
+            free(tail);
+            return err;
+        }
+        written += to_write;
+        ch->acked = written;
+        print_progress(ch, written, size);
+    }
+
+    int64_t elapsed = esp_timer_get_time() - start;
+    progress_end(ch);
+    free(tail);
+    log_timing(ch, erase, elapsed, written, written);
+    ch->bytes_written += written;
+
+    if (offset == 0 && size == file->size) {
+        return verify_md5(ch, address, size, file->md5);
+    }
+    md5_context_t md5;
+    esp_rom_md5_init(&md5);
+    esp_rom_md5_update(&md5, data, size);
+    esp_rom_md5_final(digest, &md5);
+    return verify_md5(ch, address, size, digest);
+}
+
+// Connect, settle the loader and the rate and size the packets, once for the
+// session and again when a write is resumed
+static esp_loader_error_t connect_session(channel_t *ch,
+                                          const flash_args_t *args,
+                                          bool synced)
+{
+    // The port stays open between cycles, only its rate is restored
+    if (ch->port.baud_rate != ROM_BAUDRATE) {
+        port_change_rate(&ch->port, ROM_BAUDRATE);
+    }
+    esp_loader_error_t err = open_session(ch, args, synced);
+    if (err == ESP_LOADER_SUCCESS) {
+        err = check_session(ch, args);
+    }
+    if (err != ESP_LOADER_SUCCESS) {
+        return err;
+    }
+    ch->deflate_supported = args->chip != ESP8266_CHIP || ch->proto.stub;
+    uint32_t ceiling = args->baud ? args->baud : CONFIG_FLASH_BAUDRATE_MAX;
+    err = negotiate_transmission_rate(ch, args, ceiling);
+    if (err != ESP_LOADER_SUCCESS) {
+        return err;
+    }
+    ch->block_size = choose_block_size(ch, args);
+    ESP_LOGI(ch->tag, "Flash block size: 0x%lX", ch->block_size);
+    return ESP_LOADER_SUCCESS;
+}
+
+// Reconnect after a write broke off, within the resumes of the session. The
+// flash keeps what was written, the loader starts over. A reconnect that
+// fails on the same line takes the next resume.
+static bool reconnect(channel_t *ch)
+{
+    bool stub = ch->proto.stub;
+    bool deflate = ch->deflate_supported;
+    while (ch->resumes < CONFIG_FLASH_RESUMES && !job.stop) {
+        ch->resumes++;
+        ESP_LOGW(ch->tag, "Reconnecting to resume the write, %ld of %d",
+                 ch->resumes, CONFIG_FLASH_RESUMES);
+        // The line failed at this rate, the next connect tries a lower one
+        lower_rate_cap(ch, ch->current_rate);
+        if (connect_session(ch, ch->args, false) != ESP_LOADER_SUCCESS) {
+            continue;
+        }
+        // The ROM would not know which sectors the stub erased ahead
+        if (stub && !ch->proto.stub) {
+            ESP_LOGE(ch->tag, "Stub lost, cannot resume");
+            return false;
+        }
+        ch->deflate_supported &= deflate;
+        return true;
+    }
+    return false;
+}
+
+static esp_loader_error_t erase_region(channel_t *ch, uint32_t addr,
+                                       uint32_t size)
+{
+    int64_t start = esp_timer_get_time();
+    TRACE_BEGIN("erase");
+    esp_loader_error_t err = proto_erase_region(&ch->proto, addr, size);
+    TRACE_END("erase");
+    if (err != ESP_LOADER_SUCCESS) {
+        ESP_LOGE(ch->tag, "Erasing 0x%lX failed with error %d", addr, err);
+        return err;
+    }
+    int64_t erase = esp_timer_get_time() - start;
+    metrics_phase(ch->id, METRICS_ERASE, erase);
+    ch->erase_us += erase;
+    return ESP_LOADER_SUCCESS;
+}
+
+// A write that broke off resumes from the sector of the last byte the loader
+// took. The rest of the range is erased still: by the ROM up front, ahead of
+// the data by the stub, which erases the resumed sectors once more itself.
+// With the ROM only the sectors the lost packet may have reached are erased
+// again.
+static esp_loader_error_t flash_raw(channel_t *ch, const flash_file_t *file,
+                                    size_t offset, size_t size)
+{
+    const size_t end = offset + size;
+    while (1) {
+        ch->acked = 0;
+        ch->interrupted = false;
+        esp_loader_error_t err = file->data != NULL
+                                     ? flash_cached(ch, file, offset, size)
+                                     : flash_stored(ch, file, offset, size);
+        ch->resumed = false;
+        if (err == ESP_LOADER_SUCCESS || !ch->interrupted) {
+            return err;
+        }
+        uint32_t acked = file->addr + offset + ch->acked;
+        uint32_t from = acked / FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE;
+        uint32_t to = MIN(acked + ch->block_size, file->addr + end);
+        to = (to + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE *
+             FLASH_SECTOR_SIZE;
+        if (!reconnect(ch)) {
+            return err;
+        }
+        if (!ch->proto.stub) {
+            err = erase_region(ch, from, to - from);
+            if (err != ESP_LOADER_SUCCESS) {
+                return err;
+            }
+        }
+        // The sector may begin before an unaligned file
+        size_t resume = MAX(from, file->addr + offset) - file->addr;
+        ESP_LOGI(ch->tag, "Resuming at 0x%lX", file->addr + resume);
+        ch->bytes_written += resume - offset;
+        offset = resume;
+        size = end - offset;
+        ch->resumed = true;
+    }
+}
+
+static esp_loader_error_t flash_deflated(channel_t *ch,
+                                         const flash_file_t *file)
+{
+    if (erases_up_front(ch)) {
+        ESP_LOGI(ch->tag, "Erasing flash (this may take a while)...");
+    }
+    int64_t start = esp_timer_get_time();
+    TRACE_BEGIN("erase");
+    esp_loader_error_t err =
+        proto_flash_defl_begin(&ch->proto, file->addr, file->size,
+                               file->zsize, ch->block_size);
+    TRACE_END("erase");
     if (err == ESP_LOADER_ERROR_UNSUPPORTED_FUNC) {
-        ESP_LOGW(TAG, "ESP8266 does not support flash verify command");
-        return ESP_LOADER_SUCCESS;
+        return err;
     } else if (err != ESP_LOADER_SUCCESS) {
-        ESP_LOGE(TAG, "MD5 does not match. err: %d", err);
+        ESP_LOGE(ch->tag, "Erasing flash failed with error %d", err);
         return err;
     }
-    ESP_LOGI(TAG, "Flash verified");
+    int64_t erase = esp_timer_get_time() - start;
+    progress_begin(ch);
+
+    size_t written = 0;
+    start = esp_timer_get_time();
+
+    while (written < file->zsize) {
+        size_t to_write = MIN(file->zsize - written, ch->block_size);
+        err = send_packet(ch, file->zdata + written, to_write, true);
+        if (err != ESP_LOADER_SUCCESS) {
+            progress_abort(ch);
+            ESP_LOGE(ch->tag, "Packet could not be written! Error %d", err);
+            ch->interrupted = true;
+            return err;
+        }
+        written += to_write;
+
+        print_progress(ch, written, file->zsize);
+    }
+
+    int64_t elapsed = esp_timer_get_time() - start;
+    progress_end(ch);
+    log_timing(ch, erase, elapsed, file->size, written);
+    ch->bytes_written += file->size;
+
+    return verify_md5(ch, file->addr, file->size, file->md5);
+}
+
+// Compare the digest of every region with the target and rewrite the runs of
+// regions that differ. Returns ESP_LOADER_ERROR_UNSUPPORTED_FUNC when the
+// whole image has to be written anyway.
+static esp_loader_error_t flash_diff(channel_t *ch, const flash_file_t *file)
+{
+    const uint32_t region = CONFIG_FLASH_DIFF_REGION_SIZE;
+    uint32_t regions = (file->size + region - 1) / region;
+    esp_loader_error_t err = ESP_LOADER_SUCCESS;
+
+    if (!file->hashed || file->addr % FLASH_SECTOR_SIZE != 0 || regions == 0) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+    bool *dirty = calloc(regions, sizeof(bool));
+    if (dirty == NULL) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+
+    int64_t start = esp_timer_get_time();
+    uint32_t changed = 0;
+    for (uint32_t i = 0; i < regions; i++) {
+        uint32_t offset = i * region;
+        uint8_t md5[16];
+        err = proto_flash_md5(&ch->proto, file->addr + offset,
+                              MIN(region, file->size - offset), md5);
+        if (err != ESP_LOADER_SUCCESS) {
+            ESP_LOGW(ch->tag, "Cannot read MD5 of 0x%lX from target",
+                     file->addr + offset);
+            goto done;
+        }
+        dirty[i] = memcmp(md5, file->region_md5[i], sizeof(md5)) != 0;
+        changed += dirty[i];
+    }
+    int64_t compared = esp_timer_get_time() - start;
+    metrics_phase(ch->id, METRICS_DIFF, compared);
+    ESP_LOGI(ch->tag, "Compared %ld regions in %lld ms, %ld differ", regions,
+             compared / 1000, changed);
+    if (changed == regions) {
+        err = ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+        goto done;
+    }
+
+    size_t written = 0;
+    for (uint32_t i = 0; i < regions;) {
+        if (!dirty[i]) {
+            i++;
+            continue;
+        }
+        uint32_t end = i;
+        while (end < regions && dirty[end]) {
+            end++;
+        }
+        size_t offset = i * region;
+        size_t size = MIN(end * region, file->size) - offset;
+        err = flash_raw(ch, file, offset, size);
+        if (err != ESP_LOADER_SUCCESS) {
+            goto done;
+        }
+        written += size;
+        i = end;
+    }
+    ch->bytes_skipped += file->size - written;
+    ESP_LOGI(ch->tag, "Skipped %d bytes, wrote %d bytes", file->size - written,
+             written);
+
+done:
+    free(dirty);
+    return err;
+}
+
+#if CONFIG_FLASH_SPARSE
+// Write the extents of the image, each with its own begin and data, and erase
+// the blank sectors in between unless the chip erase did. Returns
+// ESP_LOADER_ERROR_UNSUPPORTED_FUNC when no sector would be skipped.
+static esp_loader_error_t flash_sparse(channel_t *ch, const flash_file_t *file)
+{
+    uint32_t used = 0;
+    for (int i = 0; i < file->extents_size; i++) {
+        used += file->extents[i].size;
+    }
+    if (file->size - used < FLASH_SECTOR_SIZE) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+
+    uint32_t done = 0; // sectors up to here are written or erased
+    for (int i = 0; i <= file->extents_size; i++) {
+        const flash_extent_t *ext =
+            i < file->extents_size ? &file->extents[i] : NULL;
+        uint32_t end = ext != NULL ? ext->offset
+                                   : (file->size + FLASH_SECTOR_SIZE - 1) /
+                                         FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE;
+        esp_loader_error_t err = ESP_LOADER_SUCCESS;
+        if (end > done && ch->erase != FLASH_ERASE_CHIP) {
+            err = erase_region(ch, file->addr + done, end - done);
+        }
+        if (err == ESP_LOADER_SUCCESS && ext != NULL) {
+            err = flash_raw(ch, file, ext->offset, ext->size);
+        }
+        if (err != ESP_LOADER_SUCCESS) {
+            return err;
+        }
+        if (ext != NULL) {
+            done = (ext->offset + ext->size + FLASH_SECTOR_SIZE - 1) /
+                   FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE;
+        }
+    }
+    ch->bytes_skipped += file->size - used;
+    ESP_LOGI(ch->tag, "Skipped %ld blank bytes, wrote %ld bytes in %d run(s)",
+             file->size - used, used, file->extents_size);
+    return ESP_LOADER_SUCCESS;
+}
+#endif
+
+static esp_loader_error_t flash_binary(channel_t *ch, const flash_file_t *file,
+                                       bool diff)
+{
+    if (diff) {
+        esp_loader_error_t err = flash_diff(ch, file);
+        if (err != ESP_LOADER_ERROR_UNSUPPORTED_FUNC) {
+            return err;
+        }
+    }
+    while (file->zdata != NULL && ch->deflate_supported) {
+        ch->interrupted = false;
+        esp_loader_error_t err = flash_deflated(ch, file);
+        if (err == ESP_LOADER_ERROR_UNSUPPORTED_FUNC) {
+            ESP_LOGW(ch->tag, "Loader rejects compressed data, flashing raw");
+            ch->deflate_supported = false;
+            break;
+        }
+        if (err == ESP_LOADER_SUCCESS || !ch->interrupted || !reconnect(ch)) {
+            return err;
+        }
+        // A deflated stream cannot pick up in the middle. The regions it
+        // completed match their digests, the others are written raw, or
+        // the stream starts over when none matches.
+        err = flash_diff(ch, file);
+        if (err != ESP_LOADER_ERROR_UNSUPPORTED_FUNC) {
+            return err;
+        }
+    }
+#if CONFIG_FLASH_SPARSE
+    if (file->extents != NULL) {
+        esp_loader_error_t err = flash_sparse(ch, file);
+        if (err != ESP_LOADER_ERROR_UNSUPPORTED_FUNC) {
+            return err;
+        }
+    }
 #endif
+    return flash_raw(ch, file, 0, file->size);
+}
+
+static const char *erase_name(channel_t *ch)
+{
+    if (ch->erase == FLASH_ERASE_CHIP) {
+        return "chip";
+    }
+    return ch->proto.stub ? "ahead" : "region";
+}
 
+// The stub hides the erase of each write behind its transfer. The ROM erases
+// each write before its data, a single chip erase spares those once the job
+// covers most of the flash.
+static flash_erase_t choose_erase(channel_t *ch, const flash_args_t *args)
+{
+    if (args->erase != FLASH_ERASE_AUTO) {
+        return args->erase;
+    }
+    if (ch->proto.stub || CONFIG_FLASH_ERASE_CHIP_PERCENT == 0 ||
+        args->flash_size == 0) {
+        return FLASH_ERASE_REGION;
+    }
+    uint64_t covered = 0;
+    for (int i = 0; i < args->flash_files_size; i++) {
+        covered += args->flash_files[i].size;
+    }
+    if (covered * 100 >=
+        (uint64_t)args->flash_size * CONFIG_FLASH_ERASE_CHIP_PERCENT) {
+        return FLASH_ERASE_CHIP;
+    }
+    return FLASH_ERASE_REGION;
+}
+
+static esp_loader_error_t erase_chip(channel_t *ch, uint32_t flash_size)
+{
+    ESP_LOGI(ch->tag, "Erasing the whole flash (this may take a while)...");
+    int64_t start = esp_timer_get_time();
+    TRACE_BEGIN("erase");
+    esp_loader_error_t err = proto_erase_chip(&ch->proto, flash_size);
+    TRACE_END("erase");
+    if (err != ESP_LOADER_SUCCESS) {
+        ESP_LOGE(ch->tag, "Erasing flash failed with error %d", err);
+        return err;
+    }
+    int64_t erase = esp_timer_get_time() - start;
+    metrics_phase(ch->id, METRICS_ERASE, erase);
+    ch->erase_us += erase;
+    ESP_LOGI(ch->tag, "Flash erased in %lld ms", erase / 1000);
     return ESP_LOADER_SUCCESS;
+}
 
-failed:
-    fclose(fp);
+// The stub erases every write ahead of its data whatever was erased before,
+// after ERASE_FLASH each written sector would be erased twice. A chip erase
+// with the stub erases the flash around the writes instead.
+static esp_loader_error_t erase_around(channel_t *ch,
+                                       const flash_args_t *args)
+{
+    ESP_LOGI(ch->tag, "Erasing the flash around the writes...");
+    uint32_t pos = 0;
+    while (pos < args->flash_size) {
+        // The next write at or after pos, in sectors
+        uint32_t start = args->flash_size;
+        uint32_t end = args->flash_size;
+        for (int i = 0; i < args->flash_files_size; i++) {
+            const flash_file_t *file = &args->flash_files[i];
+            uint32_t s = file->addr / FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE;
+            uint32_t e = (file->addr + file->size + FLASH_SECTOR_SIZE - 1) /
+                         FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE;
+            if (e > pos && MAX(s, pos) < start) {
+                start = MAX(s, pos);
+                end = e;
+            }
+        }
+        if (start > pos) {
+            esp_loader_error_t err = erase_region(ch, pos, start - pos);
+            if (err != ESP_LOADER_SUCCESS) {
+                return err;
+            }
+        }
+        pos = end;
+    }
+    return ESP_LOADER_SUCCESS;
+}
+
+static esp_loader_error_t flash_session(channel_t *ch,
+                                        const flash_args_t *args, bool synced)
+{
+    ch->retries = 0;
+    ch->resumes = 0;
+    esp_loader_error_t err = connect_session(ch, args, synced);
+    if (err != ESP_LOADER_SUCCESS) {
+        return err;
+    }
+    ch->args = args;
+    ch->bytes_written = 0;
+    ch->bytes_skipped = 0;
+
+    ch->erase = choose_erase(ch, args);
+    if (ch->erase == FLASH_ERASE_CHIP && args->flash_size == 0) {
+        ESP_LOGW(ch->tag, "Unknown flash size, erasing each write instead");
+        ch->erase = FLASH_ERASE_REGION;
+    }
+    ch->erase_us = 0;
+    int64_t start = esp_timer_get_time();
+    bool diff = args->diff;
+    if (ch->erase == FLASH_ERASE_CHIP && ch->proto.stub) {
+        // The writes keep their content until the stub erases them, a
+        // comparison still pays
+        err = erase_around(ch, args);
+        if (err != ESP_LOADER_SUCCESS) {
+            return err;
+        }
+        ch->erase = FLASH_ERASE_REGION;
+    } else if (ch->erase == FLASH_ERASE_CHIP) {
+        err = erase_chip(ch, args->flash_size);
+        if (err != ESP_LOADER_SUCCESS) {
+            return err;
+        }
+        diff = false; // nothing left to compare
+        // The ROM would erase the deflated writes once more
+        ch->deflate_supported &= ch->proto.stub;
+    }
+    for (int i = 0; i < args->flash_files_size; i++) {
+        const flash_file_t *file = &args->flash_files[i];
+        if (file->parts_size == 1) {
+            ESP_LOGI(ch->tag, "Flashing \"%s\" size: %ld, address: 0x%lX",
+                     file->parts[0].path, file->size, file->addr);
+        } else {
+            ESP_LOGI(ch->tag, "Flashing %d files size: %ld, address: 0x%lX",
+                     file->parts_size, file->size, file->addr);
+        }
+        metrics_file(ch->id, file->addr, file->size);
+        TRACE_BEGIN("flash_binary");
+        err = flash_binary(ch, file, diff);
+        TRACE_END("flash_binary");
+        if (err != ESP_LOADER_SUCCESS) {
+            return err;
+        }
+    }
+
+    ESP_LOGI(ch->tag, "Done! %d bytes written, %d bytes skipped",
+             ch->bytes_written, ch->bytes_skipped);
+    ESP_LOGI(ch->tag, "Erase %s: waited %lld ms of %lld ms", erase_name(ch),
+             ch->erase_us / 1000, (esp_timer_get_time() - start) / 1000);
+    return ESP_LOADER_SUCCESS;
+}
+
+static bool flash_channel(channel_t *ch, const flash_args_t *args,
+                          bool synced)
+{
+    metrics_begin(ch->id, METRICS_CYCLE_FLASH);
+    esp_loader_error_t err = flash_session(ch, args, synced);
+    if (ch->retries > 0 || ch->resumes > 0) {
+        ESP_LOGW(ch->tag, "%ld packet(s) resent, %ld write(s) resumed",
+                 ch->retries, ch->resumes);
+    }
+    metrics_recovery(ch->id, ch->retries, ch->resumes);
+    metrics_end(ch->id, err);
+    rate_cycle_done(ch, err == ESP_LOADER_SUCCESS && ch->retries == 0 &&
+                            ch->resumes == 0);
+    return err == ESP_LOADER_SUCCESS;
+}
+
+// Compares the flash of the target with the job, nothing is written. Its
+// phases replace the last cycle of the channel, the lifetime counters only
+// count flash cycles.
+static bool verify_channel(channel_t *ch, const flash_args_t *args)
+{
+    metrics_begin(ch->id, METRICS_CYCLE_VERIFY);
+    esp_loader_error_t err = connect_session(ch, args, false);
+    for (int i = 0; i < args->flash_files_size && err == ESP_LOADER_SUCCESS;
+         i++) {
+        const flash_file_t *file = &args->flash_files[i];
+        if (!file->hashed) {
+            ESP_LOGE(ch->tag, "No digest of the write to 0x%lX", file->addr);
+            err = ESP_LOADER_ERROR_INVALID_PARAM;
+            break;
+        }
+        ESP_LOGI(ch->tag, "Verifying size: %ld, address: 0x%lX", file->size,
+                 file->addr);
+        err = verify_md5(ch, file->addr, file->size, file->md5);
+    }
+    metrics_end(ch->id, err);
+    return err == ESP_LOADER_SUCCESS;
+}
+
+// Streams the flash through cb and compares the digest the stub sends last
+static esp_loader_error_t read_flash(channel_t *ch, uint32_t addr,
+                                     uint32_t size, uint8_t *buf,
+                                     flash_read_cb_t cb, void *ctx,
+                                     bool progress)
+{
+    esp_loader_error_t err = proto_read_flash(&ch->proto, addr, size,
+                                              READ_PACKET_SIZE, READ_INFLIGHT);
+    if (err != ESP_LOADER_SUCCESS) {
+        ESP_LOGE(ch->tag, "Cannot read the flash. Error: %d", err);
+        return err;
+    }
+    md5_context_t md5;
+    esp_rom_md5_init(&md5);
+    uint32_t received = 0;
+    while (received < size) {
+        size_t len;
+        TRACE_BEGIN("packet");
+        err = proto_read_flash_data(&ch->proto, buf, READ_PACKET_SIZE, &len);
+        TRACE_END("packet");
+        if (err == ESP_LOADER_SUCCESS &&
+            len != MIN(READ_PACKET_SIZE, size - received)) {
+            err = ESP_LOADER_ERROR_INVALID_RESPONSE;
+        }
+        // The stub sends on while the packet is handled
+        if (err == ESP_LOADER_SUCCESS) {
+            received += len;
+            err = proto_read_flash_ack(&ch->proto, received);
+        }
+        if (err != ESP_LOADER_SUCCESS) {
+            ESP_LOGE(ch->tag, "Read broke off at 0x%lX. Error: %d",
+                     addr + received, err);
+            return err;
+        }
+        esp_rom_md5_update(&md5, buf, len);
+        if (!cb(buf, len, ctx)) {
+            return ESP_LOADER_ERROR_FAIL;
+        }
+        if (progress) {
+            print_progress(ch, received, size);
+        }
+    }
+    uint8_t digest[16];
+    esp_rom_md5_final(digest, &md5);
+    size_t len;
+    err = proto_read_flash_data(&ch->proto, buf, READ_PACKET_SIZE, &len);
+    if (err == ESP_LOADER_SUCCESS &&
+        (len != sizeof(digest) || memcmp(buf, digest, len) != 0)) {
+        ESP_LOGE(ch->tag, "MD5 of the read does not match");
+        err = ESP_LOADER_ERROR_INVALID_MD5;
+    }
     return err;
 }
 
-void flash(flash_args_t *args, flash_cb_t done)
+#if CONFIG_FLASH_READBACK
+static bool copy_header(const uint8_t *data, size_t size, void *ctx)
 {
-    const loader_esp32_config_t config = {
-        .baud_rate = 115200,
-        .uart_port = CONFIG_FLASH_UART_PORT_NUM,
-        .uart_rx_pin = CONFIG_FLASH_UART_RX_GPIO,
-        .uart_tx_pin = CONFIG_FALSH_UART_TX_GPIO,
-        .reset_trigger_pin = CONFIG_FLASH_UART_RESET_GPIO,
-        .gpio0_trigger_pin = CONFIG_FLASH_UART_IO0_GPIO,
-    };
+    memcpy(ctx, data, size);
+    return true;
+}
 
-    if (loader_port_esp32_init(&config) != ESP_LOADER_SUCCESS) {
-        ESP_LOGE(TAG, "Serial initialization failed");
-        if (done) {
-            done(false);
+// The size the bootloader image declares in its header, 0 if there is none
+static uint32_t header_flash_size(channel_t *ch, uint8_t *buf)
+{
+    uint8_t header[4];
+    // The ESP32 and ESP32-S2 boot from 0x1000, the later chips from 0
+    uint32_t addr = ch->proto.chip == ESP32_CHIP ||
+                            ch->proto.chip == ESP32S2_CHIP
+                        ? 0x1000
+                        : 0;
+    if (ch->proto.chip == ESP8266_CHIP ||
+        read_flash(ch, addr, sizeof(header), buf, copy_header, header,
+                   false) != ESP_LOADER_SUCCESS ||
+        header[0] != BOOTLOADER_MAGIC) {
+        return 0;
+    }
+    // 1 MB to 128 MB by the high nibble
+    return header[3] >> 4 <= 7 ? (1024 * 1024) << (header[3] >> 4) : 0;
+}
+
+// The stub has the only READ_FLASH, the ROM would read 64 bytes per command
+static esp_loader_error_t read_session(channel_t *ch, uint32_t addr,
+                                       uint32_t size, uint8_t *buf,
+                                       flash_read_cb_t cb, void *ctx,
+                                       flash_read_info_t *info)
+{
+    flash_args_t args = {.stub = true};
+    if (ch->port.baud_rate != ROM_BAUDRATE) {
+        port_change_rate(&ch->port, ROM_BAUDRATE);
+    }
+    esp_loader_error_t err = open_session(ch, &args, false);
+    if (err != ESP_LOADER_SUCCESS) {
+        return err;
+    }
+    // The target found first is the one read, a fallback must find it again
+    args.chip = ch->proto.chip;
+    err = check_session(ch, &args);
+    if (err != ESP_LOADER_SUCCESS) {
+        return err;
+    }
+    if (!ch->proto.stub) {
+        ESP_LOGE(ch->tag, "Reading the flash needs the flasher stub");
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+    err = negotiate_transmission_rate(ch, &args, CONFIG_FLASH_BAUDRATE_MAX);
+    if (err != ESP_LOADER_SUCCESS) {
+        return err;
+    }
+    info->chip = ch->proto.chip;
+    info->flash_size = header_flash_size(ch, buf);
+    if (size == 0) {
+        if (info->flash_size <= addr) {
+            ESP_LOGE(ch->tag, "Unknown flash size, give the size to read");
+            return ESP_LOADER_ERROR_INVALID_PARAM;
         }
-        return;
+        size = info->flash_size - addr;
     }
 
-    if (connect_to_target(HIGHER_BAUDRATE) != ESP_LOADER_SUCCESS) {
-        goto failed;
+    ESP_LOGI(ch->tag, "Reading size: %ld, address: 0x%lX", size, addr);
+    int64_t start = esp_timer_get_time();
+    progress_begin(ch);
+    TRACE_BEGIN("read");
+    err = read_flash(ch, addr, size, buf, cb, ctx, true);
+    TRACE_END("read");
+    if (err != ESP_LOADER_SUCCESS) {
+        progress_abort(ch);
+        return err;
     }
-    if (esp_loader_get_target() != args->chip) {
-        ESP_LOGE(TAG, "Target chip error: found %d, but flash %d",
-                 esp_loader_get_target(), args->chip);
-        goto failed;
+    progress_end(ch);
+    int64_t us = esp_timer_get_time() - start;
+    info->size = size;
+    info->us = us;
+    ESP_LOGI(ch->tag, "Read %ld bytes at %ld baud in %lld ms (%lld bytes/s)",
+             size, ch->current_rate, us / 1000,
+             us > 0 ? size * 1000000LL / us : 0);
+    return ESP_LOADER_SUCCESS;
+}
+
+bool flash_read(uint32_t addr, uint32_t size, flash_read_cb_t cb, void *ctx,
+                flash_read_info_t *info)
+{
+    channel_t *ch = &channels[0];
+    memset(info, 0, sizeof(flash_read_info_t));
+    info->chip = ESP_UNKNOWN_CHIP;
+    uint8_t *buf = malloc(READ_PACKET_SIZE);
+    if (buf == NULL) {
+        ESP_LOGE(ch->tag, "Malloc %d bytes read buffer failed",
+                 READ_PACKET_SIZE);
+        return false;
     }
-    for (int i = 0; i < args->flash_files_size; i++) {
-        ESP_LOGI(TAG, "Flashing \"%s\" size: %ld, address: 0x%lX",
-                 args->flash_files[i].path, args->flash_files[i].size,
-                 args->flash_files[i].addr);
-        if (flash_binary(args->flash_files[i].path, args->flash_files[i].size,
-                         args->flash_files[i].addr) != ESP_LOADER_SUCCESS) {
-            goto failed;
+    // Like a verify, the phases replace the last cycle of the channel
+    metrics_begin(ch->id, METRICS_CYCLE_READ);
+    esp_loader_error_t err =
+        read_session(ch, addr, size, buf, cb, ctx, info);
+    metrics_end(ch->id, err);
+    free(buf);
+    return err == ESP_LOADER_SUCCESS;
+}
+#endif
+
+static void notify(channel_t *ch, flash_event_t event)
+{
+    if (job.cb != NULL) {
+        job.cb(ch->id, event);
+    }
+}
+
+// Cheap presence check, the sense pin when wired or else a single sync with
+// the ROM loader, which leaves the target synced for the session
+static bool target_present(channel_t *ch, bool *synced)
+{
+    *synced = false;
+    if (ch->port.config.sense_pin >= 0) {
+        return port_sense(&ch->port);
+    }
+    if (ch->port.baud_rate != ROM_BAUDRATE) {
+        port_change_rate(&ch->port, ROM_BAUDRATE);
+    }
+    *synced = proto_sync(&ch->proto, &ch->port, 1) == ESP_LOADER_SUCCESS;
+    return *synced;
+}
+
+// Flash every target inserted into the channel until the mode is stopped
+static void channel_auto(channel_t *ch)
+{
+    bool synced;
+
+    ESP_LOGI(ch->tag, "Waiting for a target");
+    while (!job.stop) {
+        if (!target_present(ch, &synced)) {
+            port_delay_ms(CONFIG_FLASH_AUTO_POLL_MS);
+            continue;
+        }
+        if (!synced) {
+            port_delay_ms(AUTO_SETTLE_MS); // let the contacts settle
+        }
+        notify(ch, FLASH_EVENT_START);
+        ch->success = flash_channel(ch, job.args, synced);
+        ch->units += ch->success;
+        notify(ch, ch->success ? FLASH_EVENT_DONE : FLASH_EVENT_FAILED);
+        ESP_LOGI(ch->tag, "%ld target(s) flashed, remove the target",
+                 ch->units);
+
+        // A single missed probe may be a glitch of the contacts
+        for (int misses = 0; misses < AUTO_REMOVE_MISSES && !job.stop;) {
+            port_delay_ms(CONFIG_FLASH_AUTO_POLL_MS);
+            misses = target_present(ch, &synced) ? 0 : misses + 1;
         }
+        notify(ch, FLASH_EVENT_REMOVED);
     }
+}
+
+static void channel_task(void *arg)
+{
+    channel_t *ch = arg;
 
-    ESP_LOGI(TAG, "Done!");
-    loader_port_esp32_deinit();
-    if (done) {
-        done(true);
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (job.auto_mode) {
+            channel_auto(ch);
+        } else {
+            notify(ch, FLASH_EVENT_START);
+            ch->success = job.verify ? verify_channel(ch, job.args)
+                                     : flash_channel(ch, job.args, false);
+            notify(ch, ch->success ? FLASH_EVENT_DONE : FLASH_EVENT_FAILED);
+        }
+        xSemaphoreGive(job.finished);
     }
-    return;
+}
 
-failed:
-    loader_port_esp32_deinit();
-    if (done) {
-        done(false);
+int flash_init(void)
+{
+    job.finished = xSemaphoreCreateCounting(CHANNELS, 0);
+    if (job.finished == NULL) {
+        ESP_LOGE(TAG, "Cannot create the flash semaphore");
+        return 0;
+    }
+    for (int i = 0; i < CHANNELS; i++) {
+        channel_t *ch = &channels[i];
+        ch->id = i;
+        snprintf(ch->tag, sizeof(ch->tag), CHANNELS == 1 ? "flash" : "flash%d",
+                 i);
+        ch->current_rate = ROM_BAUDRATE;
+        ch->block_size = FLASH_BLOCK_SIZE_MIN;
+        if (port_init(&ch->port, &port_configs[i], ROM_BAUDRATE) !=
+            ESP_LOADER_SUCCESS) {
+            ESP_LOGE(ch->tag, "Serial initialization failed");
+            return i;
+        }
+        if (xTaskCreate(channel_task, ch->tag, FLASH_TASK_STACK, ch,
+                        FLASH_TASK_PRIORITY, &ch->task) != pdPASS) {
+            ESP_LOGE(TAG, "Cannot create task of channel %d", i);
+            return i;
+        }
+    }
+    return CHANNELS;
+}
+
+static bool run(flash_args_t *args, flash_cb_t cb, bool auto_mode,
+                bool verify)
+{
+    int started = 0;
+
+    job.args = args;
+    job.cb = cb;
+    job.auto_mode = auto_mode;
+    job.verify = verify;
+    job.stop = false;
+    for (int i = 0; i < CHANNELS; i++) {
+        if (channels[i].task != NULL) {
+            xTaskNotifyGive(channels[i].task);
+            started++;
+        }
+    }
+    // Every channel flashes its own target from the shared cache
+    bool success = started > 0;
+    for (int i = 0; i < started; i++) {
+        xSemaphoreTake(job.finished, portMAX_DELAY);
     }
+    for (int i = 0; i < started; i++) {
+        success &= channels[i].success;
+    }
+    return success;
+}
+
+bool flash(flash_args_t *args, flash_cb_t cb)
+{
+    return run(args, cb, false, false);
+}
+
+bool flash_verify(flash_args_t *args, flash_cb_t cb)
+{
+    return run(args, cb, false, true);
+}
+
+void flash_auto(flash_args_t *args, flash_cb_t cb)
+{
+    for (int i = 0; i < CHANNELS; i++) {
+        channels[i].units = 0;
+    }
+    run(args, cb, true, false);
+}
+
+void flash_stop(void)
+{
+    job.stop = true;
 }
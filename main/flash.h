@@ -1,7 +1,46 @@
 #pragma once
 
 #include "flash_args.h"
+#include "sdkconfig.h"
 
-typedef void (*flash_cb_t)(bool);
+typedef enum {
+    FLASH_EVENT_START,   // a target is being flashed
+    FLASH_EVENT_DONE,    // the target was flashed and verified
+    FLASH_EVENT_FAILED,  // flashing the target failed
+    FLASH_EVENT_REMOVED, // auto mode only, waiting for the next target
+} flash_event_t;
 
-void flash(flash_args_t *args, flash_cb_t done);
+typedef void (*flash_cb_t)(int channel, flash_event_t event);
+
+// Open one port and start one task per configured flash UART, returns the
+// number of channels
+int flash_init(void);
+
+// Flash the job on every channel in parallel, cb is called from the channel
+// tasks. Returns when all channels are done.
+bool flash(flash_args_t *args, flash_cb_t cb);
+// Like flash() but only compares the digests of the writes with the targets
+bool flash_verify(flash_args_t *args, flash_cb_t cb);
+
+// Flash every target inserted into any channel, one after another, until
+// flash_stop() is called. Returns once all channels are idle.
+void flash_auto(flash_args_t *args, flash_cb_t cb);
+void flash_stop(void);
+
+// Takes the flash read back in order, false stops the read
+typedef bool (*flash_read_cb_t)(const uint8_t *data, size_t size, void *ctx);
+
+#if CONFIG_FLASH_READBACK
+typedef struct {
+    target_chip_t chip;
+    uint32_t flash_size; // of the bootloader image header, 0 if unknown
+    uint32_t size;       // bytes read
+    int64_t us;          // spent reading them
+} flash_read_info_t;
+
+// Reads the flash of the target on the first channel with the flasher stub
+// at the negotiated rate, from the calling task while no channel flashes. A
+// size of 0 reads up to the flash size of the bootloader header.
+bool flash_read(uint32_t addr, uint32_t size, flash_read_cb_t cb, void *ctx,
+                flash_read_info_t *info);
+#endif
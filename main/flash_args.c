@@ -1,14 +1,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/param.h>
 #include <sys/stat.h>
 
 #include "cJSON.h"
 #include "esp_log.h"
+#include "esp_rom_md5.h"
 #include "flash_args.h"
+#include "gz.h"
+#include "trace.h"
 
 static const char *TAG = "flash_args";
 
+#define FLASH_SECTOR_SIZE 0x1000
+
 static target_chip_t parse_chip(char *str)
 {
     if (strncmp("esp", str, 3) == 0) {
@@ -47,7 +53,7 @@ static target_chip_t parse_chip(char *str)
     return ESP_UNKNOWN_CHIP;
 }
 
-static const char *dump_chip(target_chip_t chip)
+const char *flash_args_chip_name(target_chip_t chip)
 {
     switch (chip) {
     case ESP8266_CHIP:
@@ -71,10 +77,93 @@ static const char *dump_chip(target_chip_t chip)
     }
 }
 
+// "2MB", "4MB"... of flash_settings, 0 for "detect", "keep" or unknown
+static uint32_t parse_flash_size(const char *str)
+{
+    char *end;
+    uint32_t size = strtoul(str, &end, 10);
+    if (end == str) {
+        return 0;
+    } else if (strcmp(end, "MB") == 0) {
+        return size * 1024 * 1024;
+    } else if (strcmp(end, "KB") == 0) {
+        return size * 1024;
+    }
+    return 0;
+}
+
+static flash_erase_t parse_erase(const char *str)
+{
+    if (strcmp(str, "region") == 0) {
+        return FLASH_ERASE_REGION;
+    } else if (strcmp(str, "chip") == 0) {
+        return FLASH_ERASE_CHIP;
+    }
+    return FLASH_ERASE_AUTO;
+}
+
+static const char *dump_erase(flash_erase_t erase)
+{
+    switch (erase) {
+    case FLASH_ERASE_REGION:
+        return "region";
+    case FLASH_ERASE_CHIP:
+        return "chip";
+    default:
+        return "auto";
+    }
+}
+
+static int compare_parts(const void *a, const void *b)
+{
+    const flash_part_t *pa = a, *pb = b;
+    return pa->addr < pb->addr ? -1 : pa->addr > pb->addr;
+}
+
+// Sort the files by address and merge the ones whose gap lies in sectors
+// erased anyway. Every write costs a begin and its verify, and sectors shared
+// by two writes would be erased twice, the second erase wiping the tail of
+// the first file. A whole sector in between is left alone, like the NVS
+// between the partition table and the app.
+static bool plan(flash_args_t *args)
+{
+    flash_part_t *parts = args->flash_parts;
+    int n = args->flash_parts_size;
+
+    qsort(parts, n, sizeof(flash_part_t), compare_parts);
+    for (int i = 1; i < n; i++) {
+        if (parts[i - 1].addr + parts[i - 1].size > parts[i].addr) {
+            ESP_LOGE(TAG, "\"%s\" at 0x%lX overlaps \"%s\" at 0x%lX",
+                     parts[i - 1].path, parts[i - 1].addr, parts[i].path,
+                     parts[i].addr);
+            return false;
+        }
+    }
+
+    flash_file_t *file = NULL;
+    for (int i = 0; i < n; i++) {
+        uint32_t end = file != NULL ? file->addr + file->size : 0;
+        if (file != NULL && parts[i].addr / FLASH_SECTOR_SIZE <=
+                                (end + FLASH_SECTOR_SIZE - 1) /
+                                    FLASH_SECTOR_SIZE) {
+            file->size = parts[i].addr + parts[i].size - file->addr;
+            file->parts_size++;
+            continue;
+        }
+        file = &args->flash_files[args->flash_files_size++];
+        file->addr = parts[i].addr;
+        file->size = parts[i].size;
+        file->parts = &parts[i];
+        file->parts_size = 1;
+    }
+    return true;
+}
+
 flash_args_t *flash_args_from_json(const char *json, uint32_t length,
                                    const char *base_path)
 {
     flash_args_t *args = NULL;
+    md5_context_t md5;
     size_t base_path_len = strlen(base_path) + 2; // "{$base_path}/{$path}\0"
     cJSON *root = cJSON_ParseWithLength(json, length);
     if (root == NULL) {
@@ -95,39 +184,58 @@ flash_args_t *flash_args_from_json(const char *json, uint32_t length,
         ESP_LOGE(TAG, "Invalid \"flash_files\" size\n");
         goto failed;
     }
-    size_t s = sizeof(flash_args_t) + sizeof(flash_file_t) * size;
+    // The plan has at most one write per file, the paths follow the parts
+    size_t dir_len = strlen(base_path) + 1;
+    size_t s = sizeof(flash_args_t) + sizeof(flash_file_t) * size +
+               sizeof(flash_part_t) * size + dir_len;
+    for (const cJSON *i = flash_files->child; i != NULL; i = i->next) {
+        if (!cJSON_IsString(i)) {
+            ESP_LOGE(TAG, "Invalid \"flash_files\" entry \"%s\"\n", i->string);
+            goto failed;
+        }
+        s += base_path_len + strlen(i->valuestring);
+    }
     args = malloc(s);
     if (args == NULL) {
         ESP_LOGE(TAG, "Malloc flash_args %d bytes failed\n", s);
         goto failed;
     }
     memset(args, 0, s);
+    args->arena_size = s;
+    args->flash_parts = (flash_part_t *)&args->flash_files[size];
+    char *str = (char *)&args->flash_parts[size];
+    args->dir = strcpy(str, base_path);
+    str += dir_len;
+    esp_rom_md5_init(&md5);
+    esp_rom_md5_update(&md5, json, length);
+    esp_rom_md5_final(args->manifest_md5, &md5);
     args->chip = ESP_UNKNOWN_CHIP;
-    args->flash_files_size = size;
+    args->stub = true;
+#ifdef CONFIG_FLASH_DIFF
+    args->diff = true;
+#endif
+    args->flash_parts_size = size;
     int n = 0;
     for (const cJSON *i = flash_files->child; i != NULL; i = i->next) {
-        size_t s = base_path_len + strlen(i->valuestring);
-        char *path = malloc(s);
-        if (path == NULL) {
-            ESP_LOGE(TAG,
-                     "Malloc flash_args.flash_files[%d].path %d bytes "
-                     "failed\n",
-                     n, s);
-            goto failed;
-        }
-        strcpy(path, base_path);
-        strcat(path, "/");
-        strcat(path, i->valuestring);
+        flash_part_t *part = &args->flash_parts[n++];
+        part->path = str;
+        str += sprintf(str, "%s/%s", base_path, i->valuestring) + 1;
+        // A gzip part is flashed inflated
         struct stat st;
-        if (stat(path, &st) == 0) {
-            args->flash_files[n].size = st.st_size;
+        if (gz_path(part->path)) {
+            if (!gz_size(part->path, &part->size)) {
+                goto failed;
+            }
+        } else if (stat(part->path, &st) == 0) {
+            part->size = st.st_size;
         } else {
-            ESP_LOGE(TAG, "Flash file \"%s\" is not exists\n", path);
+            ESP_LOGE(TAG, "Flash file \"%s\" is not exists\n", part->path);
             goto failed;
         }
-        args->flash_files[n].addr = strtoul(i->string, NULL, 0);
-        args->flash_files[n].path = path;
-        n++;
+        part->addr = strtoul(i->string, NULL, 0);
+    }
+    if (!plan(args)) {
+        goto failed;
     }
     const cJSON *extra = cJSON_GetObjectItem(root, "extra_esptool_args");
     if (extra != NULL) {
@@ -135,6 +243,36 @@ flash_args_t *flash_args_from_json(const char *json, uint32_t length,
         if (chip != NULL) {
             args->chip = parse_chip(chip->valuestring);
         }
+        const cJSON *stub = cJSON_GetObjectItem(extra, "stub");
+        if (cJSON_IsBool(stub)) {
+            args->stub = cJSON_IsTrue(stub);
+        }
+    }
+    const cJSON *settings = cJSON_GetObjectItem(root, "flash_settings");
+    if (settings != NULL) {
+        const cJSON *flash_size = cJSON_GetObjectItem(settings, "flash_size");
+        if (cJSON_IsString(flash_size)) {
+            args->flash_size = parse_flash_size(flash_size->valuestring);
+        }
+    }
+    const cJSON *flasher = cJSON_GetObjectItem(root, "flasher");
+    if (flasher != NULL) {
+        const cJSON *baud = cJSON_GetObjectItem(flasher, "baud");
+        if (cJSON_IsNumber(baud)) {
+            args->baud = baud->valueint;
+        }
+        const cJSON *block_size = cJSON_GetObjectItem(flasher, "block_size");
+        if (cJSON_IsNumber(block_size)) {
+            args->block_size = block_size->valueint;
+        }
+        const cJSON *diff = cJSON_GetObjectItem(flasher, "diff");
+        if (cJSON_IsBool(diff)) {
+            args->diff = cJSON_IsTrue(diff);
+        }
+        const cJSON *erase = cJSON_GetObjectItem(flasher, "erase");
+        if (cJSON_IsString(erase)) {
+            args->erase = parse_erase(erase->valuestring);
+        }
     }
 
     cJSON_Delete(root);
@@ -152,25 +290,363 @@ void flash_args_free(flash_args_t *args)
         return;
     }
     for (int i = 0; i < args->flash_files_size; i++) {
-        if (args->flash_files[i].path != NULL) {
-            free(args->flash_files[i].path);
+        if (args->flash_files[i].data != NULL &&
+            !args->flash_files[i].mapped) {
+            free(args->flash_files[i].data);
+        }
+        if (args->flash_files[i].zdata != NULL) {
+            free(args->flash_files[i].zdata);
         }
+        if (args->flash_files[i].region_md5 != NULL) {
+            free(args->flash_files[i].region_md5);
+        }
+        free(args->flash_files[i].extents);
     }
     free(args);
 }
 
+#define PLAN_MAGIC 0x4e414c50 // "PLAN"
+#define PLAN_VERSION 4
+
+#define SHIFT(ptr, delta) ((void *)((intptr_t)(ptr) + (delta)))
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;     // of this header and the layout of flash_args_t
+    uint32_t region_size; // CONFIG_FLASH_DIFF_REGION_SIZE of the digests
+    uint32_t arena_size;
+} plan_header_t;
+
+static uint32_t regions_of(const flash_file_t *file)
+{
+    const uint32_t region = CONFIG_FLASH_DIFF_REGION_SIZE;
+    return (file->size + region - 1) / region;
+}
+
+// Move every pointer into the arena by delta, the parts are located by the
+// layout of flash_args_from_json() since the pointers may be offsets
+static void relocate(flash_args_t *args, intptr_t delta)
+{
+    flash_part_t *parts =
+        (flash_part_t *)&args->flash_files[args->flash_parts_size];
+
+    args->dir = SHIFT(args->dir, delta);
+    args->flash_parts = SHIFT(args->flash_parts, delta);
+    for (int i = 0; i < args->flash_parts_size; i++) {
+        parts[i].path = SHIFT(parts[i].path, delta);
+    }
+    for (int i = 0; i < args->flash_files_size; i++) {
+        args->flash_files[i].parts = SHIFT(args->flash_files[i].parts, delta);
+    }
+}
+
+// The offsets of an unpacked arena, before relocate(): the strings lie after
+// the layout and end within the arena, the parts of a write are its own
+static bool offset_in(const flash_args_t *args, size_t layout, const char *str)
+{
+    uintptr_t off = (uintptr_t)str;
+    return off >= layout && off < args->arena_size &&
+           memchr((const char *)args + off, '\0', args->arena_size - off);
+}
+
+static bool offsets_valid(const flash_args_t *args, size_t layout)
+{
+    const flash_part_t *parts =
+        (const flash_part_t *)&args->flash_files[args->flash_parts_size];
+    uintptr_t first = (uintptr_t)parts - (uintptr_t)args;
+
+    if ((uintptr_t)args->flash_parts != first ||
+        !offset_in(args, layout, args->dir)) {
+        return false;
+    }
+    for (int i = 0; i < args->flash_parts_size; i++) {
+        if (!offset_in(args, layout, parts[i].path)) {
+            return false;
+        }
+    }
+    for (int i = 0; i < args->flash_files_size; i++) {
+        const flash_file_t *file = &args->flash_files[i];
+        uintptr_t off = (uintptr_t)file->parts;
+        if (off < first || (off - first) % sizeof(flash_part_t) != 0 ||
+            file->parts_size <= 0 ||
+            (off - first) / sizeof(flash_part_t) + file->parts_size >
+                (uintptr_t)args->flash_parts_size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool flash_args_compiled_from(const flash_args_t *args, const char *json,
+                              uint32_t length)
+{
+    md5_context_t md5;
+    uint8_t digest[16];
+
+    esp_rom_md5_init(&md5);
+    esp_rom_md5_update(&md5, json, length);
+    esp_rom_md5_final(digest, &md5);
+    return memcmp(digest, args->manifest_md5, sizeof(digest)) == 0;
+}
+
+size_t flash_args_pack(const flash_args_t *args, uint8_t **blob)
+{
+    size_t size = sizeof(plan_header_t) + args->arena_size;
+    for (int i = 0; i < args->flash_files_size; i++) {
+        const flash_file_t *file = &args->flash_files[i];
+        if (file->hashed) {
+            size += regions_of(file) * 16;
+        }
+    }
+    uint8_t *buf = malloc(size);
+    if (buf == NULL) {
+        ESP_LOGE(TAG, "Malloc %d bytes plan failed", size);
+        return 0;
+    }
+    plan_header_t *header = (plan_header_t *)buf;
+    header->magic = PLAN_MAGIC;
+    header->version = PLAN_VERSION;
+    header->region_size = CONFIG_FLASH_DIFF_REGION_SIZE;
+    header->arena_size = args->arena_size;
+
+    flash_args_t *copy = (flash_args_t *)(header + 1);
+    memcpy(copy, args, args->arena_size);
+    relocate(copy, -(intptr_t)args);
+    uint8_t *digests = (uint8_t *)copy + args->arena_size;
+    for (int i = 0; i < copy->flash_files_size; i++) {
+        flash_file_t *file = &copy->flash_files[i];
+        if (file->hashed) {
+            memcpy(digests, file->region_md5, regions_of(file) * 16);
+            digests += regions_of(file) * 16;
+        }
+        file->data = NULL;
+        file->mapped = false;
+        file->zdata = NULL;
+        file->zsize = 0;
+        file->extents = NULL;
+        file->extents_size = 0;
+        file->region_md5 = NULL;
+        file->read = false;
+    }
+    *blob = buf;
+    return size;
+}
+
+flash_args_t *flash_args_unpack(const uint8_t *blob, size_t size)
+{
+    const plan_header_t *header = (const plan_header_t *)blob;
+    if (size < sizeof(plan_header_t) + sizeof(flash_args_t) ||
+        header->magic != PLAN_MAGIC || header->version != PLAN_VERSION ||
+        header->region_size != CONFIG_FLASH_DIFF_REGION_SIZE ||
+        header->arena_size < sizeof(flash_args_t) ||
+        header->arena_size > size - sizeof(plan_header_t)) {
+        ESP_LOGW(TAG, "Plan of another version or truncated");
+        return NULL;
+    }
+    flash_args_t *args = malloc(header->arena_size);
+    if (args == NULL) {
+        ESP_LOGE(TAG, "Malloc flash_args %ld bytes failed", header->arena_size);
+        return NULL;
+    }
+    memcpy(args, header + 1, header->arena_size);
+    // Bounded first, so the layout cannot wrap
+    const size_t per_part = sizeof(flash_file_t) + sizeof(flash_part_t);
+    int parts_max = (header->arena_size - sizeof(flash_args_t)) / per_part;
+    if (args->flash_parts_size <= 0 || args->flash_parts_size > parts_max) {
+        ESP_LOGW(TAG, "Plan damaged");
+        free(args);
+        return NULL;
+    }
+    size_t layout = sizeof(flash_args_t) + per_part * args->flash_parts_size;
+    if (args->arena_size != header->arena_size ||
+        args->flash_files_size < 0 ||
+        args->flash_files_size > args->flash_parts_size ||
+        layout > args->arena_size ||
+        ((char *)args)[args->arena_size - 1] != '\0' ||
+        !offsets_valid(args, layout)) {
+        ESP_LOGW(TAG, "Plan damaged");
+        free(args);
+        return NULL;
+    }
+    relocate(args, (intptr_t)args);
+
+    const uint8_t *digests = (const uint8_t *)(header + 1) + args->arena_size;
+    const uint8_t *end = blob + size;
+    for (int i = 0; i < args->flash_files_size; i++) {
+        flash_file_t *file = &args->flash_files[i];
+        // pack cleared these, a damaged blob must not hand them to free()
+        file->data = NULL;
+        file->mapped = false;
+        file->zdata = NULL;
+        file->zsize = 0;
+        file->extents = NULL;
+        file->extents_size = 0;
+        file->region_md5 = NULL;
+        file->read = false;
+        if (!file->hashed) {
+            continue;
+        }
+        size_t len = regions_of(file) * 16;
+        const uint8_t *src = digests;
+        digests += len;
+        file->hashed = false;
+        if (digests > end) {
+            ESP_LOGW(TAG, "Plan without the digests of 0x%lX", file->addr);
+            continue;
+        }
+        file->region_md5 = malloc(MAX(len, 1));
+        if (file->region_md5 != NULL) {
+            memcpy(file->region_md5, src, len);
+            file->hashed = true;
+        }
+    }
+    return args;
+}
+
 void flash_args_dump(flash_args_t *args)
 {
     if (args == NULL) {
         return;
     }
-    ESP_LOGI(TAG, "Flash chip: %s(%d)", dump_chip(args->chip), args->chip);
-    ESP_LOGI(TAG, "Flash %d file(s):", args->flash_files_size);
+    ESP_LOGI(TAG, "Flash chip: %s(%d)", flash_args_chip_name(args->chip),
+             args->chip);
+    if (args->baud != 0) {
+        ESP_LOGI(TAG, "Flash baud: %ld", args->baud);
+    }
+    if (args->flash_size != 0) {
+        ESP_LOGI(TAG, "Flash size: %ld KB", args->flash_size / 1024);
+    }
+    ESP_LOGI(TAG, "Flash stub: %s", args->stub ? "yes" : "no");
+    if (args->block_size != 0) {
+        ESP_LOGI(TAG, "Flash block size: %ld", args->block_size);
+    }
+    ESP_LOGI(TAG, "Flash diff: %s", args->diff ? "yes" : "no");
+    ESP_LOGI(TAG, "Flash erase: %s", dump_erase(args->erase));
+    ESP_LOGI(TAG, "Flash %d file(s) in %d write(s):", args->flash_parts_size,
+             args->flash_files_size);
     for (int i = 0; i < args->flash_files_size; i++) {
+        const flash_file_t *file = &args->flash_files[i];
         printf("  - \033[1;37maddr\033[0m: \033[1;36m0x%lx\033[0m\n"
-               "    \033[1;37msize\033[0m: \033[1;36m%ld\033[0m\n"
-               "    \033[1;37mpath\033[0m: \033[1;32m%s\033[0m\n",
-               args->flash_files[i].addr, args->flash_files[i].size,
-               args->flash_files[i].path);
+               "    \033[1;37msize\033[0m: \033[1;36m%ld\033[0m\n",
+               file->addr, file->size);
+        if (file->parts_size == 1) {
+            printf("    \033[1;37mpath\033[0m: \033[1;32m%s\033[0m\n",
+                   file->parts[0].path);
+        } else {
+            uint32_t padding = file->size;
+            printf("    \033[1;37mmerged\033[0m:\n");
+            for (int j = 0; j < file->parts_size; j++) {
+                const flash_part_t *part = &file->parts[j];
+                printf("      - \033[1;32m%s\033[0m at "
+                       "\033[1;36m0x%lx\033[0m, \033[1;36m%ld\033[0m\n",
+                       part->path, part->addr, part->size);
+                padding -= part->size;
+            }
+            printf("    \033[1;37mpadding\033[0m: \033[1;36m%ld\033[0m\n",
+                   padding);
+        }
+        if (file->data != NULL) {
+            printf("    \033[1;37mcached\033[0m: \033[1;36m%s\033[0m\n",
+                   file->mapped ? "mapped" : "yes");
+        }
+        if (file->zdata != NULL) {
+            printf("    \033[1;37mzsize\033[0m: \033[1;36m%ld\033[0m\n",
+                   file->zsize);
+        }
+        if (file->extents != NULL) {
+            uint32_t used = 0;
+            for (int j = 0; j < file->extents_size; j++) {
+                used += file->extents[j].size;
+            }
+            printf("    \033[1;37mblank\033[0m: \033[1;36m%ld\033[0m\n",
+                   file->size - used);
+        }
+    }
+}
+
+void flash_reader_open(flash_reader_t *r, const flash_file_t *file,
+                       uint32_t offset)
+{
+    r->file = file;
+    r->part = 0;
+    r->fp = NULL;
+    r->gz = NULL;
+    r->pos = offset;
+}
+
+static void close_part(flash_reader_t *r)
+{
+    if (r->fp != NULL) {
+        fclose(r->fp);
+        r->fp = NULL;
+    }
+    gz_close(r->gz);
+    r->gz = NULL;
+}
+
+// A gzip part cannot seek, it is inflated up to the offset
+static bool open_part(flash_reader_t *r, const flash_part_t *part,
+                      uint32_t offset)
+{
+    bool ok;
+    if (gz_path(part->path)) {
+        r->gz = gz_open(part->path);
+        ok = r->gz != NULL && (offset == 0 || gz_skip(r->gz, offset));
+    } else {
+        r->fp = fopen(part->path, "rb");
+        ok = r->fp != NULL &&
+             (offset == 0 || fseek(r->fp, offset, SEEK_SET) == 0);
     }
+    if (!ok) {
+        ESP_LOGE(TAG, "Cannot read \"%s\" from %ld", part->path, offset);
+        close_part(r);
+    }
+    return ok;
+}
+
+size_t flash_reader_read(flash_reader_t *r, uint8_t *buf, size_t size)
+{
+    const flash_file_t *file = r->file;
+    size_t done = 0;
+
+    while (done < size && r->pos < file->size) {
+        const flash_part_t *part = &file->parts[r->part];
+        uint32_t start = part->addr - file->addr;
+        uint32_t end = start + part->size;
+        if (r->pos >= end) {
+            // Parts are sorted and the last one ends the write
+            close_part(r);
+            r->part++;
+            continue;
+        }
+        size_t n;
+        if (r->pos < start) {
+            n = MIN(size - done, start - r->pos);
+            memset(buf + done, 0xff, n);
+        } else {
+            if (r->fp == NULL && r->gz == NULL &&
+                !open_part(r, part, r->pos - start)) {
+                break;
+            }
+            size_t to_read = MIN(size - done, end - r->pos);
+            if (r->gz != NULL) {
+                n = gz_read(r->gz, buf + done, to_read);
+            } else {
+                TRACE_BEGIN("fat_read");
+                n = fread(buf + done, 1, to_read, r->fp);
+                TRACE_END("fat_read");
+            }
+            if (n == 0) {
+                break;
+            }
+        }
+        done += n;
+        r->pos += n;
+    }
+    return done;
+}
+
+void flash_reader_close(flash_reader_t *r)
+{
+    close_part(r);
 }
@@ -1,22 +1,98 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdio.h>
 
 #include "esp_loader.h"
+#include "gz.h"
 
+// A file of flash_files
 typedef struct {
     uint32_t addr;
     char *path;
     uint32_t size;
+} flash_part_t;
+
+// A run of sectors of a write holding more than erased flash
+typedef struct {
+    uint32_t offset; // in the write, sector aligned
+    uint32_t size;
+} flash_extent_t;
+
+// One write of the plan. Files whose gap lies in sectors erased anyway are
+// merged into one image, the gaps padded as erased flash.
+typedef struct {
+    uint32_t addr;
+    uint32_t size;
+    int parts_size;
+    flash_part_t *parts; // sorted by address
+    uint8_t *data;  // image cached in PSRAM, NULL if read from storage
+    bool mapped;    // data maps the file in flash instead, it is not freed
+    uint8_t *zdata; // deflated image in PSRAM, NULL if not compressed
+    uint32_t zsize;
+    flash_extent_t *extents; // sorted, NULL if not known
+    int extents_size;
+    bool hashed;     // the digests below are known
+    bool read;       // read since boot, data and zdata are final
+    uint8_t md5[16]; // digest of the whole image
+    uint8_t (*region_md5)[16]; // digests of CONFIG_FLASH_DIFF_REGION_SIZE
+                               // regions
 } flash_file_t;
 
+typedef enum {
+    FLASH_ERASE_AUTO,   // see CONFIG_FLASH_ERASE_CHIP_PERCENT
+    FLASH_ERASE_REGION, // each write erases its sectors, ahead of the data
+                        // with the stub and up front with the ROM
+    FLASH_ERASE_CHIP,   // the whole flash once before the writes
+} flash_erase_t;
+
+// One allocation holds the struct, its writes, the files and their paths. The
+// PSRAM images and the region digests are allocated on their own.
 typedef struct {
+    uint32_t arena_size;
+    uint8_t manifest_md5[16]; // of the flasher_args.json compiled
+    char *dir;                // where the job lives
     target_chip_t chip;
-    int flash_files_size;
+    uint32_t baud; // ceiling of the negotiated rate, 0 uses the Kconfig one
+    bool stub;     // run the flasher stub, "stub" of extra_esptool_args
+    uint32_t block_size; // bytes per flash packet, 0 picks one per loader
+    bool diff;           // only rewrite the regions that differ
+    flash_erase_t erase;
+    uint32_t flash_size; // bytes of flash_settings, 0 if not given
+    int flash_parts_size;
+    flash_part_t *flash_parts; // the files, sorted by address
+    int flash_files_size;      // writes of the plan
     flash_file_t flash_files[];
 } flash_args_t;
 
+// Reads a write of the plan, the gaps between merged files read as 0xFF
+typedef struct {
+    const flash_file_t *file;
+    int part;
+    FILE *fp;        // of the current part
+    gz_reader_t *gz; // instead of fp for a gzip part
+    uint32_t pos;
+} flash_reader_t;
+
+// Parses and plans the job, overlapping files are an error
 flash_args_t *flash_args_from_json(const char *json, uint32_t length,
                                    const char *base_path);
 void flash_args_free(flash_args_t *args);
 void flash_args_dump(flash_args_t *args);
+// The name of extra_esptool_args, "UNKNOWN" for none
+const char *flash_args_chip_name(target_chip_t chip);
+bool flash_args_compiled_from(const flash_args_t *args, const char *json,
+                              uint32_t length);
+
+// The compiled plan: a versioned header, the arena with offsets in place of
+// the pointers and the region digests known. Returns the size of the
+// allocated blob, 0 on failure.
+size_t flash_args_pack(const flash_args_t *args, uint8_t **blob);
+// Writes whose digests came with the blob are hashed but not read
+flash_args_t *flash_args_unpack(const uint8_t *blob, size_t size);
+
+void flash_reader_open(flash_reader_t *r, const flash_file_t *file,
+                       uint32_t offset);
+// Returns less than size at the end of the write or on a read error
+size_t flash_reader_read(flash_reader_t *r, uint8_t *buf, size_t size);
+void flash_reader_close(flash_reader_t *r);
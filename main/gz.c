@@ -0,0 +1,321 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/param.h>
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "gz.h"
+#include "trace.h"
+#if CONFIG_IDF_TARGET_ESP32S2
+#include "esp32s2/rom/miniz.h"
+#elif CONFIG_IDF_TARGET_ESP32S3
+#include "esp32s3/rom/miniz.h"
+#endif
+
+static const char *TAG = "gz";
+
+#define GZ_MAGIC1 0x1f
+#define GZ_MAGIC2 0x8b
+#define GZ_DEFLATE 8
+#define GZ_FHCRC 0x02
+#define GZ_FEXTRA 0x04
+#define GZ_FNAME 0x08
+#define GZ_FCOMMENT 0x10
+#define GZ_OS_UNKNOWN 0xff
+#define GZ_HEADER_SIZE 10
+#define GZ_TRAILER_SIZE 8
+#define GZ_IN_SIZE 4096
+// Few probes and greedy parsing, the readback deflates at the line rate
+#define GZ_DEFLATE_FLAGS (TDEFL_GREEDY_PARSING_FLAG | 16)
+
+struct gz_reader {
+    FILE *fp;
+    tinfl_decompressor inflator;
+    tinfl_status status;
+    bool eof;
+    bool failed;
+    uint8_t in[GZ_IN_SIZE];
+    size_t in_pos;
+    size_t in_len;
+    // The inflator refers back into the last 32 KiB it wrote, it wraps
+    uint8_t dict[TINFL_LZ_DICT_SIZE];
+    size_t dict_pos;
+    size_t out_pos; // of the inflated bytes not taken yet
+    size_t out_len;
+    uint32_t crc;
+    uint32_t size;
+};
+
+struct gz_writer {
+    FILE *fp;
+    tdefl_compressor deflator;
+    bool failed;
+    uint32_t crc;
+    uint32_t size;
+    uint32_t zsize;
+};
+
+static void put_u32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+bool gz_path(const char *path)
+{
+    size_t len = strlen(path);
+    return len > 3 && strcasecmp(path + len - 3, ".gz") == 0;
+}
+
+bool gz_size(const char *path, uint32_t *size)
+{
+    uint8_t trailer[4];
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return false;
+    }
+    bool ok = fgetc(fp) == GZ_MAGIC1 && fgetc(fp) == GZ_MAGIC2 &&
+              fseek(fp, -(long)sizeof(trailer), SEEK_END) == 0 &&
+              fread(trailer, 1, sizeof(trailer), fp) == sizeof(trailer);
+    fclose(fp);
+    if (!ok) {
+        ESP_LOGE(TAG, "\"%s\" is no gzip file", path);
+        return false;
+    }
+    *size = get_u32(trailer);
+    return true;
+}
+
+static bool skip_string(FILE *fp)
+{
+    int c;
+    while ((c = fgetc(fp)) != EOF && c != '\0') {
+    }
+    return c != EOF;
+}
+
+// Past the header, whatever optional fields gzip wrote
+static bool read_header(FILE *fp)
+{
+    uint8_t h[GZ_HEADER_SIZE];
+    if (fread(h, 1, sizeof(h), fp) != sizeof(h) || h[0] != GZ_MAGIC1 ||
+        h[1] != GZ_MAGIC2 || h[2] != GZ_DEFLATE) {
+        return false;
+    }
+    if (h[3] & GZ_FEXTRA) {
+        uint8_t len[2];
+        if (fread(len, 1, sizeof(len), fp) != sizeof(len) ||
+            fseek(fp, len[0] | len[1] << 8, SEEK_CUR) != 0) {
+            return false;
+        }
+    }
+    if ((h[3] & GZ_FNAME) && !skip_string(fp)) {
+        return false;
+    }
+    if ((h[3] & GZ_FCOMMENT) && !skip_string(fp)) {
+        return false;
+    }
+    return !(h[3] & GZ_FHCRC) || fseek(fp, 2, SEEK_CUR) == 0;
+}
+
+gz_reader_t *gz_open(const char *path)
+{
+    gz_reader_t *gz =
+        heap_caps_malloc(sizeof(gz_reader_t), MALLOC_CAP_SPIRAM |
+                                                  MALLOC_CAP_8BIT);
+    if (gz == NULL) {
+        ESP_LOGE(TAG, "Cannot allocate the inflate state");
+        return NULL;
+    }
+    gz->fp = fopen(path, "rb");
+    if (gz->fp == NULL || !read_header(gz->fp)) {
+        ESP_LOGE(TAG, "Cannot open \"%s\" as gzip file", path);
+        gz_close(gz);
+        return NULL;
+    }
+    tinfl_init(&gz->inflator);
+    gz->status = TINFL_STATUS_NEEDS_MORE_INPUT;
+    gz->eof = false;
+    gz->failed = false;
+    gz->in_pos = 0;
+    gz->in_len = 0;
+    gz->dict_pos = 0;
+    gz->out_pos = 0;
+    gz->out_len = 0;
+    gz->crc = 0;
+    gz->size = 0;
+    return gz;
+}
+
+// The trailer follows the deflated stream, partly still in the input
+static bool check_trailer(gz_reader_t *gz)
+{
+    uint8_t trailer[GZ_TRAILER_SIZE];
+    size_t n = MIN(gz->in_len - gz->in_pos, sizeof(trailer));
+    memcpy(trailer, gz->in + gz->in_pos, n);
+    if (fread(trailer + n, 1, sizeof(trailer) - n, gz->fp) !=
+        sizeof(trailer) - n) {
+        ESP_LOGE(TAG, "gzip trailer missing");
+        return false;
+    }
+    if (get_u32(trailer) != gz->crc || get_u32(trailer + 4) != gz->size) {
+        ESP_LOGE(TAG, "gzip CRC or size mismatch");
+        return false;
+    }
+    return true;
+}
+
+// Inflates the next bytes into the dictionary, they are taken from there
+static void inflate_more(gz_reader_t *gz)
+{
+    if (gz->in_pos == gz->in_len && !gz->eof) {
+        TRACE_BEGIN("fat_read");
+        gz->in_len = fread(gz->in, 1, sizeof(gz->in), gz->fp);
+        TRACE_END("fat_read");
+        gz->in_pos = 0;
+        gz->eof = gz->in_len < sizeof(gz->in);
+    }
+    size_t in_size = gz->in_len - gz->in_pos;
+    size_t out_size = sizeof(gz->dict) - gz->dict_pos;
+    gz->status = tinfl_decompress(
+        &gz->inflator, gz->in + gz->in_pos, &in_size, gz->dict,
+        gz->dict + gz->dict_pos, &out_size,
+        gz->eof ? 0 : TINFL_FLAG_HAS_MORE_INPUT);
+    gz->in_pos += in_size;
+    gz->crc = esp_rom_crc32_le(gz->crc, gz->dict + gz->dict_pos, out_size);
+    gz->size += out_size;
+    gz->out_pos = gz->dict_pos;
+    gz->out_len = out_size;
+    gz->dict_pos = (gz->dict_pos + out_size) % sizeof(gz->dict);
+
+    if (gz->status == TINFL_STATUS_DONE) {
+        gz->failed = !check_trailer(gz);
+    } else if (gz->status < 0 ||
+               (gz->status == TINFL_STATUS_NEEDS_MORE_INPUT && gz->eof &&
+                gz->in_pos == gz->in_len)) {
+        ESP_LOGE(TAG, "Inflate failed: %d", gz->status);
+        gz->failed = true;
+    }
+    if (gz->failed) {
+        gz->out_len = 0;
+    }
+}
+
+// Copies the inflated bytes into buf, or drops them without one
+static size_t take(gz_reader_t *gz, uint8_t *buf, size_t size)
+{
+    size_t done = 0;
+    while (done < size) {
+        if (gz->out_len == 0) {
+            if (gz->status == TINFL_STATUS_DONE || gz->failed) {
+                break;
+            }
+            inflate_more(gz);
+            continue;
+        }
+        size_t n = MIN(size - done, gz->out_len);
+        if (buf != NULL) {
+            memcpy(buf + done, gz->dict + gz->out_pos, n);
+        }
+        gz->out_pos += n;
+        gz->out_len -= n;
+        done += n;
+    }
+    return done;
+}
+
+size_t gz_read(gz_reader_t *gz, uint8_t *buf, size_t size)
+{
+    return take(gz, buf, size);
+}
+
+bool gz_skip(gz_reader_t *gz, size_t size)
+{
+    return take(gz, NULL, size) == size;
+}
+
+void gz_close(gz_reader_t *gz)
+{
+    if (gz == NULL) {
+        return;
+    }
+    if (gz->fp != NULL) {
+        fclose(gz->fp);
+    }
+    free(gz);
+}
+
+static mz_bool put(const void *buf, int len, void *user)
+{
+    gz_writer_t *gz = user;
+    gz->zsize += len;
+    return fwrite(buf, 1, len, gz->fp) == len;
+}
+
+gz_writer_t *gz_create(const char *path)
+{
+    gz_writer_t *gz =
+        heap_caps_malloc(sizeof(gz_writer_t), MALLOC_CAP_SPIRAM |
+                                                  MALLOC_CAP_8BIT);
+    if (gz == NULL) {
+        ESP_LOGE(TAG, "Cannot allocate the deflate state");
+        return NULL;
+    }
+    gz->fp = fopen(path, "wb");
+    if (gz->fp == NULL) {
+        ESP_LOGE(TAG, "Cannot create \"%s\"", path);
+        free(gz);
+        return NULL;
+    }
+    gz->failed = false;
+    gz->crc = 0;
+    gz->size = 0;
+    gz->zsize = GZ_HEADER_SIZE;
+    const uint8_t header[GZ_HEADER_SIZE] = {
+        GZ_MAGIC1, GZ_MAGIC2, GZ_DEFLATE, 0, 0, 0, 0, 0, 0, GZ_OS_UNKNOWN,
+    };
+    // Raw deflate, the header and trailer are gzip's
+    if (fwrite(header, 1, sizeof(header), gz->fp) != sizeof(header) ||
+        tdefl_init(&gz->deflator, put, gz, GZ_DEFLATE_FLAGS) !=
+            TDEFL_STATUS_OKAY) {
+        gz->failed = true;
+    }
+    return gz;
+}
+
+bool gz_write(gz_writer_t *gz, const uint8_t *data, size_t size)
+{
+    if (gz->failed) {
+        return false;
+    }
+    gz->crc = esp_rom_crc32_le(gz->crc, data, size);
+    gz->size += size;
+    gz->failed = tdefl_compress_buffer(&gz->deflator, data, size,
+                                       TDEFL_NO_FLUSH) != TDEFL_STATUS_OKAY;
+    return !gz->failed;
+}
+
+bool gz_finish(gz_writer_t *gz, uint32_t *zsize)
+{
+    bool ok = !gz->failed && tdefl_compress_buffer(&gz->deflator, NULL, 0,
+                                                   TDEFL_FINISH) ==
+                                 TDEFL_STATUS_DONE;
+    uint8_t trailer[GZ_TRAILER_SIZE];
+    put_u32(trailer, gz->crc);
+    put_u32(trailer + 4, gz->size);
+    ok = ok && fwrite(trailer, 1, sizeof(trailer), gz->fp) == sizeof(trailer);
+    ok = fclose(gz->fp) == 0 && ok;
+    *zsize = gz->zsize + sizeof(trailer);
+    free(gz);
+    return ok;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// gzip files on the storage, so a PC gunzips them too. The readback writes
+// its dump as one, the flash reader inflates the parts of a job named *.gz
+// while they are flashed.
+
+typedef struct gz_reader gz_reader_t;
+typedef struct gz_writer gz_writer_t;
+
+// Whether the path names a gzip file
+bool gz_path(const char *path);
+// The inflated size of the trailer, modulo 4 GiB like gzip keeps it
+bool gz_size(const char *path, uint32_t *size);
+
+gz_reader_t *gz_open(const char *path);
+// Returns less than size at the end of the file or on an error, a digest
+// mismatch holds back the last bytes
+size_t gz_read(gz_reader_t *gz, uint8_t *buf, size_t size);
+// Inflates and drops size bytes, false if the file ends before
+bool gz_skip(gz_reader_t *gz, size_t size);
+void gz_close(gz_reader_t *gz);
+
+gz_writer_t *gz_create(const char *path);
+bool gz_write(gz_writer_t *gz, const uint8_t *data, size_t size);
+// Ends the stream and closes the file, false if any write failed. The
+// deflated size is returned, the writer is freed either way.
+bool gz_finish(gz_writer_t *gz, uint32_t *zsize);
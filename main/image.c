@@ -0,0 +1,321 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_rom_md5.h"
+#include "esp_timer.h"
+#include "gz.h"
+#include "image.h"
+#include "trace.h"
+#if CONFIG_IDF_TARGET_ESP32S2
+#include "esp32s2/rom/miniz.h"
+#elif CONFIG_IDF_TARGET_ESP32S3
+#include "esp32s3/rom/miniz.h"
+#endif
+
+static const char *TAG = "image";
+
+#define FLASH_SECTOR_SIZE 0x1000
+#define IMAGE_CHUNK_SIZE FLASH_SECTOR_SIZE
+
+typedef struct {
+    uint8_t *buf;
+    size_t size;
+    size_t cap;
+    size_t limit; // give up once the stream is no smaller than the image
+} zbuf_t;
+
+static mz_bool zbuf_put(const void *data, int len, void *user)
+{
+    zbuf_t *z = user;
+    if (z->size + len >= z->limit) {
+        return MZ_FALSE;
+    }
+    if (z->size + len > z->cap) {
+        size_t cap = MIN(MAX(z->cap * 2, z->size + len), z->limit);
+        uint8_t *buf = heap_caps_realloc(z->buf, cap,
+                                         MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (buf == NULL) {
+            return MZ_FALSE;
+        }
+        z->buf = buf;
+        z->cap = cap;
+    }
+    memcpy(z->buf + z->size, data, len);
+    z->size += len;
+    return MZ_TRUE;
+}
+
+static bool blank(const uint8_t *buf, size_t size)
+{
+    return size == 0 || (buf[0] == 0xff && memcmp(buf, buf + 1, size - 1) == 0);
+}
+
+// Extend the last extent by the sector at offset or start a new one
+static bool add_sector(flash_file_t *file, uint32_t offset, uint32_t size)
+{
+    int n = file->extents_size;
+    if (n > 0 && file->extents[n - 1].offset + file->extents[n - 1].size ==
+                     offset) {
+        file->extents[n - 1].size += size;
+        return true;
+    }
+    flash_extent_t *extents =
+        realloc(file->extents, (n + 1) * sizeof(flash_extent_t));
+    if (extents == NULL) {
+        return false;
+    }
+    extents[n].offset = offset;
+    extents[n].size = size;
+    file->extents = extents;
+    file->extents_size = n + 1;
+    return true;
+}
+
+static void ingest_file(flash_file_t *file, tdefl_compressor *d,
+                        uint8_t *chunk)
+{
+    const uint32_t region = CONFIG_FLASH_DIFF_REGION_SIZE;
+    // Named after its first file when several are merged, the digests and
+    // the deflated stream cover the padding in between too
+    const char *name = file->parts[0].path;
+    flash_reader_t reader;
+    flash_reader_open(&reader, file, 0);
+
+    int64_t start = esp_timer_get_time();
+    // A mapped file is hashed and deflated in place
+    uint8_t *data = file->mapped ? file->data : NULL;
+#if CONFIG_FLASH_CACHE
+    if (data == NULL) {
+        data = heap_caps_malloc(MAX(file->size, 1),
+                                MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    }
+    if (data == NULL) {
+        ESP_LOGW(TAG, "Cannot cache \"%s\" in PSRAM, read it on flashing",
+                 name);
+    }
+#endif
+    uint32_t regions = (file->size + region - 1) / region;
+    uint8_t(*region_md5)[16] = malloc(MAX(regions, 1) * 16);
+    zbuf_t z = {
+        .buf = NULL,
+        .size = 0,
+        .cap = 0,
+        .limit = file->size,
+    };
+    tdefl_status status = TDEFL_STATUS_BAD_PARAM;
+    if (d != NULL) {
+        // The loaders inflate with the zlib header parsed
+        status = tdefl_init(d, zbuf_put, &z,
+                            TDEFL_WRITE_ZLIB_HEADER | TDEFL_DEFAULT_MAX_PROBES);
+    }
+    md5_context_t md5, region_ctx;
+    esp_rom_md5_init(&md5);
+    // The chunks are the sectors of the write, a blank one need not be sent
+    free(file->extents);
+    file->extents = NULL;
+    file->extents_size = 0;
+    bool sparse = file->addr % FLASH_SECTOR_SIZE == 0;
+    bool sector_blank = true; // of the sector read so far
+
+    size_t pos = 0;
+    while (pos < file->size && region_md5 != NULL) {
+        // Chunks never straddle a sector, nor a region since those are whole
+        // sectors, so a short read is completed by the next ones
+        size_t to_read = MIN(file->size - pos,
+                             IMAGE_CHUNK_SIZE - pos % IMAGE_CHUNK_SIZE);
+        uint8_t *buf = data != NULL ? data + pos : chunk;
+        size_t read = file->mapped ? to_read
+                                   : flash_reader_read(&reader, buf, to_read);
+        if (read == 0) {
+            ESP_LOGE(TAG, "Read \"%s\" failed", name);
+            break;
+        }
+        if (pos % region == 0) {
+            esp_rom_md5_init(&region_ctx);
+        }
+        esp_rom_md5_update(&md5, buf, read);
+        esp_rom_md5_update(&region_ctx, buf, read);
+        if (status == TDEFL_STATUS_OKAY) {
+            status = tdefl_compress_buffer(d, buf, read, TDEFL_NO_FLUSH);
+        }
+        sector_blank = sector_blank && blank(buf, read);
+        pos += read;
+        if (pos % FLASH_SECTOR_SIZE == 0 || pos == file->size) {
+            if (sparse && !sector_blank) {
+                size_t sector = (pos - 1) / FLASH_SECTOR_SIZE;
+                sparse = add_sector(file, sector * FLASH_SECTOR_SIZE,
+                                    pos - sector * FLASH_SECTOR_SIZE);
+            }
+            sector_blank = true;
+        }
+        if (pos % region == 0 || pos == file->size) {
+            esp_rom_md5_final(region_md5[(pos - 1) / region], &region_ctx);
+        }
+    }
+    flash_reader_close(&reader);
+    if (!sparse || pos != file->size) {
+        free(file->extents);
+        file->extents = NULL;
+        file->extents_size = 0;
+    }
+    if (pos != file->size || region_md5 == NULL) {
+        free(region_md5);
+        if (!file->mapped) {
+            free(data);
+        }
+        free(z.buf);
+        return;
+    }
+    esp_rom_md5_final(file->md5, &md5);
+    free(file->region_md5); // the digests of a compiled plan
+    file->region_md5 = region_md5;
+    file->hashed = true;
+    file->read = true;
+    file->data = data;
+
+    if (status == TDEFL_STATUS_OKAY) {
+        status = tdefl_compress_buffer(d, NULL, 0, TDEFL_FINISH);
+    }
+    if (status != TDEFL_STATUS_DONE) {
+        if (d != NULL) {
+            ESP_LOGW(TAG, "Keep \"%s\" uncompressed", name);
+        }
+        free(z.buf);
+        return;
+    }
+    file->zdata = z.buf;
+    file->zsize = z.size;
+    ESP_LOGI(TAG, "Deflated \"%s\" %ld -> %d bytes (%d%%) in %lld ms",
+             name, file->size, z.size,
+             (int)((uint64_t)z.size * 100 / MAX(file->size, 1)),
+             (esp_timer_get_time() - start) / 1000);
+}
+
+static bool same_write(const flash_file_t *a, const flash_file_t *b)
+{
+    if (a->addr != b->addr || a->size != b->size ||
+        a->parts_size != b->parts_size) {
+        return false;
+    }
+    for (int i = 0; i < a->parts_size; i++) {
+        if (a->parts[i].addr != b->parts[i].addr ||
+            a->parts[i].size != b->parts[i].size ||
+            strcmp(a->parts[i].path, b->parts[i].path) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void image_reuse(flash_args_t *args, flash_args_t *old,
+                 image_changed_t changed)
+{
+    int reused = 0;
+
+    for (int i = 0; i < args->flash_files_size; i++) {
+        flash_file_t *file = &args->flash_files[i];
+        for (int j = 0; j < old->flash_files_size; j++) {
+            flash_file_t *prev = &old->flash_files[j];
+            if (!prev->hashed || !same_write(file, prev)) {
+                continue;
+            }
+            int k = 0;
+            while (k < file->parts_size && !changed(file->parts[k].path)) {
+                k++;
+            }
+            if (k < file->parts_size) {
+                break;
+            }
+            file->data = prev->data;
+            file->mapped = prev->mapped;
+            file->zdata = prev->zdata;
+            file->zsize = prev->zsize;
+            file->hashed = true;
+            file->read = prev->read;
+            memcpy(file->md5, prev->md5, sizeof(file->md5));
+            file->region_md5 = prev->region_md5;
+            free(file->extents);
+            file->extents = prev->extents;
+            file->extents_size = prev->extents_size;
+            prev->data = NULL;
+            prev->zdata = NULL;
+            prev->region_md5 = NULL;
+            prev->extents = NULL;
+            prev->hashed = false;
+            reused++;
+            break;
+        }
+    }
+    ESP_LOGI(TAG, "Reused %d of %d write(s)", reused, args->flash_files_size);
+}
+
+void image_map(flash_args_t *args, image_map_t map)
+{
+    int mapped = 0;
+
+    for (int i = 0; i < args->flash_files_size; i++) {
+        flash_file_t *file = &args->flash_files[i];
+        // Merged files have gaps in between, gzip ones are stored deflated
+        if (file->mapped || file->parts_size != 1 ||
+            gz_path(file->parts[0].path)) {
+            continue;
+        }
+        uint8_t *data = (uint8_t *)map(file->parts[0].path);
+        if (data == NULL) {
+            continue;
+        }
+        free(file->data);
+        file->data = data;
+        file->mapped = true;
+        mapped++;
+    }
+    ESP_LOGI(TAG, "Mapped %d of %d write(s)", mapped, args->flash_files_size);
+}
+
+void image_unmap(flash_args_t *args)
+{
+    for (int i = 0; args != NULL && i < args->flash_files_size; i++) {
+        flash_file_t *file = &args->flash_files[i];
+        if (file->mapped) {
+            file->data = NULL;
+            file->mapped = false;
+        }
+    }
+}
+
+void image_ingest(flash_args_t *args)
+{
+    tdefl_compressor *d = NULL;
+#if CONFIG_FLASH_COMPRESS
+    d = heap_caps_malloc(sizeof(tdefl_compressor),
+                         MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (d == NULL) {
+        ESP_LOGE(TAG, "Cannot allocate the deflate state");
+    }
+#endif
+    uint8_t *chunk = malloc(IMAGE_CHUNK_SIZE);
+    if (chunk == NULL) {
+        ESP_LOGE(TAG, "Malloc %d bytes chunk failed", IMAGE_CHUNK_SIZE);
+    } else {
+        for (int i = 0; i < args->flash_files_size; i++) {
+            flash_file_t *file = &args->flash_files[i];
+#if CONFIG_FLASH_CACHE || CONFIG_FLASH_COMPRESS
+            // The digests of a compiled plan neither cache nor deflate
+            bool done = file->read;
+#else
+            bool done = file->hashed;
+#endif
+            if (!done) {
+                TRACE_BEGIN("ingest");
+                ingest_file(file, d, chunk);
+                TRACE_END("ingest");
+            }
+        }
+    }
+    free(chunk);
+    free(d);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "flash_args.h"
+
+// Whether the file changed since the previous job was ingested
+typedef bool (*image_changed_t)(const char *path);
+
+// Hand the ingested data of the writes of old that are planned the same in
+// args and whose files did not change over to args
+void image_reuse(flash_args_t *args, flash_args_t *old,
+                 image_changed_t changed);
+// The file of a path in the data address space, NULL if it is not mapped
+typedef const void *(*image_map_t)(const char *path);
+
+// Flash the single file writes of args straight from the mapping, neither
+// reading nor caching them
+void image_map(flash_args_t *args, image_map_t map);
+// Drop the mappings before they go, the writes read their files again
+void image_unmap(flash_args_t *args);
+// Ingest the writes not reused
+void image_ingest(flash_args_t *args);
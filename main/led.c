@@ -1,6 +1,7 @@
 #include "led.h"
 #include "esp_log.h"
 #include "led_indicator.h"
+#include "trace.h"
 
 static const char *TAG = "led";
 
@@ -35,22 +36,34 @@ static const blink_step_t led_error_step[] = {
     {LED_BLINK_LOOP, 0, 0},
 };
 
+static const blink_step_t led_auto_step[] = {
+    {LED_BLINK_HOLD, LED_STATE_ON, 50},
+    {LED_BLINK_HOLD, LED_STATE_OFF, 1950},
+    {LED_BLINK_LOOP, 0, 0},
+};
+
 static blink_step_t const *led_indicator_blink_lists[] = {
     [LED_STATUS_ERROR] = led_error_step,
     [LED_STATUS_FLASH] = led_flash_step,
     [LED_STATUS_USB] = led_usb_step,
     [LED_STATUS_READY] = led_ready_step,
+    [LED_STATUS_AUTO] = led_auto_step,
     [LED_STATUS_MAX] = NULL,
 };
 
-static led_indicator_handle_t led_handle = NULL;
-static led_status_t latest = LED_STATUS_READY;
+typedef struct {
+    led_indicator_handle_t handle;
+    led_status_t latest;
+} led_t;
 
-void led_init(void)
+static led_t board_led = {NULL, LED_STATUS_READY};
+static led_t channel_leds[LED_CHANNELS_MAX];
+
+static void led_create(led_t *led, int gpio_num)
 {
     led_indicator_gpio_config_t gpio_config = {
         .is_active_level_high = true,
-        .gpio_num = CONFIG_BOARD_LED_GPIO,
+        .gpio_num = gpio_num,
     };
     led_indicator_config_t config = {
         .mode = LED_GPIO_MODE,
@@ -58,20 +71,49 @@ void led_init(void)
         .blink_lists = led_indicator_blink_lists,
         .blink_list_num = LED_STATUS_MAX,
     };
-    led_handle = led_indicator_create(&config);
-    if (led_handle == NULL) {
-        ESP_LOGE(TAG, "Onboard led create failed");
+    led->handle = led_indicator_create(&config);
+    if (led->handle == NULL) {
+        ESP_LOGE(TAG, "Led on GPIO%d create failed", gpio_num);
     } else {
-        led_indicator_start(led_handle, latest);
+        led_indicator_start(led->handle, led->latest);
     }
 }
 
+static void led_update(led_t *led, led_status_t status)
+{
+    if (led->handle == NULL || status == led->latest) {
+        return;
+    }
+    TRACE_BEGIN("led");
+    led_indicator_stop(led->handle, led->latest);
+    led->latest = status;
+    led_indicator_start(led->handle, led->latest);
+    TRACE_END("led");
+}
+
+void led_init(void)
+{
+    led_create(&board_led, CONFIG_BOARD_LED_GPIO);
+}
+
 void led_set_status(led_status_t status)
 {
-    if (led_handle == NULL || status == latest) {
+    led_update(&board_led, status);
+}
+
+void led_channel_init(int channel, int gpio_num)
+{
+    if (channel < 0 || channel >= LED_CHANNELS_MAX || gpio_num < 0) {
+        return;
+    }
+    channel_leds[channel].latest = LED_STATUS_READY;
+    led_create(&channel_leds[channel], gpio_num);
+}
+
+void led_channel_set_status(int channel, led_status_t status)
+{
+    if (channel < 0 || channel >= LED_CHANNELS_MAX) {
         return;
     }
-    led_indicator_stop(led_handle, latest);
-    latest = status;
-    led_indicator_start(led_handle, latest);
+    led_update(&channel_leds[channel], status);
 }
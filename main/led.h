@@ -5,8 +5,15 @@ typedef enum {
     LED_STATUS_FLASH,
     LED_STATUS_USB,
     LED_STATUS_READY,
+    LED_STATUS_AUTO,
     LED_STATUS_MAX,
 } led_status_t;
 
+#define LED_CHANNELS_MAX 4
+
 void led_init(void);
 void led_set_status(led_status_t status);
+
+// Optional led of one flash channel, gpio_num < 0 means none
+void led_channel_init(int channel, int gpio_num);
+void led_channel_set_status(int channel, led_status_t status);
@@ -1,91 +1,677 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bridge.h"
 #include "btn.h"
+#include "console.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "findfile.h"
 #include "flash.h"
 #include "flash_args.h"
 #include "freertos/FreeRTOS.h"
-#include "freertos/event_groups.h"
+#include "freertos/semphr.h"
+#include "image.h"
 #include "led.h"
+#include "metrics.h"
+#include "nvs_flash.h"
+#include "plan.h"
+#include "readback.h"
+#include "sched.h"
+#include "store.h"
+#include "trace.h"
+#include "upload.h"
 #include "usb.h"
 
 static const char *TAG = "main";
 
+// Only replaced by the ingest jobs, which read it without the lock
 static flash_args_t *flash_args = NULL;
+// Held while flash_args is replaced or flashed
+static SemaphoreHandle_t job_lock;
+// flash_args is the job uploaded into the store, it is flashed even while
+// the storage is exposed to the host
+static bool store_job = false;
+// A console session on the CDC port, an upload rewriting the store or the
+// bridge owning the first channel, nothing is flashed meanwhile
+static const char *session = NULL;
+
+// The arg of the jobs
+enum {
+    INGEST_STORAGE,       // the host mounted the storage
+    INGEST_UPLOAD,        // an upload committed a job into the store
+    INGEST_UPLOAD_FAILED, // an upload ended without a job
+    INGEST_READBACK,      // a readback wrote a job into the storage
+};
+enum {
+    FLASH_ONCE,
+    FLASH_AUTO, // until cancelled
+};
+enum {
+    PLAN_SAVE,
+    PLAN_DROP,
+};
+
+#if CONFIG_FLASH_PLAN
+// flash_args was compiled and not saved yet
+static bool plan_stale = false;
+#endif
+
+static const int channel_leds[] = {
+    CONFIG_FLASH_UART_LED_GPIO,
+#if CONFIG_FLASH_CHANNELS >= 2
+    CONFIG_FLASH_UART2_LED_GPIO,
+#endif
+#if CONFIG_FLASH_CHANNELS >= 3
+    CONFIG_FLASH_UART3_LED_GPIO,
+#endif
+};
+
+static int flash_channels = 0;
+
+#ifdef CONFIG_FLASH_AUTO
+static bool auto_mode = true;
+#else
+static bool auto_mode = false;
+#endif
+
+static void auto_check(void);
+
+static const char *mount_dir = CONFIG_TINYUSB_MSC_MOUNT_PATH;
+static const char *job_fname = "flasher_args.json";
+
+// The job file found on the last mount, kept to parse it again while the
+// host left it alone
+static findfile_t *job_file = NULL;
+
+static void job_file_free(void)
+{
+    if (job_file != NULL) {
+        free(job_file->buf);
+        if (job_file->dir != mount_dir) {
+            free(job_file->dir);
+        }
+        free(job_file);
+        job_file = NULL;
+    }
+}
+
+static bool job_file_written(const char *fname)
+{
+    char path[strlen(job_file->dir) + strlen(fname) + 2];
+    sprintf(path, "%s/%s", job_file->dir, fname);
+    return usb_file_written(path);
+}
+
+// The job of the JSON, the plan instead if it was compiled from it
+static flash_args_t *job_compile(const char *json, uint32_t size,
+                                 const char *dir, flash_args_t **plan,
+                                 bool *compiled)
+{
+    if (*plan != NULL && strcmp((*plan)->dir, dir) == 0 &&
+        flash_args_compiled_from(*plan, json, size)) {
+        ESP_LOGI(TAG, "Job unchanged since the plan was saved");
+        flash_args_t *args = *plan;
+        *plan = NULL;
+        return args;
+    }
+    flash_args_t *args = flash_args_from_json(json, size, dir);
+    *compiled = args != NULL;
+    return args;
+}
+
+#if CONFIG_FLASH_UPLOAD
+// The uploaded job, NULL if there is none
+static flash_args_t *store_job_load(flash_args_t **plan, bool *compiled)
+{
+    const store_entry_t *entry = store_find(job_fname);
+    if (entry == NULL) {
+        return NULL;
+    }
+    // Read like findfile() does, the plan compares the same bytes
+    flash_args_t *args = NULL;
+    char *json = malloc(entry->size + 1);
+    if (json != NULL && store_read(entry, 0, json, entry->size) == ESP_OK) {
+        json[entry->size] = '\0';
+        args = job_compile(json, entry->size + 1, STORE_DIR, plan, compiled);
+    }
+    free(json);
+    if (args != NULL) {
+        image_map(args, store_vfs_mmap);
+    }
+    return args;
+}
+#endif
+
+// The job after the host wrote the storage, or on the first mount
+static flash_args_t *storage_job(flash_args_t *old)
+{
+    static bool first_mount = true;
+    flash_args_t *plan = NULL;
+    flash_args_t *args = NULL;
+    bool compiled = false;
+
+#if CONFIG_FLASH_PLAN
+    if (first_mount) {
+        plan = plan_load();
+    }
+#endif
+#if CONFIG_FLASH_UPLOAD
+    if (first_mount) {
+        // The store only holds a job newer than the one of the storage
+        args = store_job_load(&plan, &compiled);
+        store_job = args != NULL;
+    }
+#endif
+    first_mount = false;
+    if (args == NULL && (job_file == NULL || job_file_written(job_fname))) {
+        // The job most likely stayed where it was
+        const char *hint = NULL;
+        if (job_file != NULL) {
+            hint = job_file->dir;
+        } else if (plan != NULL) {
+            hint = plan->dir;
+        }
+        findfile_t *ff = findfile(mount_dir, job_fname, hint);
+        job_file_free();
+        job_file = ff;
+    }
+#if CONFIG_FLASH_UPLOAD
+    if (args == NULL && store_job) {
+        if (job_file == NULL || !job_file_written(job_fname)) {
+            ESP_LOGI(TAG, "No new \"%s\" written, keep the uploaded job",
+                     job_fname);
+            flash_args_free(plan);
+            return old;
+        }
+        image_unmap(old);
+        store_drop(); // the storage job is newer
+        store_job = false;
+    }
+#endif
+    if (args == NULL && job_file != NULL) {
+        args = job_compile(job_file->buf, job_file->size, job_file->dir,
+                           &plan, &compiled);
+    }
+    flash_args_free(plan);
+    if (args != NULL) {
+        // Only the files the host wrote are read again
+        if (old != NULL) {
+            image_reuse(args, old, usb_file_written);
+        }
+        image_ingest(args);
+        flash_args_dump(args);
+    }
+#if CONFIG_FLASH_PLAN
+    plan_stale = args != NULL && compiled;
+#endif
+    flash_args_free(old);
+    return args;
+}
 
-static EventGroupHandle_t event_group;
+// Whether the job may be flashed now
+static bool job_available(void)
+{
+    return flash_args != NULL && session == NULL &&
+           (!usb_mounted() || store_job);
+}
+
+static void storage_ingest(void)
+{
+    int64_t start = esp_timer_get_time();
+    usb_written_take();
+    if (flash_args != NULL && !usb_written()) {
+        ESP_LOGI(TAG, "Storage not written, keep the job");
+    } else {
+        xSemaphoreTake(job_lock, portMAX_DELAY);
+        flash_args = storage_job(flash_args);
+        xSemaphoreGive(job_lock);
+#if CONFIG_FLASH_PLAN
+        if (plan_stale) {
+            sched_post(SCHED_PLAN, SCHED_PRIO_LOW, PLAN_SAVE);
+        }
+#endif
+    }
+    if (flash_args != NULL) {
+        ESP_LOGI(TAG, "Ready in %lld ms",
+                 (esp_timer_get_time() - start) / 1000);
+    } else {
+        ESP_LOGE(TAG, "Cannot find \"%s\" file in the \"%s\" directory",
+                 job_fname, mount_dir);
+        led_set_status(LED_STATUS_ERROR);
+    }
+    usb_written_done();
+}
+
+#if CONFIG_FLASH_UPLOAD
+static void upload_ingest(bool committed)
+{
+    flash_args_t *args = NULL;
+    if (committed) {
+        int64_t start = esp_timer_get_time();
+        flash_args_t *plan = NULL;
+        bool compiled = false;
+        args = store_job_load(&plan, &compiled);
+        if (args != NULL) {
+            image_ingest(args);
+            flash_args_dump(args);
+            ESP_LOGI(TAG, "Uploaded job ready in %lld ms",
+                     (esp_timer_get_time() - start) / 1000);
+        } else {
+            ESP_LOGE(TAG, "Cannot load the uploaded job");
+        }
+    }
+    xSemaphoreTake(job_lock, portMAX_DELAY);
+    // A session cut short after begin took the uploaded job along
+    if (args != NULL || (session != NULL && store_job)) {
+        flash_args_free(flash_args);
+        flash_args = args;
+        store_job = args != NULL;
+        led_set_status(store_job ? LED_STATUS_READY : LED_STATUS_ERROR);
+#if CONFIG_FLASH_PLAN
+        plan_stale = store_job;
+        if (plan_stale) {
+            sched_post(SCHED_PLAN, SCHED_PRIO_LOW, PLAN_SAVE);
+        }
+#endif
+    }
+    session = NULL;
+    xSemaphoreGive(job_lock);
+}
+#endif
+
+#if CONFIG_FLASH_READBACK
+// The copy replaces the job, whatever else the storage holds, and is found
+// first on the next mounts
+static void readback_ingest(void)
+{
+    int64_t start = esp_timer_get_time();
+    xSemaphoreTake(job_lock, portMAX_DELAY);
+    findfile_t *ff = findfile(mount_dir, job_fname, READBACK_DIR);
+    flash_args_t *args = NULL;
+    bool compiled = false;
+    if (ff != NULL) {
+        flash_args_t *plan = NULL;
+        args = job_compile(ff->buf, ff->size, ff->dir, &plan, &compiled);
+        job_file_free();
+        job_file = ff;
+    }
+    if (args != NULL) {
+        image_ingest(args);
+        flash_args_dump(args);
+        flash_args_free(flash_args);
+        flash_args = args;
+#if CONFIG_FLASH_UPLOAD
+        if (store_job) {
+            store_drop(); // the copy is newer
+            store_job = false;
+        }
+#endif
+#if CONFIG_FLASH_PLAN
+        plan_stale = compiled;
+        sched_post(SCHED_PLAN, SCHED_PRIO_LOW, PLAN_SAVE);
+#endif
+        ESP_LOGI(TAG, "Read back job ready in %lld ms",
+                 (esp_timer_get_time() - start) / 1000);
+        led_set_status(LED_STATUS_READY);
+    } else {
+        ESP_LOGE(TAG, "Cannot load the read back job");
+        led_set_status(LED_STATUS_ERROR);
+    }
+    xSemaphoreGive(job_lock);
+}
+#endif
+
+static void ingest_run(int source)
+{
+#if CONFIG_FLASH_READBACK
+    if (source == INGEST_READBACK) {
+        readback_ingest();
+        auto_check();
+        return;
+    }
+#endif
+#if CONFIG_FLASH_UPLOAD
+    if (source != INGEST_STORAGE) {
+        upload_ingest(source == INGEST_UPLOAD);
+        auto_check();
+        return;
+    }
+#endif
+    storage_ingest();
+    auto_check();
+}
+
+#if CONFIG_FLASH_PLAN
+// The plan is written once the job is ready, a drop after a host write
+// overtakes a save still pending
+static void plan_run(int what)
+{
+    if (what == PLAN_DROP) {
+        // The plan of a storage job no longer matches the files, the one of
+        // an uploaded job does
+        if (!store_job) {
+            plan_stale = false;
+            plan_drop();
+        }
+    } else if (plan_stale && flash_args != NULL) {
+        plan_stale = false;
+        plan_save(flash_args);
+    }
+}
 
-#define FLASH_START_BIT BIT0
+static void storage_written(void)
+{
+    sched_post(SCHED_PLAN, SCHED_PRIO_NORMAL, PLAN_DROP);
+}
+#endif
 
 static void storage_mount_changed(bool mounted)
 {
     if (mounted) {
         ESP_LOGI(TAG, "Storage mounted");
         led_set_status(LED_STATUS_READY);
-
-        if (flash_args != NULL) {
-            flash_args_free(flash_args);
-        }
-        const char *dir = CONFIG_TINYUSB_MSC_MOUNT_PATH;
-        const char *fname = "flasher_args.json";
-        findfile_t *ff = findfile(dir, fname);
-        if (ff != NULL) {
-            flash_args = flash_args_from_json(ff->buf, ff->size, ff->dir);
-            if (flash_args != NULL) {
-                flash_args_dump(flash_args);
-            }
-            free(ff->buf);
-            if (ff->dir != dir) {
-                free(ff->dir);
-            }
-            free(ff);
-        }
-        if (flash_args == NULL) {
-            ESP_LOGE(TAG, "Cannot find \"%s\" file in the \"%s\" directory",
-                     fname, dir);
-            led_set_status(LED_STATUS_ERROR);
+        if (usb_written()) {
+            // An uploaded job may be flashed meanwhile
+            sched_cancel(SCHED_FLASH, SCHED_ANY);
+            sched_cancel(SCHED_VERIFY, SCHED_ANY);
         }
+        // Scanning and ingesting take a while, not in the USB callback
+        sched_post(SCHED_INGEST, SCHED_PRIO_HIGH, INGEST_STORAGE);
     } else {
         ESP_LOGI(TAG, "Storage unmounted");
         led_set_status(LED_STATUS_USB);
+#if CONFIG_FLASH_READBACK
+        // The app lost the volume it was writing
+        sched_cancel(SCHED_READBACK, SCHED_ANY);
+#endif
     }
+    auto_check();
 }
 
 static void flash_check(void)
 {
-    if (usb_mounted()) {
+    if (auto_mode) {
+        ESP_LOGW(TAG, "Auto mode, insert a target or long press to leave");
+    } else if (usb_mounted() && !store_job) {
         ESP_LOGW(TAG, "Storage exposed over USB, please remove it from PC");
-    } else if (flash_args == NULL) {
-        ESP_LOGW(TAG, "Not found flash args, please copy files to USB");
-    } else if (xEventGroupGetBits(event_group) & FLASH_START_BIT) {
+    } else if (session != NULL) {
+        ESP_LOGW(TAG, "%s in progress, please wait", session);
+    } else if (sched_busy(SCHED_FLASH, SCHED_ANY) ||
+               sched_busy(SCHED_VERIFY, SCHED_ANY)) {
         ESP_LOGW(TAG, "Flashing, please wait");
+    } else if (sched_busy(SCHED_READBACK, SCHED_ANY)) {
+        ESP_LOGW(TAG, "Reading the target, please wait");
+    } else if (flash_args == NULL && !sched_busy(SCHED_INGEST, SCHED_ANY)) {
+        ESP_LOGW(TAG, "Not found flash args, please copy files to USB");
+    } else {
+        // Runs as soon as a job still being ingested is ready
+        sched_post(SCHED_FLASH, SCHED_PRIO_HIGH, FLASH_ONCE);
+    }
+}
+
+static void flash_event(int channel, flash_event_t event)
+{
+    led_status_t status = LED_STATUS_AUTO;
+
+    switch (event) {
+    case FLASH_EVENT_START:
+        status = LED_STATUS_FLASH;
+        break;
+    case FLASH_EVENT_DONE:
+        status = LED_STATUS_READY;
+        break;
+    case FLASH_EVENT_FAILED:
+        ESP_LOGE(TAG, "Flashing the target of channel %d failed", channel);
+        status = LED_STATUS_ERROR;
+        break;
+    case FLASH_EVENT_REMOVED:
+        status = LED_STATUS_AUTO;
+        break;
+    }
+    led_channel_set_status(channel, status);
+    if (auto_mode && flash_channels == 1) {
+        led_set_status(status); // the board led is the channel led
+    }
+    if (event == FLASH_EVENT_DONE || event == FLASH_EVENT_FAILED) {
+        // The counters go to NVS between the cycles
+        sched_post(SCHED_REPORT, SCHED_PRIO_NORMAL, 0);
+    }
+}
+
+static void flash_run(int mode)
+{
+    xSemaphoreTake(job_lock, portMAX_DELAY);
+    if (!job_available()) {
+        // Replaced or taken by a session since the job was posted
+        ESP_LOGD(TAG, "No job to flash");
+    } else if (mode == FLASH_AUTO) {
+        ESP_LOGI(TAG, "Auto flashing %d file(s) on %d channel(s)",
+                 flash_args->flash_parts_size, flash_channels);
+        led_set_status(LED_STATUS_AUTO);
+        flash_auto(flash_args, flash_event);
+        led_set_status(usb_mounted() ? LED_STATUS_USB : LED_STATUS_READY);
     } else {
         led_set_status(LED_STATUS_FLASH);
-        ESP_LOGI(TAG, "Flashing %d file(s)...", flash_args->flash_files_size);
-        xEventGroupSetBits(event_group, FLASH_START_BIT);
+        ESP_LOGI(TAG, "Flashing %d file(s) on %d target(s)...",
+                 flash_args->flash_parts_size, flash_channels);
+        if (flash(flash_args, flash_event)) {
+            led_set_status(LED_STATUS_READY);
+        } else {
+            led_set_status(LED_STATUS_ERROR);
+        }
     }
+    xSemaphoreGive(job_lock);
 }
 
-static void flash_done(bool success)
+static void verify_run(int arg)
 {
-    if (success) {
-        led_set_status(LED_STATUS_READY);
+    xSemaphoreTake(job_lock, portMAX_DELAY);
+    if (!job_available() || auto_mode) {
+        ESP_LOGW(TAG, "Nothing to verify now");
+    } else {
+        led_set_status(LED_STATUS_FLASH);
+        ESP_LOGI(TAG, "Verifying %d file(s) on %d target(s)...",
+                 flash_args->flash_parts_size, flash_channels);
+        bool verified = flash_verify(flash_args, flash_event);
+        ESP_LOGI(TAG, "Targets %s the job", verified ? "match" : "differ from");
+        led_set_status(verified ? LED_STATUS_READY : LED_STATUS_ERROR);
+    }
+    xSemaphoreGive(job_lock);
+}
+
+static void report_run(int arg)
+{
+    metrics_save();
+}
+
+#if CONFIG_FLASH_READBACK
+// The storage is written, the host must not have it mounted
+static bool readback_available(void)
+{
+    return session == NULL && !auto_mode && !usb_mounted();
+}
+
+static void readback_job(int arg)
+{
+    xSemaphoreTake(job_lock, portMAX_DELAY);
+    bool available = readback_available();
+    xSemaphoreGive(job_lock);
+    if (!available) {
+        ESP_LOGW(TAG, "Cannot read the target now");
+        return;
+    }
+    led_set_status(LED_STATUS_FLASH);
+    if (readback_run()) {
+        sched_post(SCHED_INGEST, SCHED_PRIO_HIGH, INGEST_READBACK);
     } else {
         led_set_status(LED_STATUS_ERROR);
     }
-    xEventGroupClearBits(event_group, FLASH_START_BIT);
 }
 
-void app_main(void)
+static bool readback_begin(void)
 {
-    led_init();
-    usb_init(storage_mount_changed);
+    if (auto_mode) {
+        ESP_LOGW(TAG, "Auto mode, long press to leave it first");
+    } else if (usb_mounted()) {
+        ESP_LOGW(TAG, "Storage exposed over USB, please remove it from PC");
+    } else if (session != NULL) {
+        ESP_LOGW(TAG, "%s in progress, please wait", session);
+    } else {
+        return sched_post(SCHED_READBACK, SCHED_PRIO_NORMAL, 0);
+    }
+    return false;
+}
+#endif
+
+// Run the auto mode while it is on and the job is available to the app
+static void auto_check(void)
+{
+    if (auto_mode && job_available()) {
+        if (!sched_busy(SCHED_FLASH, FLASH_AUTO)) {
+            sched_post(SCHED_FLASH, SCHED_PRIO_NORMAL, FLASH_AUTO);
+        }
+    } else {
+        sched_cancel(SCHED_FLASH, FLASH_AUTO);
+    }
+}
+
+static void auto_toggle(void)
+{
+    auto_mode = !auto_mode;
+    ESP_LOGI(TAG, "Auto mode %s", auto_mode ? "on" : "off");
+    auto_check();
+}
+
+#if CONFIG_FLASH_UPLOAD || CONFIG_FLASH_BRIDGE
+// Not while flashing or the host's job is loaded
+static bool session_begin(const char *name)
+{
+    if (auto_mode || xSemaphoreTake(job_lock, 0) != pdTRUE) {
+        return false;
+    }
+    bool idle = session == NULL && !sched_busy(SCHED_FLASH, SCHED_ANY) &&
+                !sched_busy(SCHED_VERIFY, SCHED_ANY) &&
+                !sched_busy(SCHED_READBACK, SCHED_ANY);
+    if (idle) {
+        session = name;
+    }
+    xSemaphoreGive(job_lock);
+    return idle;
+}
+#endif
+
+#if CONFIG_FLASH_UPLOAD
+static bool upload_begin(void)
+{
+    if (!session_begin("Upload")) {
+        return false;
+    }
+    // The upload unmaps the store, the job must not point into it. No flash
+    // or verify runs during the session.
+    xSemaphoreTake(job_lock, portMAX_DELAY);
+    if (store_job) {
+        image_unmap(flash_args);
+    }
+    xSemaphoreGive(job_lock);
+    return true;
+}
+
+// The session ends once the ingest job took the uploaded job over
+static void upload_end(bool committed)
+{
+    sched_post(SCHED_INGEST, SCHED_PRIO_HIGH,
+               committed ? INGEST_UPLOAD : INGEST_UPLOAD_FAILED);
+}
+#endif
+
+#if CONFIG_FLASH_BRIDGE
+static bool bridge_begin(void)
+{
+    return session_begin("Bridge");
+}
+
+static void bridge_end(void)
+{
+    session = NULL;
+    auto_check();
+}
+#endif
+
+static void btn_click(void)
+{
+#if CONFIG_FLASH_BRIDGE
+    if (bridge_stop()) {
+        return;
+    }
+#endif
+    flash_check();
+}
 
-    event_group = xEventGroupCreate();
-    btn_init(flash_check, NULL, NULL);
+static void nvs_init(void)
+{
+    esp_err_t err = nvs_flash_init();
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES ||
+        err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_LOGW(TAG, "Erasing the NVS partition");
+        nvs_flash_erase();
+        err = nvs_flash_init();
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "NVS initialization failed: %s", esp_err_to_name(err));
+    }
+}
 
-    while (1) {
-        xEventGroupWaitBits(event_group, FLASH_START_BIT, pdFALSE, pdFALSE,
-                            portMAX_DELAY);
-        flash(flash_args, flash_done);
+void app_main(void)
+{
+    job_lock = xSemaphoreCreateMutex();
+    const sched_handler_t handlers[SCHED_TYPES] = {
+        [SCHED_INGEST] = {.run = ingest_run},
+#if CONFIG_FLASH_PLAN
+        [SCHED_PLAN] = {.run = plan_run},
+#endif
+        [SCHED_FLASH] = {.run = flash_run, .cancel = flash_stop},
+        [SCHED_VERIFY] = {.run = verify_run},
+        [SCHED_REPORT] = {.run = report_run},
+#if CONFIG_FLASH_READBACK
+        [SCHED_READBACK] = {.run = readback_job, .cancel = readback_stop},
+#endif
+    };
+    // The first mount posts its ingest job before the workers start
+    sched_init(handlers);
+    led_init();
+    for (int i = 0; i < sizeof(channel_leds) / sizeof(channel_leds[0]); i++) {
+        led_channel_init(i, channel_leds[i]);
     }
+    nvs_init(); // the plan is loaded on the first mount
+#if CONFIG_FLASH_UPLOAD
+    if (store_init()) {
+        store_vfs_register();
+    }
+#endif
+#if CONFIG_FLASH_PLAN
+    usb_init(storage_mount_changed, storage_written);
+#else
+    usb_init(storage_mount_changed, NULL);
+#endif
+    console_init();
+#if CONFIG_FLASH_TRACE
+    trace_init();
+#endif
+#if CONFIG_FLASH_UPLOAD
+    upload_cdc_init(upload_begin, upload_end);
+#endif
+#if CONFIG_FLASH_BRIDGE
+    bridge_init(bridge_begin, bridge_end);
+#endif
+#if CONFIG_FLASH_READBACK
+    readback_init(readback_begin);
+#endif
+    metrics_init();
+    flash_channels = flash_init();
+
+    btn_init(btn_click, NULL, auto_toggle);
+    auto_check();
+    sched_start();
 }
@@ -0,0 +1,387 @@
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "cJSON.h"
+#include "esp_console.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "metrics.h"
+#include "nvs.h"
+
+static const char *TAG = "metrics";
+
+#define METRICS_CHANNELS_MAX 4
+#define METRICS_FILES_MAX 16
+#define METRICS_ERRORS 16
+#define METRICS_BUCKETS_PER_OCTAVE 16 // steps of 4.4% of the cycle ms
+#define METRICS_BUCKETS (20 * METRICS_BUCKETS_PER_OCTAVE) // up to 17.5 min
+#define METRICS_VERSION 3
+
+#define NVS_NAMESPACE "metrics"
+#define NVS_KEY "lifetime"
+
+typedef struct {
+    uint32_t addr;
+    uint32_t size;
+    uint32_t sent;
+    int64_t phase_us[METRICS_PHASES];
+} file_metrics_t;
+
+typedef struct {
+    bool valid;
+    metrics_cycle_t cycle;
+    int64_t start;
+    int64_t cycle_us;
+    esp_loader_error_t err;
+    int64_t phase_us[METRICS_PHASES];
+    uint32_t retries;
+    uint32_t resumes;
+    int files;
+    file_metrics_t file[METRICS_FILES_MAX];
+} run_metrics_t;
+
+// Stored as a blob, bump METRICS_VERSION when the layout changes
+typedef struct {
+    uint32_t version;
+    uint32_t units;                    // successful cycles
+    uint32_t failures[METRICS_ERRORS]; // failed cycles by esp_loader_error_t
+    uint64_t cycle_ms_sum;             // of the successful cycles
+    uint32_t cycle_buckets[METRICS_BUCKETS];
+    uint32_t cycle_overflows; // successful cycles beyond the last bucket
+    uint32_t retries; // packets resent, a hint at bad cables
+    uint32_t resumes;
+} lifetime_t;
+
+static run_metrics_t runs[METRICS_CHANNELS_MAX];
+static lifetime_t lifetime = {.version = METRICS_VERSION};
+static SemaphoreHandle_t lock = NULL;
+static bool dirty = false; // lifetime changed since it was saved
+
+static const char *phase_names[METRICS_PHASES] = {
+    [METRICS_CONNECT] = "connect_us", [METRICS_STUB] = "stub_us",
+    [METRICS_BAUD] = "baud_us",       [METRICS_DIFF] = "diff_us",
+    [METRICS_ERASE] = "erase_us",     [METRICS_WRITE] = "write_us",
+    [METRICS_VERIFY] = "verify_us",
+};
+
+static const char *cycle_names[METRICS_CYCLES] = {
+    [METRICS_CYCLE_FLASH] = "flash",
+    [METRICS_CYCLE_VERIFY] = "verify",
+    [METRICS_CYCLE_READ] = "read",
+};
+
+static const char *error_name(int err)
+{
+    switch (err) {
+    case ESP_LOADER_SUCCESS:
+        return "success";
+    case ESP_LOADER_ERROR_FAIL:
+        return "fail";
+    case ESP_LOADER_ERROR_TIMEOUT:
+        return "timeout";
+    case ESP_LOADER_ERROR_IMAGE_SIZE:
+        return "image_size";
+    case ESP_LOADER_ERROR_INVALID_MD5:
+        return "invalid_md5";
+    case ESP_LOADER_ERROR_INVALID_PARAM:
+        return "invalid_param";
+    case ESP_LOADER_ERROR_INVALID_TARGET:
+        return "invalid_target";
+    case ESP_LOADER_ERROR_UNSUPPORTED_CHIP:
+        return "unsupported_chip";
+    case ESP_LOADER_ERROR_UNSUPPORTED_FUNC:
+        return "unsupported_func";
+    case ESP_LOADER_ERROR_INVALID_RESPONSE:
+        return "invalid_response";
+    default:
+        return "unknown";
+    }
+}
+
+// METRICS_BUCKETS for a cycle beyond the histogram
+static int bucket_of(uint32_t ms)
+{
+    int i = ms > 1 ? (int)(log2f(ms) * METRICS_BUCKETS_PER_OCTAVE) : 0;
+    return MIN(i, METRICS_BUCKETS);
+}
+
+// Upper bound of the bucket, the percentiles are this coarse
+static uint32_t bucket_limit(int i)
+{
+    return (uint32_t)ceilf(
+        exp2f((i + 1) / (float)METRICS_BUCKETS_PER_OCTAVE));
+}
+
+// 0 when the percentile lies beyond the histogram
+static uint32_t cycle_percentile(int percent)
+{
+    uint32_t rank = (lifetime.units * percent + 99) / 100;
+    uint32_t seen = 0;
+
+    for (int i = 0; i < METRICS_BUCKETS && rank > 0; i++) {
+        seen += lifetime.cycle_buckets[i];
+        if (seen >= rank) {
+            return bucket_limit(i);
+        }
+    }
+    return 0;
+}
+
+static void lifetime_save(void)
+{
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err == ESP_OK) {
+        err = nvs_set_blob(nvs, NVS_KEY, &lifetime, sizeof(lifetime));
+        if (err == ESP_OK) {
+            err = nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Cannot save counters: %s", esp_err_to_name(err));
+    }
+}
+
+static void lifetime_load(void)
+{
+    nvs_handle_t nvs;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return; // nothing saved yet
+    }
+    lifetime_t saved;
+    size_t size = sizeof(saved);
+    if (nvs_get_blob(nvs, NVS_KEY, &saved, &size) == ESP_OK &&
+        size == sizeof(saved) && saved.version == METRICS_VERSION) {
+        lifetime = saved;
+    }
+    nvs_close(nvs);
+}
+
+static cJSON *run_to_json(int channel, const run_metrics_t *run)
+{
+    cJSON *obj = cJSON_CreateObject();
+    cJSON_AddNumberToObject(obj, "channel", channel);
+    cJSON_AddStringToObject(obj, "cycle", cycle_names[run->cycle]);
+    cJSON_AddStringToObject(obj, "result", error_name(run->err));
+    cJSON_AddNumberToObject(obj, "cycle_us", run->cycle_us);
+    for (int i = 0; i < METRICS_PHASES; i++) {
+        cJSON_AddNumberToObject(obj, phase_names[i], run->phase_us[i]);
+    }
+    cJSON_AddNumberToObject(obj, "retries", run->retries);
+    cJSON_AddNumberToObject(obj, "resumes", run->resumes);
+    cJSON *files = cJSON_AddArrayToObject(obj, "files");
+    for (int i = 0; i < run->files; i++) {
+        const file_metrics_t *f = &run->file[i];
+        cJSON *file = cJSON_CreateObject();
+        cJSON_AddNumberToObject(file, "addr", f->addr);
+        cJSON_AddNumberToObject(file, "size", f->size);
+        cJSON_AddNumberToObject(file, "sent", f->sent);
+        int64_t total = 0;
+        for (int j = METRICS_DIFF; j < METRICS_PHASES; j++) {
+            cJSON_AddNumberToObject(file, phase_names[j], f->phase_us[j]);
+            total += f->phase_us[j];
+        }
+        // Effective rate of the image, including erase and verify
+        cJSON_AddNumberToObject(file, "bytes_per_s",
+                                total > 0 ? f->size * 1000000LL / total : 0);
+        cJSON_AddItemToArray(files, file);
+    }
+    return obj;
+}
+
+static cJSON *lifetime_to_json(void)
+{
+    cJSON *obj = cJSON_CreateObject();
+    cJSON_AddNumberToObject(obj, "units", lifetime.units);
+    cJSON *failures = cJSON_AddObjectToObject(obj, "failures");
+    for (int i = 1; i < METRICS_ERRORS; i++) {
+        if (lifetime.failures[i] != 0) {
+            cJSON_AddNumberToObject(failures, error_name(i),
+                                    lifetime.failures[i]);
+        }
+    }
+    cJSON_AddNumberToObject(obj, "cycle_mean_ms",
+                            lifetime.units > 0
+                                ? lifetime.cycle_ms_sum / lifetime.units
+                                : 0);
+    uint32_t p95 = cycle_percentile(95);
+    if (p95 != 0 || lifetime.units == 0) {
+        cJSON_AddNumberToObject(obj, "cycle_p95_ms", p95);
+    } else {
+        cJSON_AddNullToObject(obj, "cycle_p95_ms"); // longer than measured
+    }
+    cJSON_AddNumberToObject(obj, "cycle_overflows", lifetime.cycle_overflows);
+    cJSON_AddNumberToObject(obj, "retries", lifetime.retries);
+    cJSON_AddNumberToObject(obj, "resumes", lifetime.resumes);
+    return obj;
+}
+
+static int metrics_cmd(int argc, char **argv)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+        memset(&lifetime, 0, sizeof(lifetime));
+        lifetime.version = METRICS_VERSION;
+        lifetime_save();
+        dirty = false;
+    }
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddItemToObject(root, "lifetime", lifetime_to_json());
+    cJSON *last = cJSON_AddArrayToObject(root, "last");
+    for (int i = 0; i < METRICS_CHANNELS_MAX; i++) {
+        if (runs[i].valid) {
+            cJSON_AddItemToArray(last, run_to_json(i, &runs[i]));
+        }
+    }
+    xSemaphoreGive(lock);
+
+    char *json = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    if (json == NULL) {
+        return 1;
+    }
+    printf("%s\n", json);
+    free(json);
+    return 0;
+}
+
+void metrics_init(void)
+{
+    lock = xSemaphoreCreateMutex();
+    lifetime_load(); // NVS is initialized by app_main()
+    ESP_LOGI(TAG, "%" PRIu32 " unit(s) flashed so far", lifetime.units);
+
+    const esp_console_cmd_t cmd = {
+        .command = "metrics",
+        .help = "Print the flash timing and counters as JSON, \"metrics "
+                "reset\" clears the counters",
+        .func = metrics_cmd,
+    };
+    esp_console_cmd_register(&cmd);
+}
+
+void metrics_save(void)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (dirty) {
+        lifetime_save();
+        dirty = false;
+    }
+    xSemaphoreGive(lock);
+}
+
+void metrics_begin(int channel, metrics_cycle_t cycle)
+{
+    if (channel >= METRICS_CHANNELS_MAX) {
+        return;
+    }
+    run_metrics_t *run = &runs[channel];
+    xSemaphoreTake(lock, portMAX_DELAY);
+    memset(run, 0, sizeof(*run));
+    run->cycle = cycle;
+    run->start = esp_timer_get_time();
+    xSemaphoreGive(lock);
+}
+
+void metrics_phase(int channel, metrics_phase_t phase, int64_t us)
+{
+    if (channel >= METRICS_CHANNELS_MAX) {
+        return;
+    }
+    run_metrics_t *run = &runs[channel];
+    xSemaphoreTake(lock, portMAX_DELAY);
+    run->phase_us[phase] += us;
+    if (run->files > 0) {
+        run->file[run->files - 1].phase_us[phase] += us;
+    }
+    xSemaphoreGive(lock);
+}
+
+void metrics_file(int channel, uint32_t addr, uint32_t size)
+{
+    if (channel >= METRICS_CHANNELS_MAX) {
+        return;
+    }
+    run_metrics_t *run = &runs[channel];
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (run->files < METRICS_FILES_MAX) {
+        file_metrics_t *file = &run->file[run->files++];
+        file->addr = addr;
+        file->size = size;
+    }
+    xSemaphoreGive(lock);
+}
+
+void metrics_sent(int channel, uint32_t bytes)
+{
+    if (channel >= METRICS_CHANNELS_MAX) {
+        return;
+    }
+    run_metrics_t *run = &runs[channel];
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (run->files > 0) {
+        run->file[run->files - 1].sent += bytes;
+    }
+    xSemaphoreGive(lock);
+}
+
+void metrics_recovery(int channel, uint32_t retries, uint32_t resumes)
+{
+    if (channel >= METRICS_CHANNELS_MAX) {
+        return;
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    runs[channel].retries = retries;
+    runs[channel].resumes = resumes;
+    xSemaphoreGive(lock);
+}
+
+void metrics_end(int channel, esp_loader_error_t err)
+{
+    if (channel >= METRICS_CHANNELS_MAX) {
+        return;
+    }
+    run_metrics_t *run = &runs[channel];
+    xSemaphoreTake(lock, portMAX_DELAY);
+    run->cycle_us = esp_timer_get_time() - run->start;
+    run->err = err;
+    run->valid = true;
+    uint32_t ms = run->cycle_us / 1000;
+    if (run->cycle == METRICS_CYCLE_FLASH) {
+        lifetime.retries += run->retries;
+        lifetime.resumes += run->resumes;
+        if (err == ESP_LOADER_SUCCESS) {
+            lifetime.units++;
+            lifetime.cycle_ms_sum += ms;
+            int bucket = bucket_of(ms);
+            if (bucket < METRICS_BUCKETS) {
+                lifetime.cycle_buckets[bucket]++;
+            } else {
+                lifetime.cycle_overflows++;
+            }
+        } else {
+            lifetime.failures[MIN(err, METRICS_ERRORS - 1)]++;
+        }
+        dirty = true;
+    }
+    xSemaphoreGive(lock);
+
+    ESP_LOGI(TAG,
+             "Channel %d %s %s in %" PRIu32 " ms: connect %lld, stub %lld, "
+             "baud %lld, diff %lld, erase %lld, write %lld, verify %lld ms",
+             channel, cycle_names[run->cycle], error_name(err), ms,
+             run->phase_us[METRICS_CONNECT] / 1000,
+             run->phase_us[METRICS_STUB] / 1000,
+             run->phase_us[METRICS_BAUD] / 1000,
+             run->phase_us[METRICS_DIFF] / 1000,
+             run->phase_us[METRICS_ERASE] / 1000,
+             run->phase_us[METRICS_WRITE] / 1000,
+             run->phase_us[METRICS_VERIFY] / 1000);
+}
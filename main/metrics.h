@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "esp_loader.h"
+
+// Timing of every flash cycle per channel, and lifetime counters kept in NVS
+
+typedef enum {
+    METRICS_CONNECT, // reset, sync and chip detect
+    METRICS_STUB,    // download and start of the flasher stub
+    METRICS_BAUD,    // transmission rate negotiation
+    METRICS_DIFF,    // region digests compared by the differential flashing
+    METRICS_ERASE,
+    METRICS_WRITE,
+    METRICS_VERIFY,
+    METRICS_PHASES,
+} metrics_phase_t;
+
+// Each replaces the last run of the channel, only flash cycles are counted
+typedef enum {
+    METRICS_CYCLE_FLASH,
+    METRICS_CYCLE_VERIFY,
+    METRICS_CYCLE_READ,
+    METRICS_CYCLES,
+} metrics_cycle_t;
+
+void metrics_init(void);
+
+void metrics_begin(int channel, metrics_cycle_t cycle);
+void metrics_phase(int channel, metrics_phase_t phase, int64_t us);
+// Phases reported after this are also accounted to the file
+void metrics_file(int channel, uint32_t addr, uint32_t size);
+void metrics_sent(int channel, uint32_t bytes);
+// Packets resent and writes resumed by the cycle
+void metrics_recovery(int channel, uint32_t retries, uint32_t resumes);
+void metrics_end(int channel, esp_loader_error_t err);
+// Writes the lifetime counters to NVS, kept out of the cycles
+void metrics_save(void);
@@ -0,0 +1,298 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "msc_cache.h"
+#include "tusb_msc_storage.h"
+
+static const char *TAG = "msc_cache";
+
+#define FLASH_SECTOR_SIZE 0x1000
+#define MIN_SLOTS 4
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+static wl_handle_t wl = WL_INVALID_HANDLE;
+static SemaphoreHandle_t lock = NULL;
+static TaskHandle_t flusher = NULL;
+static size_t sector_size = 0; // of the wear levelling
+static uint32_t n_blocks = 0;  // flash sectors of the volume
+static uint16_t *slot_of = NULL; // per flash sector, its slot + 1 or 0
+
+// Allocated on the first write and released on flush, so the images
+// ingested afterwards get the PSRAM
+static uint8_t *data = NULL; // a flash sector per slot
+static uint32_t *valid = NULL; // per slot, the sectors the host wrote
+static uint32_t *block_of = NULL; // per slot, its flash sector
+static uint32_t n_slots = 0;
+static uint32_t used = 0;
+
+static bool alloc(void)
+{
+    uint32_t slots = CONFIG_FLASH_MSC_CACHE_SIZE * 1024 / FLASH_SECTOR_SIZE;
+    slots = MIN(MIN(slots, n_blocks), UINT16_MAX);
+    for (; slots >= MIN_SLOTS; slots /= 2) {
+        size_t size = slots * (FLASH_SECTOR_SIZE + 2 * sizeof(uint32_t));
+        data = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (data != NULL) {
+            break;
+        }
+    }
+    if (data == NULL) {
+        ESP_LOGW(TAG, "No memory for the cache, writing through");
+        return false;
+    }
+    valid = (uint32_t *)(data + slots * FLASH_SECTOR_SIZE);
+    block_of = valid + slots;
+    n_slots = slots;
+    used = 0;
+    ESP_LOGI(TAG, "Caching the host writes in %ld KiB",
+             slots * FLASH_SECTOR_SIZE / 1024);
+    return true;
+}
+
+// Move the slots left after a failed write back to the front, in order, so
+// each lands on a slot already moved or freed
+static void compact(void)
+{
+    uint32_t k = 0;
+    for (uint32_t s = 0; s < used; s++) {
+        uint32_t b = block_of[s];
+        if (slot_of[b] != s + 1) {
+            continue; // written back
+        }
+        if (k != s) {
+            memcpy(data + k * FLASH_SECTOR_SIZE, data + s * FLASH_SECTOR_SIZE,
+                   FLASH_SECTOR_SIZE);
+            valid[k] = valid[s];
+            block_of[k] = b;
+            slot_of[b] = k + 1;
+        }
+        k++;
+    }
+    used = k;
+}
+
+// Every cached flash sector in address order, each with one erase and one
+// write. The sectors of it the host did not write are read first. On an
+// error only the sectors written back leave the cache.
+static esp_err_t write_back(void)
+{
+    if (used == 0) {
+        return ESP_OK;
+    }
+    int64_t start = esp_timer_get_time();
+    const uint32_t per_block = FLASH_SECTOR_SIZE / sector_size;
+    esp_err_t err = ESP_OK;
+    int filled = 0;
+    for (uint32_t b = 0; b < n_blocks && err == ESP_OK; b++) {
+        if (slot_of[b] == 0) {
+            continue;
+        }
+        uint32_t s = slot_of[b] - 1;
+        uint8_t *block = data + s * FLASH_SECTOR_SIZE;
+        size_t addr = b * FLASH_SECTOR_SIZE;
+        for (uint32_t i = 0; i < per_block && err == ESP_OK; i++) {
+            if ((valid[s] & (1u << i)) == 0) {
+                err = wl_read(wl, addr + i * sector_size,
+                              block + i * sector_size, sector_size);
+                filled++;
+            }
+        }
+        if (err != ESP_OK) {
+            break;
+        }
+        // Filled, the slot holds the whole sector once the erase is done
+        valid[s] = (1u << per_block) - 1;
+        err = wl_erase_range(wl, addr, FLASH_SECTOR_SIZE);
+        if (err == ESP_OK) {
+            err = wl_write(wl, addr, block, FLASH_SECTOR_SIZE);
+        }
+        if (err == ESP_OK) {
+            slot_of[b] = 0;
+        }
+    }
+    if (err != ESP_OK) {
+        uint32_t cached = used;
+        compact();
+        ESP_LOGE(TAG, "Write back failed: %s, %ld of %ld flash sector(s) kept",
+                 esp_err_to_name(err), used, cached);
+        return err;
+    }
+    ESP_LOGI(TAG, "Wrote back %ld flash sector(s), %d filled, in %lld ms",
+             used, filled, (esp_timer_get_time() - start) / 1000);
+    used = 0;
+    return ESP_OK;
+}
+
+// The slot of the flash sector, a full cache is written back first
+static int take(uint32_t block, esp_err_t *err)
+{
+    if (block >= n_blocks) {
+        *err = ESP_ERR_INVALID_SIZE;
+        return -1;
+    }
+    if (slot_of[block] != 0) {
+        return slot_of[block] - 1;
+    }
+    if (used == n_slots && (*err = write_back()) != ESP_OK) {
+        return -1;
+    }
+    valid[used] = 0;
+    block_of[used] = block;
+    slot_of[block] = ++used;
+    return used - 1;
+}
+
+esp_err_t msc_cache_write(size_t addr, const void *buf, size_t size)
+{
+    if (lock == NULL) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (data == NULL && !alloc()) {
+        xSemaphoreGive(lock);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    const uint8_t *src = buf;
+    const size_t end = addr + size;
+    esp_err_t err = ESP_OK;
+    for (size_t pos = addr; pos < end && err == ESP_OK;) {
+        size_t next = MIN(end, (pos / sector_size + 1) * sector_size);
+        size_t off = pos % FLASH_SECTOR_SIZE;
+        uint32_t bit = 1u << off / sector_size;
+        int s = take(pos / FLASH_SECTOR_SIZE, &err);
+        if (s < 0) {
+            break;
+        }
+        uint8_t *block = data + s * FLASH_SECTOR_SIZE;
+        if ((valid[s] & bit) == 0 && next - pos < sector_size) {
+            // A partly written sector keeps the rest of its content
+            size_t first = pos - pos % sector_size;
+            err = wl_read(wl, first, block + first % FLASH_SECTOR_SIZE,
+                          sector_size);
+        }
+        if (err == ESP_OK) {
+            memcpy(block + off, src + (pos - addr), next - pos);
+            valid[s] |= bit;
+        }
+        pos = next;
+    }
+    xSemaphoreGive(lock);
+    xTaskNotifyGive(flusher);
+    return err;
+}
+
+esp_err_t msc_cache_read(size_t addr, void *buf, size_t size)
+{
+    if (lock == NULL) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (data == NULL) {
+        xSemaphoreGive(lock);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    uint8_t *dst = buf;
+    const size_t end = addr + size;
+    esp_err_t err = wl_read(wl, addr, buf, size);
+    for (size_t pos = addr; pos < end && err == ESP_OK;) {
+        size_t next = MIN(end, (pos / sector_size + 1) * sector_size);
+        uint32_t block = pos / FLASH_SECTOR_SIZE;
+        size_t off = pos % FLASH_SECTOR_SIZE;
+        if (block < n_blocks && slot_of[block] != 0) {
+            uint32_t s = slot_of[block] - 1;
+            if ((valid[s] & (1u << off / sector_size)) != 0) {
+                memcpy(dst + (pos - addr), data + s * FLASH_SECTOR_SIZE + off,
+                       next - pos);
+            }
+        }
+        pos = next;
+    }
+    xSemaphoreGive(lock);
+    return err;
+}
+
+// Written back while the host has the volume. Once the app mounted it, a
+// write underneath FATFS would corrupt it, what is left is dropped.
+static esp_err_t release(bool keep)
+{
+    if (lock == NULL) {
+        return ESP_OK;
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    esp_err_t err = ESP_OK;
+    if (keep) {
+        err = write_back();
+        if (err != ESP_OK) {
+            // Still acknowledged to the host, kept for the next flush
+            xSemaphoreGive(lock);
+            return err;
+        }
+    } else if (used > 0) {
+        ESP_LOGE(TAG, "Dropped %ld flash sector(s) the app owns", used);
+        memset(slot_of, 0, n_blocks * sizeof(uint16_t));
+        used = 0;
+    }
+    heap_caps_free(data);
+    data = NULL;
+    valid = NULL;
+    block_of = NULL;
+    n_slots = 0;
+    xSemaphoreGive(lock);
+    return err;
+}
+
+esp_err_t msc_cache_flush(void)
+{
+    return release(true);
+}
+
+// Write back once the host paused for FLASH_MSC_CACHE_IDLE_MS
+static void flush_task(void *arg)
+{
+    const TickType_t idle = pdMS_TO_TICKS(CONFIG_FLASH_MSC_CACHE_IDLE_MS);
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while (ulTaskNotifyTake(pdTRUE, idle) != 0) {
+        }
+        release(tinyusb_msc_storage_in_use_by_usb_host());
+    }
+}
+
+void msc_cache_init(wl_handle_t handle)
+{
+    if (CONFIG_FLASH_MSC_CACHE_SIZE == 0) {
+        return;
+    }
+    wl = handle;
+    sector_size = wl_sector_size(wl);
+    n_blocks = wl_size(wl) / FLASH_SECTOR_SIZE;
+    if (sector_size == 0 || FLASH_SECTOR_SIZE % sector_size != 0) {
+        ESP_LOGW(TAG, "Sector size %d unsupported, writing through",
+                 sector_size);
+        return;
+    }
+    slot_of = calloc(n_blocks, sizeof(uint16_t));
+    SemaphoreHandle_t mutex = xSemaphoreCreateMutex();
+    if (slot_of == NULL || mutex == NULL ||
+        xTaskCreate(flush_task, "msc_cache", 4096, NULL, 2, &flusher) !=
+            pdPASS) {
+        ESP_LOGE(TAG, "Cannot start the cache, writing through");
+        free(slot_of);
+        slot_of = NULL;
+        if (mutex != NULL) {
+            vSemaphoreDelete(mutex);
+        }
+        return;
+    }
+    lock = mutex;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "esp_err.h"
+#include "wear_levelling.h"
+
+// Write-back cache between the MSC class and the wear levelling. The host
+// writes sectors of the wear levelling, often only 512 bytes, each of which
+// costs a read, erase and write of its 4 KiB flash sector. The cache collects
+// them per flash sector in PSRAM and writes whole flash sectors on flush.
+// Addresses are bytes on the volume.
+
+void msc_cache_init(wl_handle_t wl);
+
+esp_err_t msc_cache_write(size_t addr, const void *buf, size_t size);
+// Read the volume with the cached sectors in place
+esp_err_t msc_cache_read(size_t addr, void *buf, size_t size);
+// Write everything back, before the volume is handed to the app. The idle
+// write back drops the cache instead once the app has it.
+esp_err_t msc_cache_flush(void);
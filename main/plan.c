@@ -0,0 +1,74 @@
+#include <stdlib.h>
+
+#include "esp_log.h"
+#include "nvs.h"
+#include "plan.h"
+
+static const char *TAG = "plan";
+
+#define NVS_NAMESPACE "plan"
+#define NVS_KEY "job"
+
+static bool saved = true; // not known before the first drop
+
+flash_args_t *plan_load(void)
+{
+    nvs_handle_t nvs;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return NULL; // nothing saved yet
+    }
+    flash_args_t *args = NULL;
+    size_t size = 0;
+    if (nvs_get_blob(nvs, NVS_KEY, NULL, &size) == ESP_OK) {
+        uint8_t *blob = malloc(size);
+        if (blob != NULL &&
+            nvs_get_blob(nvs, NVS_KEY, blob, &size) == ESP_OK) {
+            args = flash_args_unpack(blob, size);
+        }
+        free(blob);
+    }
+    nvs_close(nvs);
+    if (args != NULL) {
+        ESP_LOGI(TAG, "Loaded the plan of \"%s\", %d bytes", args->dir, size);
+    }
+    return args;
+}
+
+void plan_save(const flash_args_t *args)
+{
+    uint8_t *blob;
+    size_t size = flash_args_pack(args, &blob);
+    if (size == 0) {
+        return;
+    }
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err == ESP_OK) {
+        err = nvs_set_blob(nvs, NVS_KEY, blob, size);
+        if (err == ESP_OK) {
+            err = nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+    free(blob);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Cannot save the plan: %s", esp_err_to_name(err));
+        return;
+    }
+    saved = true;
+    ESP_LOGI(TAG, "Saved the plan, %d bytes", size);
+}
+
+void plan_drop(void)
+{
+    if (!saved) {
+        return;
+    }
+    nvs_handle_t nvs;
+    if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs) == ESP_OK) {
+        nvs_erase_key(nvs, NVS_KEY);
+        nvs_commit(nvs);
+        nvs_close(nvs);
+    }
+    saved = false;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "flash_args.h"
+
+// The compiled job of the last mount kept in NVS, so the next boot skips the
+// JSON and the digests. It is dropped as soon as the host writes the storage,
+// a plan found on boot thus still matches the files.
+
+flash_args_t *plan_load(void);
+void plan_save(const flash_args_t *args);
+void plan_drop(void);
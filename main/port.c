@@ -0,0 +1,166 @@
+#include <sys/param.h>
+
+#include "port.h"
+#include "driver/gpio.h"
+#include "driver/uart.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "trace.h"
+
+static const char *TAG = "port";
+
+#define PORT_RX_BUFFER_SIZE 4096
+#define PORT_TX_BUFFER_SIZE 4096
+#define PORT_RESET_HOLD_TIME_MS 100
+#define PORT_BOOT_HOLD_TIME_MS 50
+
+esp_loader_error_t port_init(port_t *port, const port_config_t *config,
+                             uint32_t baud_rate)
+{
+    port->config = *config;
+    port->baud_rate = baud_rate;
+    port->deadline = 0;
+
+    const uart_config_t uart_config = {
+        .baud_rate = baud_rate,
+        .data_bits = UART_DATA_8_BITS,
+        .parity = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+        .source_clk = UART_SCLK_DEFAULT,
+    };
+    if (uart_param_config(config->uart_port, &uart_config) != ESP_OK ||
+        uart_set_pin(config->uart_port, config->tx_pin, config->rx_pin,
+                     UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE) != ESP_OK ||
+        uart_driver_install(config->uart_port, PORT_RX_BUFFER_SIZE,
+                            PORT_TX_BUFFER_SIZE, 0, NULL, 0) != ESP_OK) {
+        ESP_LOGE(TAG, "Cannot initialize UART%d", config->uart_port);
+        return ESP_LOADER_ERROR_FAIL;
+    }
+
+    const gpio_config_t io_config = {
+        .pin_bit_mask = (1ULL << config->reset_pin) | (1ULL << config->io0_pin),
+        .mode = GPIO_MODE_OUTPUT,
+        .pull_up_en = GPIO_PULLUP_DISABLE,
+        .pull_down_en = GPIO_PULLDOWN_DISABLE,
+        .intr_type = GPIO_INTR_DISABLE,
+    };
+    gpio_config(&io_config);
+    gpio_set_level(config->reset_pin, 1);
+    gpio_set_level(config->io0_pin, 1);
+
+    if (config->sense_pin >= 0) {
+        const gpio_config_t sense_config = {
+            .pin_bit_mask = 1ULL << config->sense_pin,
+            .mode = GPIO_MODE_INPUT,
+            .pull_up_en = GPIO_PULLUP_ENABLE,
+            .pull_down_en = GPIO_PULLDOWN_DISABLE,
+            .intr_type = GPIO_INTR_DISABLE,
+        };
+        gpio_config(&sense_config);
+    }
+    return ESP_LOADER_SUCCESS;
+}
+
+void port_deinit(port_t *port)
+{
+    uart_driver_delete(port->config.uart_port);
+}
+
+bool port_sense(port_t *port)
+{
+    return gpio_get_level(port->config.sense_pin) == 0;
+}
+
+void port_reset_target(port_t *port)
+{
+    gpio_set_level(port->config.reset_pin, 0);
+    port_delay_ms(PORT_RESET_HOLD_TIME_MS);
+    gpio_set_level(port->config.reset_pin, 1);
+}
+
+void port_enter_bootloader(port_t *port)
+{
+    gpio_set_level(port->config.io0_pin, 0);
+    port_reset_target(port);
+    port_delay_ms(PORT_BOOT_HOLD_TIME_MS);
+    gpio_set_level(port->config.io0_pin, 1);
+}
+
+esp_loader_error_t port_change_rate(port_t *port, uint32_t baud_rate)
+{
+    uart_wait_tx_done(port->config.uart_port, pdMS_TO_TICKS(100));
+    if (uart_set_baudrate(port->config.uart_port, baud_rate) != ESP_OK) {
+        return ESP_LOADER_ERROR_FAIL;
+    }
+    port->baud_rate = baud_rate;
+    return ESP_LOADER_SUCCESS;
+}
+
+esp_loader_error_t port_write(port_t *port, const uint8_t *data, size_t size,
+                              uint32_t timeout)
+{
+    // uart_write_bytes() blocks until all fits, so only the room is written
+    int64_t deadline = esp_timer_get_time() + timeout * 1000LL;
+    esp_loader_error_t err = ESP_LOADER_SUCCESS;
+
+    TRACE_BEGIN("uart_tx");
+    while (size > 0) {
+        size_t room = 0;
+        uart_get_tx_buffer_free_size(port->config.uart_port, &room);
+        if (room == 0) {
+            if (esp_timer_get_time() >= deadline) {
+                err = ESP_LOADER_ERROR_TIMEOUT;
+                break;
+            }
+            uart_wait_tx_done(port->config.uart_port, 1);
+            continue;
+        }
+        int written = uart_write_bytes(port->config.uart_port, data,
+                                       MIN(size, room));
+        if (written < 0) {
+            err = ESP_LOADER_ERROR_FAIL;
+            break;
+        }
+        data += written;
+        size -= written;
+    }
+    TRACE_END("uart_tx");
+    return err;
+}
+
+esp_loader_error_t port_read(port_t *port, uint8_t *data, size_t size,
+                             uint32_t timeout)
+{
+    int read = uart_read_bytes(port->config.uart_port, data, size,
+                               pdMS_TO_TICKS(timeout));
+    if (read < 0) {
+        return ESP_LOADER_ERROR_FAIL;
+    } else if ((size_t)read < size) {
+        return ESP_LOADER_ERROR_TIMEOUT;
+    }
+    return ESP_LOADER_SUCCESS;
+}
+
+void port_flush(port_t *port)
+{
+    uart_flush_input(port->config.uart_port);
+}
+
+void port_start_timer(port_t *port, uint32_t ms)
+{
+    port->deadline = esp_timer_get_time() + ms * 1000LL;
+}
+
+uint32_t port_remaining_time(port_t *port)
+{
+    int64_t remaining = (port->deadline - esp_timer_get_time()) / 1000;
+    return remaining > 0 ? remaining : 0;
+}
+
+void port_delay_ms(uint32_t ms)
+{
+    vTaskDelay(pdMS_TO_TICKS(ms));
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_loader.h"
+
+// UART and boot strapping pins of one target, all state lives in port_t so
+// several targets can be driven at the same time.
+
+typedef struct {
+    int uart_port;
+    int rx_pin;
+    int tx_pin;
+    int reset_pin;
+    int io0_pin;
+    int sense_pin; // low while a target is inserted, -1 for none
+} port_config_t;
+
+typedef struct {
+    port_config_t config;
+    uint32_t baud_rate;
+    int64_t deadline;
+} port_t;
+
+esp_loader_error_t port_init(port_t *port, const port_config_t *config,
+                             uint32_t baud_rate);
+void port_deinit(port_t *port);
+
+bool port_sense(port_t *port);
+void port_enter_bootloader(port_t *port);
+void port_reset_target(port_t *port);
+esp_loader_error_t port_change_rate(port_t *port, uint32_t baud_rate);
+
+esp_loader_error_t port_write(port_t *port, const uint8_t *data, size_t size,
+                              uint32_t timeout);
+esp_loader_error_t port_read(port_t *port, uint8_t *data, size_t size,
+                             uint32_t timeout);
+void port_flush(port_t *port);
+
+void port_start_timer(port_t *port, uint32_t ms);
+uint32_t port_remaining_time(port_t *port);
+void port_delay_ms(uint32_t ms);
@@ -0,0 +1,606 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "esp_log.h"
+#include "proto.h"
+#include "trace.h"
+
+static const char *TAG = "proto";
+
+#define SLIP_END 0xC0
+#define SLIP_ESC 0xDB
+#define SLIP_ESC_END 0xDC
+#define SLIP_ESC_ESC 0xDD
+
+#define CMD_FLASH_BEGIN 0x02
+#define CMD_FLASH_DATA 0x03
+#define CMD_MEM_BEGIN 0x05
+#define CMD_MEM_END 0x06
+#define CMD_MEM_DATA 0x07
+#define CMD_SYNC 0x08
+#define CMD_READ_REG 0x0A
+#define CMD_SPI_SET_PARAMS 0x0B
+#define CMD_SPI_ATTACH 0x0D
+#define CMD_CHANGE_BAUDRATE 0x0F
+#define CMD_FLASH_DEFL_BEGIN 0x10
+#define CMD_FLASH_DEFL_DATA 0x11
+#define CMD_SPI_FLASH_MD5 0x13
+#define CMD_ERASE_FLASH 0xD0
+#define CMD_ERASE_REGION 0xD1
+#define CMD_READ_FLASH 0xD2
+
+#define DIRECTION_REQUEST 0x00
+#define DIRECTION_RESPONSE 0x01
+#define CHECKSUM_SEED 0xEF
+#define ROM_INVALID_RECV_MSG 0x05
+#define ROM_INVALID_CRC 0x07
+#define STUB_BAD_DATA_LEN 0xC0
+#define STUB_BAD_DATA_CHECKSUM 0xC1
+
+#define DEFAULT_TIMEOUT 3000
+#define SYNC_TIMEOUT 100
+#define SYNC_TRIALS 10
+#define MEM_END_ROM_TIMEOUT 200
+#define STUB_START_TIMEOUT 1000
+#define FLASH_SECTOR_SIZE 4096
+#define ERASE_TIMEOUT_PER_MB 30000
+#define MD5_TIMEOUT_PER_MB 8000
+#define RESPONSE_MAX 64
+#define RESPONSE_SKIP 16
+#define CHIP_DETECT_MAGIC_REG 0x40001000
+
+typedef struct __attribute__((packed)) {
+    uint8_t direction;
+    uint8_t command;
+    uint16_t size;
+    uint32_t value; // checksum of the data in requests
+} proto_header_t;
+
+typedef struct {
+    port_t *port;
+    uint8_t buf[128];
+    size_t len;
+    esp_loader_error_t err;
+} slip_writer_t;
+
+static const struct {
+    target_chip_t chip;
+    uint32_t magic;
+} chip_magic[] = {
+    {ESP8266_CHIP, 0xfff0c101}, {ESP32_CHIP, 0x00f01d83},
+    {ESP32S2_CHIP, 0x000007c6}, {ESP32C3_CHIP, 0x6921506f},
+    {ESP32C3_CHIP, 0x1b31506f}, {ESP32C3_CHIP, 0x4881606f},
+    {ESP32C3_CHIP, 0x4361606f}, {ESP32S3_CHIP, 0x00000009},
+    {ESP32C2_CHIP, 0x6f51306f}, {ESP32C2_CHIP, 0x7c41a06f},
+    {ESP32H2_CHIP, 0xd7b73e80},
+};
+
+void proto_init(proto_t *p, port_t *port, target_chip_t chip)
+{
+    p->port = port;
+    p->chip = chip;
+    p->stub = false;
+    p->error = 0;
+    // ROM loaders answer with 4 status bytes, except the ESP8266 one
+    p->status_len = chip == ESP8266_CHIP ? 2 : 4;
+    p->seq = 0;
+}
+
+static uint32_t timeout_per_mb(uint32_t ms_per_mb, uint32_t size)
+{
+    uint32_t timeout = (uint64_t)ms_per_mb * size / (1024 * 1024);
+    return MAX(timeout, DEFAULT_TIMEOUT);
+}
+
+// Only the ROM loaders of the newer chips take the encryption flag
+static size_t begin_params_size(proto_t *p)
+{
+    if (p->stub || p->chip == ESP8266_CHIP ||
+        p->chip == ESP32_CHIP) {
+        return 4 * sizeof(uint32_t);
+    }
+    return 5 * sizeof(uint32_t);
+}
+
+// Work around the ESP8266 ROM erasing twice the requested size
+static uint32_t erase_size(proto_t *p, uint32_t addr, uint32_t size)
+{
+    if (p->stub || p->chip != ESP8266_CHIP) {
+        return size;
+    }
+    const uint32_t sectors_per_block = 16;
+    uint32_t sectors = (size + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE;
+    uint32_t head =
+        sectors_per_block - (addr / FLASH_SECTOR_SIZE) % sectors_per_block;
+    head = MIN(head, sectors);
+    if (sectors < 2 * head) {
+        return (sectors + 1) / 2 * FLASH_SECTOR_SIZE;
+    }
+    return (sectors - head) * FLASH_SECTOR_SIZE;
+}
+
+static void slip_flush(slip_writer_t *w)
+{
+    if (w->len > 0 && w->err == ESP_LOADER_SUCCESS) {
+        w->err = port_write(w->port, w->buf, w->len, DEFAULT_TIMEOUT);
+    }
+    w->len = 0;
+}
+
+static void slip_put(slip_writer_t *w, uint8_t c, bool escape)
+{
+    if (w->len + 2 > sizeof(w->buf)) {
+        slip_flush(w);
+    }
+    if (escape && c == SLIP_END) {
+        w->buf[w->len++] = SLIP_ESC;
+        w->buf[w->len++] = SLIP_ESC_END;
+    } else if (escape && c == SLIP_ESC) {
+        w->buf[w->len++] = SLIP_ESC;
+        w->buf[w->len++] = SLIP_ESC_ESC;
+    } else {
+        w->buf[w->len++] = c;
+    }
+}
+
+static void slip_write(slip_writer_t *w, const void *data, size_t size)
+{
+    const uint8_t *p = data;
+    for (size_t i = 0; i < size; i++) {
+        slip_put(w, p[i], true);
+    }
+}
+
+static esp_loader_error_t slip_read_byte(port_t *port, uint8_t *c)
+{
+    uint32_t remaining = port_remaining_time(port);
+    if (remaining == 0) {
+        return ESP_LOADER_ERROR_TIMEOUT;
+    }
+    return port_read(port, c, 1, remaining);
+}
+
+// Receive one frame, bytes beyond size are counted in len but dropped
+static esp_loader_error_t slip_receive(port_t *port, uint8_t *buf,
+                                       size_t size, size_t *len)
+{
+    esp_loader_error_t err;
+    uint8_t c;
+    do {
+        err = slip_read_byte(port, &c);
+        if (err != ESP_LOADER_SUCCESS) {
+            return err;
+        }
+    } while (c != SLIP_END);
+
+    size_t n = 0;
+    bool escaped = false;
+    while (true) {
+        err = slip_read_byte(port, &c);
+        if (err != ESP_LOADER_SUCCESS) {
+            return err;
+        }
+        if (c == SLIP_END) {
+            if (n == 0) {
+                continue; // end of a previous frame
+            }
+            break;
+        }
+        if (escaped) {
+            escaped = false;
+            if (c == SLIP_ESC_END) {
+                c = SLIP_END;
+            } else if (c == SLIP_ESC_ESC) {
+                c = SLIP_ESC;
+            }
+        } else if (c == SLIP_ESC) {
+            escaped = true;
+            continue;
+        }
+        if (n < size) {
+            buf[n] = c;
+        }
+        n++;
+    }
+    *len = n;
+    return ESP_LOADER_SUCCESS;
+}
+
+// Late answers to earlier commands may still be in flight, skip them
+static esp_loader_error_t response(proto_t *p, uint8_t cmd, uint32_t *value,
+                                   uint8_t *resp, size_t *resp_size)
+{
+    for (int i = 0; i < RESPONSE_SKIP; i++) {
+        uint8_t frame[sizeof(proto_header_t) + RESPONSE_MAX];
+        size_t len;
+        esp_loader_error_t err =
+            slip_receive(p->port, frame, sizeof(frame), &len);
+        if (err != ESP_LOADER_SUCCESS) {
+            return err;
+        }
+        proto_header_t *r = (proto_header_t *)frame;
+        if (len < sizeof(proto_header_t) ||
+            r->direction != DIRECTION_RESPONSE || r->command != cmd) {
+            continue;
+        }
+        size_t payload = len - sizeof(proto_header_t);
+        if (len > sizeof(frame) || r->size != payload ||
+            payload < p->status_len) {
+            return ESP_LOADER_ERROR_INVALID_RESPONSE;
+        }
+        payload -= p->status_len;
+        const uint8_t *status = frame + sizeof(proto_header_t) + payload;
+        if (status[0] != 0) {
+            ESP_LOGD(TAG, "Command 0x%02x failed: 0x%02x", cmd, status[1]);
+            p->error = status[1];
+            return status[1] == ROM_INVALID_RECV_MSG
+                       ? ESP_LOADER_ERROR_UNSUPPORTED_FUNC
+                       : ESP_LOADER_ERROR_INVALID_RESPONSE;
+        }
+        if (value != NULL) {
+            *value = r->value;
+        }
+        if (resp != NULL) {
+            *resp_size = MIN(*resp_size, payload);
+            memcpy(resp, frame + sizeof(proto_header_t), *resp_size);
+        }
+        return ESP_LOADER_SUCCESS;
+    }
+    return ESP_LOADER_ERROR_INVALID_RESPONSE;
+}
+
+static esp_loader_error_t command(proto_t *p, uint8_t cmd, const void *params,
+                                  size_t params_size, const uint8_t *data,
+                                  size_t data_size, uint32_t *value,
+                                  uint8_t *resp, size_t *resp_size,
+                                  uint32_t timeout)
+{
+    proto_header_t header = {
+        .direction = DIRECTION_REQUEST,
+        .command = cmd,
+        .size = params_size + data_size,
+        .value = 0,
+    };
+    if (data != NULL) {
+        uint8_t checksum = CHECKSUM_SEED;
+        for (size_t i = 0; i < data_size; i++) {
+            checksum ^= data[i];
+        }
+        header.value = checksum;
+    }
+
+    p->error = 0;
+    port_start_timer(p->port, timeout);
+    slip_writer_t w = {
+        .port = p->port,
+        .len = 0,
+        .err = ESP_LOADER_SUCCESS,
+    };
+    // The encoder hands its chunks to the UART as it goes, "uart_tx" nests
+    TRACE_BEGIN("slip");
+    slip_put(&w, SLIP_END, false);
+    slip_write(&w, &header, sizeof(header));
+    slip_write(&w, params, params_size);
+    slip_write(&w, data, data_size);
+    slip_put(&w, SLIP_END, false);
+    slip_flush(&w);
+    TRACE_END("slip");
+    if (w.err != ESP_LOADER_SUCCESS) {
+        return w.err;
+    }
+    TRACE_BEGIN("ack");
+    esp_loader_error_t err = response(p, cmd, value, resp, resp_size);
+    TRACE_END("ack");
+    return err;
+}
+
+static esp_loader_error_t sync(proto_t *p)
+{
+    uint8_t params[36] = {0x07, 0x07, 0x12, 0x20};
+    memset(params + 4, 0x55, sizeof(params) - 4);
+    return command(p, CMD_SYNC, params, sizeof(params), NULL, 0, NULL, NULL,
+                   NULL, SYNC_TIMEOUT);
+}
+
+static esp_loader_error_t detect_chip(proto_t *p)
+{
+    uint32_t magic;
+    esp_loader_error_t err = proto_read_reg(p, CHIP_DETECT_MAGIC_REG, &magic);
+    if (err != ESP_LOADER_SUCCESS) {
+        return err;
+    }
+    for (int i = 0; i < sizeof(chip_magic) / sizeof(chip_magic[0]); i++) {
+        if (chip_magic[i].magic == magic) {
+            proto_init(p, p->port, chip_magic[i].chip);
+            return ESP_LOADER_SUCCESS;
+        }
+    }
+    ESP_LOGE(TAG, "Unknown chip magic 0x%08lx", magic);
+    return ESP_LOADER_ERROR_INVALID_TARGET;
+}
+
+esp_loader_error_t proto_sync(proto_t *p, port_t *port, int trials)
+{
+    // Until the chip is known only the status bytes common to all loaders
+    // are checked
+    proto_init(p, port, ESP_UNKNOWN_CHIP);
+    p->status_len = 2;
+
+    port_enter_bootloader(port);
+    esp_loader_error_t err;
+    do {
+        err = sync(p);
+        if (err == ESP_LOADER_ERROR_TIMEOUT && --trials > 0) {
+            port_delay_ms(100);
+        } else if (err != ESP_LOADER_SUCCESS) {
+            return err;
+        }
+    } while (err != ESP_LOADER_SUCCESS);
+    return ESP_LOADER_SUCCESS;
+}
+
+esp_loader_error_t proto_attach(proto_t *p)
+{
+    // The ROM answers a sync several times, drop the extra answers
+    port_delay_ms(20);
+    port_flush(p->port);
+
+    esp_loader_error_t err = detect_chip(p);
+    if (err != ESP_LOADER_SUCCESS || p->chip == ESP8266_CHIP) {
+        return err;
+    }
+    uint32_t params[2] = {0, 0};
+    return command(p, CMD_SPI_ATTACH, params, sizeof(params), NULL, 0, NULL,
+                   NULL, NULL, DEFAULT_TIMEOUT);
+}
+
+esp_loader_error_t proto_connect(proto_t *p, port_t *port)
+{
+    esp_loader_error_t err = proto_sync(p, port, SYNC_TRIALS);
+    if (err != ESP_LOADER_SUCCESS) {
+        return err;
+    }
+    return proto_attach(p);
+}
+
+esp_loader_error_t proto_spi_set_params(proto_t *p, uint32_t flash_size)
+{
+    uint32_t params[6] = {0, flash_size, 64 * 1024, FLASH_SECTOR_SIZE, 256,
+                          0xffff};
+    return command(p, CMD_SPI_SET_PARAMS, params, sizeof(params), NULL, 0,
+                   NULL, NULL, NULL, DEFAULT_TIMEOUT);
+}
+
+esp_loader_error_t proto_read_reg(proto_t *p, uint32_t addr, uint32_t *value)
+{
+    return command(p, CMD_READ_REG, &addr, sizeof(addr), NULL, 0, value, NULL,
+                   NULL, DEFAULT_TIMEOUT);
+}
+
+esp_loader_error_t proto_change_baudrate(proto_t *p, uint32_t rate,
+                                         uint32_t old_rate)
+{
+    // The stub derives the divider from the old rate, the ROM wants zero
+    uint32_t params[2] = {rate, p->stub ? old_rate : 0};
+    return command(p, CMD_CHANGE_BAUDRATE, params, sizeof(params), NULL, 0,
+                   NULL, NULL, NULL, DEFAULT_TIMEOUT);
+}
+
+esp_loader_error_t proto_mem_begin(proto_t *p, uint32_t addr, uint32_t size,
+                                   uint32_t block_size)
+{
+    uint32_t blocks = (size + block_size - 1) / block_size;
+    uint32_t params[4] = {size, blocks, block_size, addr};
+
+    p->seq = 0;
+    return command(p, CMD_MEM_BEGIN, params, sizeof(params), NULL, 0, NULL,
+                   NULL, NULL, DEFAULT_TIMEOUT);
+}
+
+esp_loader_error_t proto_mem_data(proto_t *p, const uint8_t *data,
+                                  uint32_t size)
+{
+    uint32_t params[4] = {size, p->seq, 0, 0};
+    esp_loader_error_t err =
+        command(p, CMD_MEM_DATA, params, sizeof(params), data, size, NULL,
+                NULL, NULL, DEFAULT_TIMEOUT);
+    p->seq += err == ESP_LOADER_SUCCESS;
+    return err;
+}
+
+esp_loader_error_t proto_mem_finish(proto_t *p, uint32_t entry)
+{
+    uint32_t params[2] = {entry == 0, entry};
+    esp_loader_error_t err =
+        command(p, CMD_MEM_END, params, sizeof(params), NULL, 0, NULL, NULL,
+                NULL, p->stub ? DEFAULT_TIMEOUT : MEM_END_ROM_TIMEOUT);
+    // The ROM may jump to the entry before its answer leaves the UART
+    if (err == ESP_LOADER_ERROR_TIMEOUT && !p->stub) {
+        return ESP_LOADER_SUCCESS;
+    }
+    return err;
+}
+
+esp_loader_error_t proto_enter_stub(proto_t *p)
+{
+    uint8_t frame[4];
+    size_t len;
+
+    port_start_timer(p->port, STUB_START_TIMEOUT);
+    esp_loader_error_t err = slip_receive(p->port, frame, sizeof(frame), &len);
+    if (err != ESP_LOADER_SUCCESS) {
+        return err;
+    }
+    if (len != sizeof(frame) || memcmp(frame, "OHAI", sizeof(frame)) != 0) {
+        return ESP_LOADER_ERROR_INVALID_RESPONSE;
+    }
+    p->stub = true;
+    p->status_len = 2;
+    return ESP_LOADER_SUCCESS;
+}
+
+esp_loader_error_t proto_flash_begin(proto_t *p, uint32_t addr, uint32_t size,
+                                     uint32_t block_size, bool erase_first)
+{
+    uint32_t blocks = (size + block_size - 1) / block_size;
+    uint32_t erase = erase_size(p, addr, size);
+    // The ROM writes the blocks whatever it erased, the stub takes the size
+    // as the byte count and always erases ahead of the data
+    if (!erase_first && !p->stub) {
+        erase = 0;
+    }
+    uint32_t params[5] = {erase, blocks, block_size, addr, 0};
+
+    // The stub erases while it writes, the ROM erases everything up front
+    p->seq = 0;
+    return command(p, CMD_FLASH_BEGIN, params, begin_params_size(p), NULL, 0,
+                   NULL, NULL, NULL,
+                   p->stub ? DEFAULT_TIMEOUT
+                                : timeout_per_mb(ERASE_TIMEOUT_PER_MB, erase));
+}
+
+esp_loader_error_t proto_erase_chip(proto_t *p, uint32_t flash_size)
+{
+    uint32_t timeout = timeout_per_mb(ERASE_TIMEOUT_PER_MB, flash_size);
+    if (p->stub) {
+        return command(p, CMD_ERASE_FLASH, NULL, 0, NULL, 0, NULL, NULL, NULL,
+                       timeout);
+    }
+    return proto_erase_region(p, 0, flash_size);
+}
+
+esp_loader_error_t proto_erase_region(proto_t *p, uint32_t addr,
+                                      uint32_t size)
+{
+    uint32_t timeout = timeout_per_mb(ERASE_TIMEOUT_PER_MB, size);
+    if (p->stub) {
+        uint32_t params[2] = {addr, size};
+        return command(p, CMD_ERASE_REGION, params, sizeof(params), NULL, 0,
+                       NULL, NULL, NULL, timeout);
+    }
+    // The ROM has no such command, a write without blocks erases as well
+    uint32_t params[5] = {erase_size(p, addr, size), 0, FLASH_SECTOR_SIZE,
+                          addr, 0};
+    p->seq = 0;
+    return command(p, CMD_FLASH_BEGIN, params, begin_params_size(p), NULL, 0,
+                   NULL, NULL, NULL, timeout);
+}
+
+esp_loader_error_t proto_flash_data(proto_t *p, const uint8_t *data,
+                                    uint32_t size)
+{
+    uint32_t params[4] = {size, p->seq, 0, 0};
+    esp_loader_error_t err =
+        command(p, CMD_FLASH_DATA, params, sizeof(params), data, size, NULL,
+                NULL, NULL, DEFAULT_TIMEOUT);
+    p->seq += err == ESP_LOADER_SUCCESS;
+    return err;
+}
+
+bool proto_data_rejected(const proto_t *p)
+{
+    if (p->stub) {
+        return p->error == STUB_BAD_DATA_LEN ||
+               p->error == STUB_BAD_DATA_CHECKSUM;
+    }
+    return p->error == ROM_INVALID_CRC;
+}
+
+esp_loader_error_t proto_flash_defl_begin(proto_t *p, uint32_t addr,
+                                          uint32_t size, uint32_t zsize,
+                                          uint32_t block_size)
+{
+    uint32_t blocks = (zsize + block_size - 1) / block_size;
+    uint32_t write_size, timeout;
+    if (p->stub) {
+        // The stub takes the byte count and erases on the fly
+        write_size = size;
+        timeout = DEFAULT_TIMEOUT;
+    } else {
+        // The ROM erases the size rounded up to whole blocks
+        write_size = (size + block_size - 1) / block_size * block_size;
+        timeout = timeout_per_mb(ERASE_TIMEOUT_PER_MB, write_size);
+    }
+    uint32_t params[5] = {write_size, blocks, block_size, addr, 0};
+
+    p->seq = 0;
+    return command(p, CMD_FLASH_DEFL_BEGIN, params, begin_params_size(p), NULL,
+                   0, NULL, NULL, NULL, timeout);
+}
+
+esp_loader_error_t proto_flash_defl_data(proto_t *p, const uint8_t *data,
+                                         uint32_t size)
+{
+    uint32_t params[4] = {size, p->seq, 0, 0};
+    esp_loader_error_t err =
+        command(p, CMD_FLASH_DEFL_DATA, params, sizeof(params), data, size,
+                NULL, NULL, NULL, DEFAULT_TIMEOUT);
+    p->seq += err == ESP_LOADER_SUCCESS;
+    return err;
+}
+
+esp_loader_error_t proto_flash_md5(proto_t *p, uint32_t addr, uint32_t size,
+                                   uint8_t md5[16])
+{
+    uint32_t params[4] = {addr, size, 0, 0};
+    uint8_t resp[32];
+    size_t len = sizeof(resp);
+
+    esp_loader_error_t err =
+        command(p, CMD_SPI_FLASH_MD5, params, sizeof(params), NULL, 0, NULL,
+                resp, &len, timeout_per_mb(MD5_TIMEOUT_PER_MB, size));
+    if (err != ESP_LOADER_SUCCESS) {
+        return err;
+    }
+    if (len == 16) { // raw digest from the stub
+        memcpy(md5, resp, 16);
+    } else if (len == 32) { // hex digest from the ROM
+        for (int i = 0; i < 16; i++) {
+            unsigned int byte;
+            if (sscanf((const char *)resp + i * 2, "%2x", &byte) != 1) {
+                return ESP_LOADER_ERROR_INVALID_RESPONSE;
+            }
+            md5[i] = byte;
+        }
+    } else {
+        return ESP_LOADER_ERROR_INVALID_RESPONSE;
+    }
+    return ESP_LOADER_SUCCESS;
+}
+
+esp_loader_error_t proto_read_flash(proto_t *p, uint32_t addr, uint32_t size,
+                                    uint32_t packet_size, uint32_t inflight)
+{
+    if (!p->stub) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+    uint32_t params[4] = {addr, size, packet_size, inflight};
+    return command(p, CMD_READ_FLASH, params, sizeof(params), NULL, 0, NULL,
+                   NULL, NULL, DEFAULT_TIMEOUT);
+}
+
+esp_loader_error_t proto_read_flash_data(proto_t *p, uint8_t *buf,
+                                         size_t size, size_t *len)
+{
+    port_start_timer(p->port, DEFAULT_TIMEOUT);
+    esp_loader_error_t err = slip_receive(p->port, buf, size, len);
+    if (err == ESP_LOADER_SUCCESS && *len > size) {
+        return ESP_LOADER_ERROR_INVALID_RESPONSE;
+    }
+    return err;
+}
+
+esp_loader_error_t proto_read_flash_ack(proto_t *p, uint32_t received)
+{
+    slip_writer_t w = {
+        .port = p->port,
+        .len = 0,
+        .err = ESP_LOADER_SUCCESS,
+    };
+    slip_put(&w, SLIP_END, false);
+    slip_write(&w, &received, sizeof(received));
+    slip_put(&w, SLIP_END, false);
+    slip_flush(&w);
+    return w.err;
+}
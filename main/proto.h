@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_loader.h"
+#include "port.h"
+
+// Serial loader commands sent over one port. They understand both the ROM
+// loader and the flasher stub, every session keeps its own state.
+
+typedef struct {
+    port_t *port;
+    target_chip_t chip;
+    bool stub;
+    uint8_t status_len;
+    uint32_t seq;
+    uint8_t error; // status the loader failed the last command with
+} proto_t;
+
+void proto_init(proto_t *p, port_t *port, target_chip_t chip);
+// Reset the target into its ROM loader and sync within the given trials
+esp_loader_error_t proto_sync(proto_t *p, port_t *port, int trials);
+// Identify the synced loader and attach its SPI flash
+esp_loader_error_t proto_attach(proto_t *p);
+esp_loader_error_t proto_connect(proto_t *p, port_t *port);
+esp_loader_error_t proto_spi_set_params(proto_t *p, uint32_t flash_size);
+
+esp_loader_error_t proto_read_reg(proto_t *p, uint32_t addr, uint32_t *value);
+esp_loader_error_t proto_change_baudrate(proto_t *p, uint32_t rate,
+                                         uint32_t old_rate);
+
+esp_loader_error_t proto_mem_begin(proto_t *p, uint32_t addr, uint32_t size,
+                                   uint32_t block_size);
+// Like proto_flash_data()
+esp_loader_error_t proto_mem_data(proto_t *p, const uint8_t *data,
+                                  uint32_t size);
+esp_loader_error_t proto_mem_finish(proto_t *p, uint32_t entry);
+esp_loader_error_t proto_enter_stub(proto_t *p);
+
+// Without erase_first the ROM writes into flash erased before, the stub
+// erases ahead of the data either way
+esp_loader_error_t proto_flash_begin(proto_t *p, uint32_t addr, uint32_t size,
+                                     uint32_t block_size, bool erase_first);
+// ERASE_FLASH with the stub, a FLASH_BEGIN erasing flash_size with the ROM
+esp_loader_error_t proto_erase_chip(proto_t *p, uint32_t flash_size);
+// ERASE_REGION with the stub, sector aligned, a FLASH_BEGIN without blocks
+// with the ROM
+esp_loader_error_t proto_erase_region(proto_t *p, uint32_t addr,
+                                      uint32_t size);
+// A packet the loader did not take keeps its sequence number, the next call
+// sends it again
+esp_loader_error_t proto_flash_data(proto_t *p, const uint8_t *data,
+                                    uint32_t size);
+// Whether the loader refused the last packet for its length or checksum,
+// before taking it. The loaders ignore the sequence numbers, so only such a
+// packet may be sent again.
+bool proto_data_rejected(const proto_t *p);
+esp_loader_error_t proto_flash_defl_begin(proto_t *p, uint32_t addr,
+                                          uint32_t size, uint32_t zsize,
+                                          uint32_t block_size);
+esp_loader_error_t proto_flash_defl_data(proto_t *p, const uint8_t *data,
+                                         uint32_t size);
+esp_loader_error_t proto_flash_md5(proto_t *p, uint32_t addr, uint32_t size,
+                                   uint8_t md5[16]);
+
+// READ_FLASH of the stub, the ROM has none. The data follows in frames of
+// packet_size bytes, the stub sends at most inflight of them ahead of the
+// acks. A last frame holds the MD5 of the whole read.
+esp_loader_error_t proto_read_flash(proto_t *p, uint32_t addr, uint32_t size,
+                                    uint32_t packet_size, uint32_t inflight);
+// Receives the next data or MD5 frame into buf
+esp_loader_error_t proto_read_flash_data(proto_t *p, uint8_t *buf,
+                                         size_t size, size_t *len);
+// Acknowledges the bytes received so far
+esp_loader_error_t proto_read_flash_ack(proto_t *p, uint32_t received);
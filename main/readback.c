@@ -0,0 +1,159 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "esp_console.h"
+#include "esp_log.h"
+#include "flash.h"
+#include "gz.h"
+#include "readback.h"
+#include "tusb_msc_storage.h"
+
+static const char *TAG = "readback";
+
+#define READBACK_IMAGE "flash.bin.gz"
+#define READBACK_JOB "flasher_args.json"
+
+static bool (*begin_cb)(void) = NULL;
+// Of the last command
+static struct {
+    uint32_t addr;
+    uint32_t size;
+} request;
+static volatile bool stop = false;
+
+static bool store(const uint8_t *data, size_t size, void *ctx)
+{
+    // Nor does it write on once the host took the volume
+    if (stop || tinyusb_msc_storage_in_use_by_usb_host()) {
+        return false;
+    }
+    if (!gz_write(ctx, data, size)) {
+        ESP_LOGE(TAG, "Cannot store the image, is the storage full?");
+        return false;
+    }
+    return true;
+}
+
+// A dump of the whole flash is written back after a chip erase
+static bool write_job(const char *path, uint32_t addr,
+                      const flash_read_info_t *info)
+{
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        ESP_LOGE(TAG, "Cannot create \"%s\"", path);
+        return false;
+    }
+    fprintf(fp, "{\n    \"flash_files\": {\"0x%lx\": \"%s\"},\n", addr,
+            READBACK_IMAGE);
+    fprintf(fp,
+            "    \"extra_esptool_args\": {\"chip\": \"%s\", \"stub\": true}",
+            flash_args_chip_name(info->chip));
+    if (info->flash_size != 0) {
+        fprintf(fp,
+                ",\n    \"flash_settings\": {\"flash_size\": \"%ldMB\"}",
+                info->flash_size / (1024 * 1024));
+    }
+    if (addr == 0 && info->size == info->flash_size) {
+        fprintf(fp, ",\n    \"flasher\": {\"erase\": \"chip\"}");
+    }
+    fprintf(fp, "\n}\n");
+    bool ok = !ferror(fp);
+    return fclose(fp) == 0 && ok;
+}
+
+bool readback(const char *dir, uint32_t addr, uint32_t size)
+{
+    char image[strlen(dir) + sizeof(READBACK_IMAGE) + 1];
+    char job[strlen(dir) + sizeof(READBACK_JOB) + 1];
+    sprintf(image, "%s/" READBACK_IMAGE, dir);
+    sprintf(job, "%s/" READBACK_JOB, dir);
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        ESP_LOGE(TAG, "Cannot create \"%s\"", dir);
+        return false;
+    }
+    // No job may refer to an image cut short
+    unlink(job);
+    gz_writer_t *gz = gz_create(image);
+    if (gz == NULL) {
+        return false;
+    }
+    stop = false;
+    flash_read_info_t info;
+    bool read = flash_read(addr, size, store, gz, &info);
+    uint32_t zsize;
+    bool stored = gz_finish(gz, &zsize);
+    if (read && !stored) {
+        ESP_LOGE(TAG, "Cannot write \"%s\"", image);
+    }
+    if (!read || !stored || !write_job(job, addr, &info)) {
+        unlink(image);
+        unlink(job);
+        return false;
+    }
+    ESP_LOGI(TAG,
+             "%s flash 0x%lX-0x%lX stored in \"%s\": %ld -> %ld bytes (%d%%), "
+             "read at %lld KiB/s",
+             flash_args_chip_name(info.chip), addr, addr + info.size, image,
+             info.size, zsize,
+             (int)((uint64_t)zsize * 100 / (info.size > 0 ? info.size : 1)),
+             info.us > 0 ? info.size * 1000000LL / info.us / 1024 : 0);
+    return true;
+}
+
+bool readback_run(void)
+{
+    return readback(READBACK_DIR, request.addr, request.size);
+}
+
+void readback_stop(void)
+{
+    stop = true;
+}
+
+// Bytes with an optional K or M suffix, in any base strtoul() takes
+static bool parse_size(const char *str, uint32_t *size)
+{
+    char *end;
+    *size = strtoul(str, &end, 0);
+    if (end == str) {
+        return false;
+    }
+    if (strcasecmp(end, "K") == 0 || strcasecmp(end, "KB") == 0) {
+        *size *= 1024;
+    } else if (strcasecmp(end, "M") == 0 || strcasecmp(end, "MB") == 0) {
+        *size *= 1024 * 1024;
+    } else if (*end != '\0') {
+        return false;
+    }
+    return true;
+}
+
+static int read_cmd(int argc, char **argv)
+{
+    request.addr = 0;
+    request.size = 0;
+    if (argc > 3 || (argc > 1 && !parse_size(argv[1], &request.addr)) ||
+        (argc > 2 && !parse_size(argv[2], &request.size))) {
+        printf("Usage: read [ADDR [SIZE]], like \"read 0 4M\"\n");
+        return 1;
+    }
+    return begin_cb != NULL && begin_cb() ? 0 : 1;
+}
+
+void readback_init(bool (*begin)(void))
+{
+    begin_cb = begin;
+    const esp_console_cmd_t cmd = {
+        .command = "read",
+        .help = "Copy the flash of the target on the first channel into \""
+                CONFIG_FLASH_READBACK_DIR "\" on the storage and make it the "
+                "job, \"read [ADDR [SIZE]]\" reads a part",
+        .func = read_cmd,
+    };
+    esp_console_cmd_register(&cmd);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sdkconfig.h"
+
+// The console command "read" copies the flash of the target on the first
+// channel into the storage, deflated on the fly into a gzip image next to a
+// flasher_args.json that writes it back. The copy becomes the job.
+
+#define READBACK_DIR CONFIG_TINYUSB_MSC_MOUNT_PATH "/" CONFIG_FLASH_READBACK_DIR
+
+// begin tells whether the target may be read now and queues the read
+void readback_init(bool (*begin)(void));
+// Reads what the last command asked for into READBACK_DIR
+bool readback_run(void);
+// Reads size bytes from addr on into dir, 0 up to the end of the flash
+bool readback(const char *dir, uint32_t addr, uint32_t size);
+// The running readback fails at its next packet
+void readback_stop(void);
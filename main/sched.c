@@ -0,0 +1,268 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_console.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "sched.h"
+#include "trace.h"
+
+static const char *TAG = "sched";
+
+#define SCHED_JOBS_MAX 16
+#define SCHED_TASK_STACK 6144
+
+typedef enum {
+    LANE_TARGETS, // the flash channels
+    LANE_STORAGE, // FATFS, the store and NVS
+    LANES,
+} lane_t;
+
+typedef struct {
+    const char *name;
+    lane_t lane;
+} type_info_t;
+
+static const type_info_t types[SCHED_TYPES] = {
+    [SCHED_INGEST] = {"ingest", LANE_STORAGE},
+    [SCHED_PLAN] = {"plan", LANE_STORAGE},
+    [SCHED_FLASH] = {"flash", LANE_TARGETS},
+    [SCHED_VERIFY] = {"verify", LANE_TARGETS},
+    [SCHED_REPORT] = {"report", LANE_STORAGE},
+    [SCHED_READBACK] = {"readback", LANE_TARGETS},
+};
+
+// The storage worker runs below the channels, the targets worker only
+// waits for them
+static const struct {
+    const char *name;
+    UBaseType_t priority;
+} lanes[LANES] = {
+    [LANE_TARGETS] = {"sched_targets", 3},
+    [LANE_STORAGE] = {"sched_storage", 1},
+};
+
+typedef struct {
+    bool used;
+    sched_type_t type;
+    sched_prio_t prio;
+    int arg;
+    uint32_t order; // posted, ties of prio go first come first served
+} job_t;
+
+static sched_handler_t handlers[SCHED_TYPES];
+static job_t pending[SCHED_JOBS_MAX];
+static uint32_t posted = 0;
+static struct {
+    TaskHandle_t task;
+    bool running;
+    job_t job; // valid while running
+} workers[LANES];
+static SemaphoreHandle_t lock = NULL;
+
+static bool matches(const job_t *job, sched_type_t type, int arg)
+{
+    return job->type == type && (arg == SCHED_ANY || job->arg == arg);
+}
+
+// The most urgent pending job of the lane, NULL if there is none
+static job_t *next(lane_t lane)
+{
+    job_t *best = NULL;
+    for (int i = 0; i < SCHED_JOBS_MAX; i++) {
+        job_t *job = &pending[i];
+        if (!job->used || types[job->type].lane != lane) {
+            continue;
+        }
+        if (best == NULL || job->prio > best->prio ||
+            (job->prio == best->prio && job->order < best->order)) {
+            best = job;
+        }
+    }
+    return best;
+}
+
+static void worker_task(void *arg)
+{
+    lane_t lane = (lane_t)(intptr_t)arg;
+
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while (1) {
+            xSemaphoreTake(lock, portMAX_DELAY);
+            job_t *job = next(lane);
+            if (job != NULL) {
+                workers[lane].job = *job;
+                workers[lane].running = true;
+                job->used = false;
+            }
+            xSemaphoreGive(lock);
+            if (job == NULL) {
+                break;
+            }
+
+            const job_t *run = &workers[lane].job;
+            ESP_LOGD(TAG, "Running %s %d", types[run->type].name, run->arg);
+            int64_t start = esp_timer_get_time();
+            TRACE_BEGIN(types[run->type].name);
+            handlers[run->type].run(run->arg);
+            TRACE_END(types[run->type].name);
+            ESP_LOGD(TAG, "Finished %s %d in %lld ms", types[run->type].name,
+                     run->arg, (esp_timer_get_time() - start) / 1000);
+
+            xSemaphoreTake(lock, portMAX_DELAY);
+            workers[lane].running = false;
+            xSemaphoreGive(lock);
+        }
+    }
+}
+
+bool sched_post(sched_type_t type, sched_prio_t prio, int arg)
+{
+    if (type >= SCHED_TYPES || handlers[type].run == NULL) {
+        return false;
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    job_t *free_job = NULL;
+    job_t *same = NULL;
+    for (int i = 0; i < SCHED_JOBS_MAX; i++) {
+        if (!pending[i].used) {
+            free_job = free_job != NULL ? free_job : &pending[i];
+        } else if (matches(&pending[i], type, arg)) {
+            same = &pending[i];
+        }
+    }
+    if (same != NULL) {
+        same->prio = prio > same->prio ? prio : same->prio;
+    } else if (free_job != NULL) {
+        *free_job = (job_t){
+            .used = true,
+            .type = type,
+            .prio = prio,
+            .arg = arg,
+            .order = posted++,
+        };
+    }
+    xSemaphoreGive(lock);
+    if (same == NULL && free_job == NULL) {
+        ESP_LOGE(TAG, "Queue full, %s %d dropped", types[type].name, arg);
+        return false;
+    }
+    TaskHandle_t task = workers[types[type].lane].task;
+    if (task != NULL) {
+        xTaskNotifyGive(task);
+    }
+    return true;
+}
+
+void sched_cancel(sched_type_t type, int arg)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (int i = 0; i < SCHED_JOBS_MAX; i++) {
+        if (pending[i].used && matches(&pending[i], type, arg)) {
+            pending[i].used = false;
+        }
+    }
+    lane_t lane = types[type].lane;
+    bool stop = workers[lane].running && matches(&workers[lane].job, type, arg);
+    xSemaphoreGive(lock);
+    // The handler may take a while to return, the caller does not wait
+    if (stop && handlers[type].cancel != NULL) {
+        handlers[type].cancel();
+    }
+}
+
+bool sched_busy(sched_type_t type, int arg)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    lane_t lane = types[type].lane;
+    bool busy = workers[lane].running && matches(&workers[lane].job, type, arg);
+    for (int i = 0; i < SCHED_JOBS_MAX && !busy; i++) {
+        busy = pending[i].used && matches(&pending[i], type, arg);
+    }
+    xSemaphoreGive(lock);
+    return busy;
+}
+
+static const char *prio_names[] = {
+    [SCHED_PRIO_LOW] = "low",
+    [SCHED_PRIO_NORMAL] = "normal",
+    [SCHED_PRIO_HIGH] = "high",
+};
+
+static int type_of(const char *name)
+{
+    for (int i = 0; i < SCHED_TYPES; i++) {
+        if (strcmp(name, types[i].name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int job_cmd(int argc, char **argv)
+{
+    if (argc == 1) {
+        xSemaphoreTake(lock, portMAX_DELAY);
+        for (int l = 0; l < LANES; l++) {
+            if (workers[l].running) {
+                printf("running %s %d\n", types[workers[l].job.type].name,
+                       workers[l].job.arg);
+            }
+        }
+        for (int i = 0; i < SCHED_JOBS_MAX; i++) {
+            if (pending[i].used) {
+                printf("pending %s %d, %s priority\n",
+                       types[pending[i].type].name, pending[i].arg,
+                       prio_names[pending[i].prio]);
+            }
+        }
+        xSemaphoreGive(lock);
+        return 0;
+    }
+    bool cancel = strcmp(argv[1], "cancel") == 0;
+    int type = type_of(argv[argc - 1]);
+    if (type < 0 || argc != (cancel ? 3 : 2)) {
+        printf("Unknown job, one of ingest, plan, flash, verify, report, "
+               "readback\n");
+        return 1;
+    }
+    if (cancel) {
+        sched_cancel(type, SCHED_ANY);
+        return 0;
+    }
+    // Console jobs run with the default arg, the handlers check whether
+    // they can run at all
+    return sched_post(type, SCHED_PRIO_NORMAL, 0) ? 0 : 1;
+}
+
+void sched_init(const sched_handler_t h[SCHED_TYPES])
+{
+    memcpy(handlers, h, sizeof(handlers));
+    lock = xSemaphoreCreateMutex();
+}
+
+void sched_start(void)
+{
+    const esp_console_cmd_t cmd = {
+        .command = "job",
+        .help = "List the pending and running jobs, \"job TYPE\" queues one, "
+                "\"job cancel TYPE\" drops and stops them",
+        .func = job_cmd,
+    };
+    esp_console_cmd_register(&cmd);
+
+    for (int l = 0; l < LANES; l++) {
+        if (xTaskCreate(worker_task, lanes[l].name, SCHED_TASK_STACK,
+                        (void *)(intptr_t)l, lanes[l].priority,
+                        &workers[l].task) != pdPASS) {
+            ESP_LOGE(TAG, "Cannot create task %s", lanes[l].name);
+            continue;
+        }
+        xTaskNotifyGive(workers[l].task); // for the jobs posted so far
+    }
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Typed jobs run by two worker tasks, one for the targets and one for the
+// storage, so loading a job never stalls the USB callbacks or a running
+// flash. Each worker takes the most urgent job of its types first, in the
+// order posted among equals. The console command "job" lists them.
+
+typedef enum {
+    SCHED_INGEST,   // storage: find, parse and ingest a job
+    SCHED_PLAN,     // storage: save or drop the plan in NVS
+    SCHED_FLASH,    // targets: flash the job once or in auto mode
+    SCHED_VERIFY,   // targets: compare the targets with the job
+    SCHED_REPORT,   // storage: save the counters of the finished cycles
+    SCHED_READBACK, // targets: copy the flash of a target into the storage
+    SCHED_TYPES,
+} sched_type_t;
+
+typedef enum {
+    SCHED_PRIO_LOW,
+    SCHED_PRIO_NORMAL,
+    SCHED_PRIO_HIGH,
+} sched_prio_t;
+
+#define SCHED_ANY -1 // any arg of sched_cancel() and sched_busy()
+
+typedef struct {
+    void (*run)(int arg);
+    // Asks the running job to return early, NULL if it cannot
+    void (*cancel)(void);
+} sched_handler_t;
+
+// Types without a run handler cannot be posted. Jobs posted before
+// sched_start() wait for it, which also registers the console command.
+void sched_init(const sched_handler_t handlers[SCHED_TYPES]);
+void sched_start(void);
+// Queues a job, false if the queue is full. A pending job of the same type
+// and arg is kept instead, at the higher of both priorities.
+bool sched_post(sched_type_t type, sched_prio_t prio, int arg);
+// Drops the pending jobs of the type and arg and stops a running one
+void sched_cancel(sched_type_t type, int arg);
+// Whether a job of the type and arg is pending or running
+bool sched_busy(sched_type_t type, int arg);
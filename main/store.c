@@ -0,0 +1,375 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_md5.h"
+#include "store.h"
+
+static const char *TAG = "store";
+
+#define FLASH_SECTOR_SIZE 0x1000
+#define STORE_MAGIC 0x53474d49 // "IMGS"
+#define STORE_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint8_t md5[16]; // of the entries
+    store_entry_t entries[];
+} store_index_t;
+
+#define STORE_FILES_MAX                                                        \
+    ((FLASH_SECTOR_SIZE - sizeof(store_index_t)) / sizeof(store_entry_t))
+
+static const esp_partition_t *part = NULL;
+static store_index_t *committed = NULL;
+// Files of the last commit and of uploads cut short, still intact. An upload
+// points to them instead of writing the same content again, its new files
+// go around them until the space runs out.
+static store_index_t *previous = NULL;
+// The partition mapped into the data address space
+static const uint8_t *map = NULL;
+static esp_partition_mmap_handle_t map_handle;
+
+// The upload in progress
+static store_index_t *pending = NULL;
+static store_entry_t *file = NULL; // being written
+static uint32_t written = 0;       // of the file
+static uint32_t erased = 0;        // end of the sectors erased for it
+static md5_context_t md5;
+
+static uint32_t sector_align(uint32_t size)
+{
+    return (size + FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE - 1);
+}
+
+static void index_digest(const store_index_t *index, uint8_t digest[16])
+{
+    md5_context_t ctx;
+    esp_rom_md5_init(&ctx);
+    esp_rom_md5_update(&ctx, index->entries,
+                       index->count * sizeof(store_entry_t));
+    esp_rom_md5_final(digest, &ctx);
+}
+
+bool store_init(void)
+{
+    part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                    STORE_PARTITION_SUBTYPE,
+                                    STORE_PARTITION_LABEL);
+    if (part == NULL) {
+        ESP_LOGI(TAG, "No \"%s\" partition, uploads are disabled",
+                 STORE_PARTITION_LABEL);
+        return false;
+    }
+    store_index_t *index = malloc(FLASH_SECTOR_SIZE);
+    if (index == NULL) {
+        return false;
+    }
+    uint8_t digest[16];
+    if (esp_partition_read(part, 0, index, FLASH_SECTOR_SIZE) != ESP_OK ||
+        index->magic != STORE_MAGIC || index->version != STORE_VERSION ||
+        index->count > STORE_FILES_MAX) {
+        free(index);
+        return true; // empty
+    }
+    index_digest(index, digest);
+    if (memcmp(digest, index->md5, sizeof(digest)) != 0) {
+        ESP_LOGW(TAG, "Index corrupted, the store is empty");
+        free(index);
+        return true;
+    }
+    committed = index;
+    ESP_LOGI(TAG, "%ld file(s) in \"%s\"", committed->count,
+             STORE_PARTITION_LABEL);
+    return true;
+}
+
+static void unmap(void)
+{
+    if (map != NULL) {
+        esp_partition_munmap(map_handle);
+        map = NULL;
+    }
+}
+
+static const store_entry_t *find(const store_index_t *index, const char *name)
+{
+    if (index == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < index->count; i++) {
+        if (strcmp(index->entries[i].name, name) == 0) {
+            return &index->entries[i];
+        }
+    }
+    return NULL;
+}
+
+const store_entry_t *store_find(const char *name)
+{
+    return find(committed, name);
+}
+
+// A file of the index with the content, NULL if there is none
+static const store_entry_t *find_content(const store_index_t *index,
+                                         uint32_t size, const uint8_t md5[16])
+{
+    if (index == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < index->count; i++) {
+        const store_entry_t *e = &index->entries[i];
+        if (e->size == size && memcmp(e->md5, md5, sizeof(e->md5)) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+esp_err_t store_read(const store_entry_t *entry, uint32_t offset, void *buf,
+                     size_t size)
+{
+    if (offset > entry->size || size > entry->size - offset) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return esp_partition_read(part, entry->offset + offset, buf, size);
+}
+
+const void *store_mmap(const store_entry_t *entry)
+{
+    if (map == NULL) {
+        const void *ptr;
+        esp_err_t err = esp_partition_mmap(part, 0, part->size,
+                                           ESP_PARTITION_MMAP_DATA, &ptr,
+                                           &map_handle);
+        if (err != ESP_OK) {
+            ESP_LOGW(TAG, "Cannot map \"%s\": %s", STORE_PARTITION_LABEL,
+                     esp_err_to_name(err));
+            return NULL;
+        }
+        map = ptr;
+    }
+    return map + entry->offset;
+}
+
+void store_drop(void)
+{
+    if (committed == NULL) {
+        return;
+    }
+    unmap();
+    free(committed);
+    committed = NULL;
+    esp_err_t err = esp_partition_erase_range(part, 0, FLASH_SECTOR_SIZE);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Cannot erase the index: %s", esp_err_to_name(err));
+    }
+}
+
+// Adds the files of index not kept yet to previous
+static void keep_files(const store_index_t *index)
+{
+    for (int i = 0; index != NULL && i < index->count; i++) {
+        const store_entry_t *e = &index->entries[i];
+        if (previous->count < STORE_FILES_MAX &&
+            find_content(previous, e->size, e->md5) == NULL) {
+            previous->entries[previous->count++] = *e;
+        }
+    }
+}
+
+esp_err_t store_begin(void)
+{
+    if (part == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (previous == NULL) {
+        previous = calloc(1, FLASH_SECTOR_SIZE);
+        if (previous == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    // The files are kept, the index goes so an upload cut short leaves no
+    // job behind
+    keep_files(committed);
+    keep_files(pending);
+    store_drop();
+    if (pending == NULL) {
+        pending = malloc(FLASH_SECTOR_SIZE);
+        if (pending == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    memset(pending, 0xff, FLASH_SECTOR_SIZE);
+    pending->magic = STORE_MAGIC;
+    pending->version = STORE_VERSION;
+    pending->count = 0;
+    file = NULL;
+    return ESP_OK;
+}
+
+// Moves start past the first file of index overlapping [start, start + size)
+static bool skip_file(const store_index_t *index, uint32_t *start,
+                      uint32_t size)
+{
+    for (int i = 0; i < index->count; i++) {
+        const store_entry_t *e = &index->entries[i];
+        uint32_t end = sector_align(e->offset + e->size);
+        if (e->offset < *start + size && *start < end) {
+            *start = end;
+            return true;
+        }
+    }
+    return false;
+}
+
+// The first gap for size bytes between the files of the upload and the kept
+// ones, 0 if there is none
+static uint32_t allocate(uint32_t size)
+{
+    size = sector_align(size);
+    uint32_t start = FLASH_SECTOR_SIZE;
+    while (start <= part->size && size <= part->size - start) {
+        if (!skip_file(pending, &start, size) &&
+            !skip_file(previous, &start, size)) {
+            return start;
+        }
+    }
+    return 0;
+}
+
+uint32_t store_free(void)
+{
+    if (part == NULL) {
+        return 0;
+    }
+    uint32_t used = FLASH_SECTOR_SIZE;
+    for (int i = 0; pending != NULL && i < pending->count; i++) {
+        const store_entry_t *e = &pending->entries[i];
+        if (find_content(pending, e->size, e->md5) == e) { // shared once
+            used += sector_align(e->size);
+        }
+    }
+    return part->size - used;
+}
+
+esp_err_t store_file_begin(const char *name, uint32_t size,
+                           const uint8_t md5_expected[16], bool *held)
+{
+    if (pending == NULL || file != NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (strlen(name) >= STORE_NAME_MAX || pending->count >= STORE_FILES_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (find(pending, name) != NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    store_entry_t *entry = &pending->entries[pending->count];
+    memset(entry, 0, sizeof(store_entry_t));
+    entry->size = size;
+    memcpy(entry->md5, md5_expected, sizeof(entry->md5));
+    strcpy(entry->name, name);
+
+    const store_entry_t *same = find_content(pending, size, md5_expected);
+    if (same == NULL) {
+        same = find_content(previous, size, md5_expected);
+    }
+    *held = same != NULL;
+    if (same != NULL) {
+        entry->offset = same->offset;
+        pending->count++;
+        return ESP_OK;
+    }
+    entry->offset = allocate(size);
+    if (entry->offset == 0 && previous->count > 0) {
+        // The files not uploaded again make room
+        previous->count = 0;
+        entry->offset = allocate(size);
+    }
+    if (entry->offset == 0) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    file = entry;
+    written = 0;
+    erased = file->offset; // a file refused before may have written there
+    esp_rom_md5_init(&md5);
+    return ESP_OK;
+}
+
+esp_err_t store_file_write(const void *buf, size_t size)
+{
+    if (file == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (size > file->size - written) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    uint32_t addr = file->offset + written;
+    // Sectors are erased as the data reaches them
+    uint32_t end = (addr + size + FLASH_SECTOR_SIZE - 1) &
+                   ~(FLASH_SECTOR_SIZE - 1);
+    if (end > erased) {
+        uint32_t start = MAX(erased, addr & ~(FLASH_SECTOR_SIZE - 1));
+        esp_err_t err = esp_partition_erase_range(part, start, end - start);
+        if (err != ESP_OK) {
+            return err;
+        }
+        erased = end;
+    }
+    esp_err_t err = esp_partition_write(part, addr, buf, size);
+    if (err != ESP_OK) {
+        return err;
+    }
+    esp_rom_md5_update(&md5, buf, size);
+    written += size;
+    return ESP_OK;
+}
+
+esp_err_t store_file_end(void)
+{
+    if (file == NULL || written != file->size) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    uint8_t digest[16];
+    esp_rom_md5_final(digest, &md5);
+    if (memcmp(digest, file->md5, sizeof(digest)) != 0) {
+        ESP_LOGE(TAG, "Digest of \"%s\" does not match", file->name);
+        file = NULL; // the next file takes its place
+        return ESP_ERR_INVALID_CRC;
+    }
+    pending->count++;
+    file = NULL;
+    return ESP_OK;
+}
+
+esp_err_t store_commit(void)
+{
+    if (pending == NULL || file != NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    index_digest(pending, pending->md5);
+    esp_err_t err = esp_partition_erase_range(part, 0, FLASH_SECTOR_SIZE);
+    if (err == ESP_OK) {
+        err = esp_partition_write(part, 0, pending, FLASH_SECTOR_SIZE);
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+    uint32_t used = part->size - store_free();
+    committed = pending;
+    pending = NULL;
+    previous->count = 0; // what the job does not name is free space now
+    ESP_LOGI(TAG, "Committed %ld file(s), %ld of %ld bytes used",
+             committed->count, used, part->size);
+    return ESP_OK;
+}
+
+const store_entry_t *store_find_pending(const char *name)
+{
+    return find(pending, name);
+}
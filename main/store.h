@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+// Files uploaded over the CDC port, kept sector aligned in the "images" data
+// partition behind an index sector, see partitions_store.csv. The store VFS
+// serves them under STORE_DIR, a job there reads like one on the storage.
+// The index is written last, an upload cut short leaves no job behind. Files
+// are addressed by content too: one the store still holds, from the last
+// commit or an upload cut short, is not sent again.
+
+#define STORE_DIR "/store"
+#define STORE_NAME_MAX 64
+#define STORE_PARTITION_LABEL "images"
+#define STORE_PARTITION_SUBTYPE 0x40
+
+typedef struct {
+    uint32_t offset; // in the partition, sector aligned
+    uint32_t size;
+    uint8_t md5[16];
+    char name[STORE_NAME_MAX]; // relative to STORE_DIR
+} store_entry_t;
+
+// Finds the partition and loads the index, false without a partition
+bool store_init(void);
+// The committed file, NULL if there is none
+const store_entry_t *store_find(const char *name);
+esp_err_t store_read(const store_entry_t *entry, uint32_t offset, void *buf,
+                     size_t size);
+// The committed file in the data address space, NULL if it cannot be mapped.
+// Valid until the store is dropped or an upload begins.
+const void *store_mmap(const store_entry_t *entry);
+// Forget the committed files
+void store_drop(void);
+
+// An upload replaces the committed files, which are dropped on begin. Files
+// are written in one go each, their digest is checked at the end. A file
+// whose content the store holds is complete on begin, held is set then.
+esp_err_t store_begin(void);
+esp_err_t store_file_begin(const char *name, uint32_t size,
+                           const uint8_t md5[16], bool *held);
+esp_err_t store_file_write(const void *buf, size_t size);
+esp_err_t store_file_end(void);
+esp_err_t store_commit(void);
+// A file of the upload in progress, complete and checked
+const store_entry_t *store_find_pending(const char *name);
+// Bytes left for files
+uint32_t store_free(void);
+
+// Serves the committed files read only under STORE_DIR, see store_vfs.c
+esp_err_t store_vfs_register(void);
+// The file of a path under STORE_DIR mapped, see store_mmap()
+const void *store_vfs_mmap(const char *path);
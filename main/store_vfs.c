@@ -0,0 +1,184 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "esp_log.h"
+#include "esp_vfs.h"
+#include "freertos/FreeRTOS.h"
+#include "store.h"
+
+static const char *TAG = "store_vfs";
+
+#define STORE_VFS_FILES_MAX 4
+
+// Read only, an open file keeps its entry even if an upload replaces the
+// store meanwhile, the flashing is not started during uploads anyway
+typedef struct {
+    bool used;
+    store_entry_t entry;
+    uint32_t pos;
+} store_fd_t;
+
+static store_fd_t fds[STORE_VFS_FILES_MAX];
+// The channels open their files concurrently
+static portMUX_TYPE fds_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static const store_entry_t *lookup(const char *path)
+{
+    while (*path == '/') {
+        path++;
+    }
+    return store_find(path);
+}
+
+static void fill_stat(const store_entry_t *entry, struct stat *st)
+{
+    memset(st, 0, sizeof(struct stat));
+    st->st_mode = S_IFREG | 0444;
+    st->st_size = entry->size;
+}
+
+static int vfs_open(const char *path, int flags, int mode)
+{
+    if ((flags & O_ACCMODE) != O_RDONLY) {
+        errno = EROFS;
+        return -1;
+    }
+    const store_entry_t *entry = lookup(path);
+    if (entry == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+    int fd;
+    taskENTER_CRITICAL(&fds_lock);
+    for (fd = 0; fd < STORE_VFS_FILES_MAX && fds[fd].used; fd++) {
+    }
+    if (fd < STORE_VFS_FILES_MAX) {
+        fds[fd].used = true;
+    }
+    taskEXIT_CRITICAL(&fds_lock);
+    if (fd == STORE_VFS_FILES_MAX) {
+        errno = ENFILE;
+        return -1;
+    }
+    fds[fd].entry = *entry;
+    fds[fd].pos = 0;
+    return fd;
+}
+
+static store_fd_t *get_fd(int fd)
+{
+    if (fd < 0 || fd >= STORE_VFS_FILES_MAX || !fds[fd].used) {
+        errno = EBADF;
+        return NULL;
+    }
+    return &fds[fd];
+}
+
+static ssize_t vfs_read(int fd, void *dst, size_t size)
+{
+    store_fd_t *f = get_fd(fd);
+    if (f == NULL) {
+        return -1;
+    }
+    if (f->pos >= f->entry.size) {
+        return 0;
+    }
+    if (size > f->entry.size - f->pos) {
+        size = f->entry.size - f->pos;
+    }
+    if (store_read(&f->entry, f->pos, dst, size) != ESP_OK) {
+        errno = EIO;
+        return -1;
+    }
+    f->pos += size;
+    return size;
+}
+
+static off_t vfs_lseek(int fd, off_t offset, int whence)
+{
+    store_fd_t *f = get_fd(fd);
+    if (f == NULL) {
+        return -1;
+    }
+    switch (whence) {
+    case SEEK_SET:
+        break;
+    case SEEK_CUR:
+        offset += f->pos;
+        break;
+    case SEEK_END:
+        offset += f->entry.size;
+        break;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+    if (offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    f->pos = offset;
+    return offset;
+}
+
+static int vfs_close(int fd)
+{
+    store_fd_t *f = get_fd(fd);
+    if (f == NULL) {
+        return -1;
+    }
+    f->used = false;
+    return 0;
+}
+
+static int vfs_fstat(int fd, struct stat *st)
+{
+    store_fd_t *f = get_fd(fd);
+    if (f == NULL) {
+        return -1;
+    }
+    fill_stat(&f->entry, st);
+    return 0;
+}
+
+static int vfs_stat(const char *path, struct stat *st)
+{
+    const store_entry_t *entry = lookup(path);
+    if (entry == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+    fill_stat(entry, st);
+    return 0;
+}
+
+const void *store_vfs_mmap(const char *path)
+{
+    size_t len = strlen(STORE_DIR);
+    if (strncmp(path, STORE_DIR, len) != 0 || path[len] != '/') {
+        return NULL;
+    }
+    const store_entry_t *entry = lookup(path + len);
+    return entry != NULL ? store_mmap(entry) : NULL;
+}
+
+esp_err_t store_vfs_register(void)
+{
+    const esp_vfs_t vfs = {
+        .flags = ESP_VFS_FLAG_DEFAULT,
+        .open = vfs_open,
+        .read = vfs_read,
+        .lseek = vfs_lseek,
+        .close = vfs_close,
+        .fstat = vfs_fstat,
+        .stat = vfs_stat,
+    };
+    esp_err_t err = esp_vfs_register(STORE_DIR, &vfs, NULL);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Cannot register \"%s\": %s", STORE_DIR,
+                 esp_err_to_name(err));
+    }
+    return err;
+}
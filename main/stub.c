@@ -0,0 +1,155 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "cJSON.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "mbedtls/base64.h"
+#include "proto.h"
+#include "stub.h"
+
+static const char *TAG = "stub";
+
+#define STUB_RAM_BLOCK 0x1800
+
+// The stubs of the esptool in the IDF environment are embedded as text by
+// main/CMakeLists.txt, which defines STUB_FLASHER_* for every one it found.
+#ifdef STUB_FLASHER_8266
+extern const char _binary_stub_flasher_8266_json_start[];
+#endif
+#ifdef STUB_FLASHER_32
+extern const char _binary_stub_flasher_32_json_start[];
+#endif
+#ifdef STUB_FLASHER_32S2
+extern const char _binary_stub_flasher_32s2_json_start[];
+#endif
+#ifdef STUB_FLASHER_32C3
+extern const char _binary_stub_flasher_32c3_json_start[];
+#endif
+#ifdef STUB_FLASHER_32S3
+extern const char _binary_stub_flasher_32s3_json_start[];
+#endif
+#ifdef STUB_FLASHER_32C2
+extern const char _binary_stub_flasher_32c2_json_start[];
+#endif
+#ifdef STUB_FLASHER_32H2
+extern const char _binary_stub_flasher_32h2_json_start[];
+#endif
+
+static const char *stub_json(target_chip_t chip)
+{
+    switch (chip) {
+#ifdef STUB_FLASHER_8266
+    case ESP8266_CHIP:
+        return _binary_stub_flasher_8266_json_start;
+#endif
+#ifdef STUB_FLASHER_32
+    case ESP32_CHIP:
+        return _binary_stub_flasher_32_json_start;
+#endif
+#ifdef STUB_FLASHER_32S2
+    case ESP32S2_CHIP:
+        return _binary_stub_flasher_32s2_json_start;
+#endif
+#ifdef STUB_FLASHER_32C3
+    case ESP32C3_CHIP:
+        return _binary_stub_flasher_32c3_json_start;
+#endif
+#ifdef STUB_FLASHER_32S3
+    case ESP32S3_CHIP:
+        return _binary_stub_flasher_32s3_json_start;
+#endif
+#ifdef STUB_FLASHER_32C2
+    case ESP32C2_CHIP:
+        return _binary_stub_flasher_32c2_json_start;
+#endif
+#ifdef STUB_FLASHER_32H2
+    case ESP32H2_CHIP:
+        return _binary_stub_flasher_32h2_json_start;
+#endif
+    default:
+        return NULL;
+    }
+}
+
+// Decode one base64 segment of the stub and download it to target RAM
+static esp_loader_error_t load_segment(proto_t *p, const cJSON *root,
+                                       const char *name,
+                                       const char *start_name)
+{
+    const cJSON *text = cJSON_GetObjectItem(root, name);
+    const cJSON *start = cJSON_GetObjectItem(root, start_name);
+    if (!cJSON_IsString(text) || !cJSON_IsNumber(start)) {
+        return ESP_LOADER_SUCCESS; // segment is optional
+    }
+
+    size_t len = strlen(text->valuestring);
+    size_t size = len / 4 * 3;
+    uint8_t *buf = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (buf == NULL) {
+        ESP_LOGE(TAG, "Malloc stub %s %d bytes failed", name, size);
+        return ESP_LOADER_ERROR_FAIL;
+    }
+    if (mbedtls_base64_decode(buf, size, &size,
+                              (const unsigned char *)text->valuestring,
+                              len) != 0) {
+        ESP_LOGE(TAG, "Invalid stub %s", name);
+        free(buf);
+        return ESP_LOADER_ERROR_FAIL;
+    }
+
+    uint32_t addr = (uint32_t)start->valuedouble;
+    esp_loader_error_t err = proto_mem_begin(p, addr, size, STUB_RAM_BLOCK);
+    for (size_t i = 0; i < size && err == ESP_LOADER_SUCCESS;
+         i += STUB_RAM_BLOCK) {
+        // A block the ROM refused is sent again, as in a flash write
+        for (int retry = 0;; retry++) {
+            err = proto_mem_data(p, buf + i, MIN(size - i, STUB_RAM_BLOCK));
+            if (err == ESP_LOADER_SUCCESS || !proto_data_rejected(p) ||
+                retry == CONFIG_FLASH_PACKET_RETRIES) {
+                break;
+            }
+        }
+    }
+    free(buf);
+    if (err != ESP_LOADER_SUCCESS) {
+        ESP_LOGE(TAG, "Download stub %s to 0x%lX failed with error %d", name,
+                 addr, err);
+    }
+    return err;
+}
+
+esp_loader_error_t stub_load(proto_t *p)
+{
+    target_chip_t chip = p->chip;
+    const char *json = stub_json(chip);
+    if (json == NULL) {
+        ESP_LOGW(TAG, "No stub bundled for chip %d", chip);
+        return ESP_LOADER_ERROR_UNSUPPORTED_CHIP;
+    }
+
+    cJSON *root = cJSON_Parse(json);
+    if (root == NULL) {
+        ESP_LOGE(TAG, "Invalid stub json for chip %d", chip);
+        return ESP_LOADER_ERROR_FAIL;
+    }
+    esp_loader_error_t err = load_segment(p, root, "text", "text_start");
+    if (err == ESP_LOADER_SUCCESS) {
+        err = load_segment(p, root, "data", "data_start");
+    }
+    const cJSON *entry = cJSON_GetObjectItem(root, "entry");
+    if (err == ESP_LOADER_SUCCESS) {
+        err = proto_mem_finish(p, (uint32_t)cJSON_GetNumberValue(entry));
+    }
+    cJSON_Delete(root);
+    if (err != ESP_LOADER_SUCCESS) {
+        return err;
+    }
+
+    err = proto_enter_stub(p);
+    if (err != ESP_LOADER_SUCCESS) {
+        ESP_LOGE(TAG, "Stub did not start, error %d", err);
+    }
+    return err;
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "esp_loader.h"
+#include "proto.h"
+
+esp_loader_error_t stub_load(proto_t *p);
@@ -0,0 +1,216 @@
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "esp_console.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "trace.h"
+
+static const char *TAG = "trace";
+
+#define TRACE_EVENTS CONFIG_FLASH_TRACE_EVENTS
+#define TRACE_THREADS_MAX 16
+#define TRACE_THREAD_NAME_MAX 16
+#define TRACE_DEPTH_MAX 32 // spans open per task, deeper ones are dropped
+
+typedef struct {
+    int64_t ts; // us since boot
+    const char *name;
+    uint8_t tid; // index of threads
+    char phase;  // 'B' or 'E'
+} trace_event_t;
+
+typedef struct {
+    TaskHandle_t task;
+    char name[TRACE_THREAD_NAME_MAX];
+} trace_thread_t;
+
+static trace_event_t *ring = NULL;
+static atomic_uint head = 0; // events recorded, the ring keeps the last ones
+static atomic_uint tail = 0; // head when last cleared
+static atomic_bool paused = false;
+static atomic_int writers = 0; // events being recorded
+// The last one collects the tasks beyond the others
+static trace_thread_t threads[TRACE_THREADS_MAX];
+static atomic_int threads_size = 0;
+static vprintf_like_t log_vprintf = NULL;
+
+// Few tasks trace at a time, a slot is claimed on the first event of a task
+// and only read by the dump
+static uint8_t thread_id(void)
+{
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    int n = MIN(atomic_load(&threads_size), TRACE_THREADS_MAX - 1);
+    for (int i = 0; i < n; i++) {
+        if (threads[i].task == task) {
+            return i;
+        }
+    }
+    int i = atomic_fetch_add(&threads_size, 1);
+    if (i >= TRACE_THREADS_MAX - 1) {
+        return TRACE_THREADS_MAX - 1;
+    }
+    snprintf(threads[i].name, sizeof(threads[i].name), "%s",
+             pcTaskGetName(task));
+    threads[i].task = task;
+    return i;
+}
+
+void trace_event(const char *name, char phase)
+{
+    if (ring == NULL) {
+        return;
+    }
+    // The dump waits for the writers that saw it unpaused
+    atomic_fetch_add(&writers, 1);
+    if (!atomic_load(&paused)) {
+        trace_event_t *e = &ring[atomic_fetch_add(&head, 1) % TRACE_EVENTS];
+        e->ts = esp_timer_get_time();
+        e->name = name;
+        e->tid = thread_id();
+        e->phase = phase;
+    }
+    atomic_fetch_sub(&writers, 1);
+}
+
+static int log_traced(const char *fmt, va_list args)
+{
+    TRACE_BEGIN("log");
+    int n = log_vprintf(fmt, args);
+    TRACE_END("log");
+    return n;
+}
+
+// Head keeps counting, so writers racing a clear never land outside the ring
+static void clear(void)
+{
+    atomic_store(&tail, atomic_load(&head));
+}
+
+// Whether an end closes a span begun in the window, the ring may have dropped
+// the begin of the oldest spans
+static bool matched(const char *stack[], int *depth, const trace_event_t *e)
+{
+    if (e->phase == 'B') {
+        if (*depth == TRACE_DEPTH_MAX) {
+            return false;
+        }
+        stack[(*depth)++] = e->name;
+        return true;
+    }
+    for (int i = *depth - 1; i >= 0; i--) {
+        if (stack[i] == e->name || strcmp(stack[i], e->name) == 0) {
+            *depth = i; // spans left open inside it end with the trace
+            return true;
+        }
+    }
+    return false;
+}
+
+void trace_dump(FILE *out)
+{
+    if (ring == NULL) {
+        return;
+    }
+    atomic_store(&paused, true);
+    while (atomic_load(&writers) > 0) {
+        vTaskDelay(1);
+    }
+    unsigned int end = atomic_load(&head);
+    unsigned int begin = MAX(atomic_load(&tail),
+                             end > TRACE_EVENTS ? end - TRACE_EVENTS : 0);
+    unsigned int count = end - begin;
+    // Copied out, the trace goes on while the window is printed
+    trace_event_t *events = heap_caps_malloc(
+        MAX(count, 1) * sizeof(trace_event_t),
+        MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (events != NULL) {
+        for (unsigned int i = 0; i < count; i++) {
+            events[i] = ring[(begin + i) % TRACE_EVENTS];
+        }
+        clear();
+        atomic_store(&paused, false);
+    }
+    const char *sep = "";
+
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    int threads_used = MIN(atomic_load(&threads_size), TRACE_THREADS_MAX);
+    for (int i = 0; i < threads_used; i++) {
+        fprintf(out,
+                "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                "\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                sep, i, threads[i].name);
+        sep = ",\n";
+    }
+    static const char *stack[TRACE_THREADS_MAX][TRACE_DEPTH_MAX];
+    int depth[TRACE_THREADS_MAX] = {0};
+    for (unsigned int i = 0; i < count; i++) {
+        const trace_event_t *e = events != NULL
+                                     ? &events[i]
+                                     : &ring[(begin + i) % TRACE_EVENTS];
+        if (!matched(stack[e->tid], &depth[e->tid], e)) {
+            continue;
+        }
+        fprintf(out,
+                "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lld,\"pid\":1,"
+                "\"tid\":%d}",
+                sep, e->name, e->phase, e->ts, e->tid);
+        sep = ",\n";
+    }
+    fprintf(out, "\n]}\n");
+    if (events == NULL) {
+        // Printed from the ring itself, paused all along
+        clear();
+        atomic_store(&paused, false);
+    }
+    free(events);
+}
+
+static int log_mute(const char *fmt, va_list args)
+{
+    return 0;
+}
+
+static int trace_cmd(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "clear") == 0) {
+        clear();
+        return 0;
+    }
+    // Logs of other tasks would land inside the JSON
+    vprintf_like_t log = esp_log_set_vprintf(log_mute);
+    trace_dump(stdout);
+    fflush(stdout);
+    esp_log_set_vprintf(log);
+    return 0;
+}
+
+void trace_init(void)
+{
+    ring = heap_caps_malloc(TRACE_EVENTS * sizeof(trace_event_t),
+                            MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (ring == NULL) {
+        ESP_LOGE(TAG, "Cannot allocate %d events in PSRAM", TRACE_EVENTS);
+        return;
+    }
+    snprintf(threads[TRACE_THREADS_MAX - 1].name, TRACE_THREAD_NAME_MAX,
+             "other");
+    log_vprintf = esp_log_set_vprintf(log_traced);
+
+    const esp_console_cmd_t cmd = {
+        .command = "trace",
+        .help = "Print the trace of the flash path as Chrome trace-event "
+                "JSON and clear it, \"trace clear\" only clears it",
+        .func = trace_cmd,
+    };
+    esp_console_cmd_register(&cmd);
+    ESP_LOGI(TAG, "Tracing into %d events", TRACE_EVENTS);
+}
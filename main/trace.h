@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "sdkconfig.h"
+
+// Begin and end events of the flash path, kept in a ring in PSRAM and printed
+// as Chrome trace-event JSON for ui.perfetto.dev by the console command
+// "trace". Names are string literals, only their pointer is kept. Without
+// FLASH_TRACE the trace points compile to nothing.
+
+#if CONFIG_FLASH_TRACE
+#define TRACE_BEGIN(name) trace_event(name, 'B')
+#define TRACE_END(name) trace_event(name, 'E')
+#else
+#define TRACE_BEGIN(name) ((void)0)
+#define TRACE_END(name) ((void)0)
+#endif
+
+// Allocates the ring, traces the log output and registers the command
+void trace_init(void);
+void trace_event(const char *name, char phase);
+// Prints the ring and empties it
+void trace_dump(FILE *out);
@@ -0,0 +1,269 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "cJSON.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+#include "store.h"
+#include "upload.h"
+
+static const char *TAG = "upload";
+
+#define JOB_NAME "flasher_args.json"
+#define MAGIC0 0xa5
+#define MAGIC1 0x5a
+#define HEADER_SIZE 4 // type, seq, length after the magic
+#define CRC_SIZE 4
+#define REPLY_SIZE (2 + HEADER_SIZE + 5 + CRC_SIZE)
+
+typedef struct {
+    const upload_port_t *port;
+    uint8_t rx[512];
+    size_t rx_len;
+    size_t rx_pos;
+    bool begun;
+    bool committed;
+    bool quit;
+    int files;
+    uint32_t written; // of the file
+    uint64_t bytes;   // of all files
+    int last_seq;     // of the request answered last, -1 for none
+    uint8_t last_type;
+    uint8_t reply[REPLY_SIZE]; // to it
+    uint8_t frame[HEADER_SIZE + UPLOAD_PAYLOAD_MAX + CRC_SIZE];
+} session_t;
+
+static uint32_t get_u32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put_u32(uint8_t *p, uint32_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static bool read_bytes(session_t *s, uint8_t *buf, size_t size)
+{
+    while (size > 0) {
+        if (s->rx_pos == s->rx_len) {
+            s->rx_pos = 0;
+            s->rx_len = s->port->read(s->port->ctx, s->rx, sizeof(s->rx),
+                                      UPLOAD_IDLE_MS);
+            if (s->rx_len == 0) {
+                return false;
+            }
+        }
+        size_t n = MIN(size, s->rx_len - s->rx_pos);
+        memcpy(buf, s->rx + s->rx_pos, n);
+        s->rx_pos += n;
+        buf += n;
+        size -= n;
+    }
+    return true;
+}
+
+// The next frame into s->frame, its payload length or -1 once the line went
+// quiet. Anything between frames, like the console line that started the
+// session, is skipped.
+static int receive(session_t *s, upload_status_t *status)
+{
+    uint8_t prev = 0;
+    uint8_t b = 0;
+    while (prev != MAGIC0 || b != MAGIC1) {
+        prev = b;
+        if (!read_bytes(s, &b, 1)) {
+            return -1;
+        }
+    }
+
+    uint8_t *f = s->frame;
+    if (!read_bytes(s, f, HEADER_SIZE)) {
+        return -1;
+    }
+    size_t len = f[2] | f[3] << 8;
+    if (len > UPLOAD_PAYLOAD_MAX) {
+        *status = UPLOAD_BAD_FRAME;
+        return 0;
+    }
+    if (!read_bytes(s, f + HEADER_SIZE, len + CRC_SIZE)) {
+        return -1;
+    }
+    uint32_t crc = esp_rom_crc32_le(0, f, HEADER_SIZE + len);
+    bool ok = crc == get_u32(f + HEADER_SIZE + len);
+    *status = ok ? UPLOAD_OK : UPLOAD_BAD_FRAME;
+    return len;
+}
+
+static void reply(session_t *s, uint8_t seq, upload_status_t status,
+                  uint32_t value, bool answer)
+{
+    uint8_t r[REPLY_SIZE] = {MAGIC0, MAGIC1, UPLOAD_REPLY, seq, 5, 0, status};
+    put_u32(r + 7, value);
+    put_u32(r + 11, esp_rom_crc32_le(0, r + 2, HEADER_SIZE + 5));
+    if (answer) {
+        memcpy(s->reply, r, sizeof(r));
+    }
+    s->port->write(s->port->ctx, r, sizeof(r));
+}
+
+// The uploaded job names only uploaded files
+static bool check_job(void)
+{
+    const store_entry_t *job = store_find_pending(JOB_NAME);
+    if (job == NULL) {
+        ESP_LOGE(TAG, "No \"%s\" uploaded", JOB_NAME);
+        return false;
+    }
+    bool ok = false;
+    char *json = malloc(job->size + 1);
+    if (json != NULL && store_read(job, 0, json, job->size) == ESP_OK) {
+        json[job->size] = '\0';
+        cJSON *root = cJSON_Parse(json);
+        const cJSON *files = cJSON_GetObjectItem(root, "flash_files");
+        ok = cJSON_IsObject(files) && files->child != NULL;
+        for (const cJSON *i = ok ? files->child : NULL; ok && i != NULL;
+             i = i->next) {
+            ok = cJSON_IsString(i) &&
+                 store_find_pending(i->valuestring) != NULL;
+            if (!ok) {
+                ESP_LOGE(TAG, "\"%s\" of \"%s\" not uploaded", i->string,
+                         JOB_NAME);
+            }
+        }
+        cJSON_Delete(root);
+    }
+    free(json);
+    return ok;
+}
+
+static upload_status_t handle(session_t *s, uint8_t type, const uint8_t *p,
+                              size_t len, uint32_t *value)
+{
+    esp_err_t err;
+    char name[STORE_NAME_MAX];
+
+    switch (type) {
+    case UPLOAD_HELLO:
+        *value = UPLOAD_PAYLOAD_MAX;
+        return UPLOAD_OK;
+    case UPLOAD_BEGIN:
+        if (len != 4) {
+            return UPLOAD_BAD_FRAME;
+        }
+        if (s->port->begin != NULL && !s->port->begin()) {
+            return UPLOAD_BUSY;
+        }
+        if (store_begin() != ESP_OK) {
+            return UPLOAD_IO_ERROR;
+        }
+        s->begun = true;
+        *value = store_free();
+        return get_u32(p) > *value ? UPLOAD_NO_SPACE : UPLOAD_OK;
+    case UPLOAD_FILE:
+        if (len <= 20 || len - 20 >= STORE_NAME_MAX) {
+            return UPLOAD_BAD_FRAME;
+        }
+        memcpy(name, p + 20, len - 20);
+        name[len - 20] = '\0';
+        bool held = false;
+        err = store_file_begin(name, get_u32(p), p + 4, &held);
+        if (err == ESP_ERR_INVALID_SIZE) {
+            return UPLOAD_NO_SPACE;
+        } else if (err == ESP_ERR_INVALID_ARG) {
+            return UPLOAD_BAD_JOB;
+        } else if (err != ESP_OK) {
+            return UPLOAD_BAD_STATE;
+        }
+        s->written = 0;
+        s->files += held;
+        *value = held;
+        return UPLOAD_OK;
+    case UPLOAD_DATA:
+        err = store_file_write(p, len);
+        if (err == ESP_ERR_INVALID_STATE || err == ESP_ERR_INVALID_SIZE) {
+            return UPLOAD_BAD_STATE;
+        } else if (err != ESP_OK) {
+            return UPLOAD_IO_ERROR;
+        }
+        s->written += len;
+        s->bytes += len;
+        *value = s->written;
+        return UPLOAD_OK;
+    case UPLOAD_END:
+        err = store_file_end();
+        if (err == ESP_ERR_INVALID_CRC) {
+            return UPLOAD_BAD_DIGEST;
+        } else if (err != ESP_OK) {
+            return UPLOAD_BAD_STATE;
+        }
+        s->files++;
+        return UPLOAD_OK;
+    case UPLOAD_COMMIT:
+        if (!s->begun || s->committed) {
+            return UPLOAD_BAD_STATE;
+        }
+        if (!check_job()) {
+            return UPLOAD_BAD_JOB;
+        }
+        if (store_commit() != ESP_OK) {
+            return UPLOAD_IO_ERROR;
+        }
+        s->committed = true;
+        *value = s->files;
+        return UPLOAD_OK;
+    case UPLOAD_QUIT:
+        s->quit = true;
+        return UPLOAD_OK;
+    default:
+        return UPLOAD_BAD_STATE;
+    }
+}
+
+bool upload_serve(const upload_port_t *port)
+{
+    session_t *s = calloc(1, sizeof(session_t));
+    if (s == NULL) {
+        ESP_LOGE(TAG, "Cannot allocate the session");
+        return false;
+    }
+    s->port = port;
+    s->last_seq = -1;
+    int64_t start = esp_timer_get_time();
+
+    while (!s->quit) {
+        upload_status_t status;
+        int len = receive(s, &status);
+        if (len < 0) {
+            ESP_LOGW(TAG, "No data for %d ms, session ended", UPLOAD_IDLE_MS);
+            break;
+        }
+        uint8_t type = s->frame[0];
+        uint8_t seq = s->frame[1];
+        if (status != UPLOAD_OK) {
+            reply(s, seq, status, 0, false);
+        } else if (seq == s->last_seq && type == s->last_type) {
+            // The reply got lost, the request is not run twice
+            port->write(port->ctx, s->reply, sizeof(s->reply));
+        } else {
+            uint32_t value = 0;
+            status = handle(s, type, s->frame + HEADER_SIZE, len, &value);
+            s->last_seq = seq;
+            s->last_type = type;
+            reply(s, seq, status, value, true);
+        }
+    }
+
+    int64_t ms = (esp_timer_get_time() - start) / 1000;
+    ESP_LOGI(TAG, "%s %d file(s), %lld KiB in %lld ms",
+             s->committed ? "Committed" : "Dropped", s->files,
+             s->bytes / 1024, ms);
+    bool committed = s->committed;
+    free(s);
+    return committed;
+}
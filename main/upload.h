@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Binary upload of a job into the store over a byte stream, the CDC port on
+// the device and a pty on the host, see tools/upload.py. Every frame is
+//
+//   0xA5 0x5A | type | seq | length (u16 LE) | payload | CRC-32 (u32 LE)
+//
+// with the CRC over type to payload. Each request of the host is answered by
+// an UPLOAD_REPLY frame of the same seq carrying a status byte and a u32 LE.
+// A request repeated with the seq of the last one gets the last reply again
+// without running twice, so the host may resend whatever got no reply.
+
+#define UPLOAD_PAYLOAD_MAX 0x4000
+#define UPLOAD_IDLE_MS 5000 // the session ends after this long without data
+
+typedef enum {
+    UPLOAD_HELLO = 'H',  // -> UPLOAD_PAYLOAD_MAX
+    UPLOAD_BEGIN = 'B',  // u32 total size -> bytes free, drops the store
+    UPLOAD_FILE = 'F',   // u32 size, md5[16], name -> 1 if the store holds
+                         // the content, no DATA and END follow then, or 0
+    UPLOAD_DATA = 'D',   // the next bytes of the file -> bytes written
+    UPLOAD_END = 'E',    // the file is complete, checks its digest -> 0
+    UPLOAD_COMMIT = 'C', // checks and commits the job -> number of files
+    UPLOAD_QUIT = 'Q',   // ends the session -> 0
+    UPLOAD_REPLY = 'R',
+} upload_type_t;
+
+typedef enum {
+    UPLOAD_OK,
+    UPLOAD_BAD_FRAME, // CRC or length error, resend
+    UPLOAD_BAD_STATE, // not expected now
+    UPLOAD_BUSY,      // flashing, try later
+    UPLOAD_NO_SPACE,
+    UPLOAD_BAD_DIGEST, // the file has to be sent again
+    UPLOAD_IO_ERROR,
+    UPLOAD_BAD_JOB, // no flasher_args.json or a file of it missing
+} upload_status_t;
+
+typedef struct {
+    // Bytes read into buf, 0 once timeout_ms passed without any
+    size_t (*read)(void *ctx, uint8_t *buf, size_t size, uint32_t timeout_ms);
+    void (*write)(void *ctx, const uint8_t *buf, size_t size);
+    void *ctx;
+    // Whether the store may be rewritten now, NULL for always
+    bool (*begin)(void);
+} upload_port_t;
+
+// Serves one session, true if a job was committed
+bool upload_serve(const upload_port_t *port);
+
+// Registers the console command "upload" serving a session on the CDC port,
+// see upload_cdc.c. begin is the one of upload_port_t, end is told whether a
+// job was committed.
+void upload_cdc_init(bool (*begin)(void), void (*end)(bool committed));
@@ -0,0 +1,106 @@
+#include <stdarg.h>
+
+#include "esp_console.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "tusb_cdc_acm.h"
+#include "upload.h"
+
+static const char *TAG = "upload_cdc";
+
+#define UPLOAD_CDC_ITF TINYUSB_CDC_ACM_0
+#define UPLOAD_CDC_WRITE_MS 100
+
+static bool (*begin_cb)(void) = NULL;
+static void (*end_cb)(bool) = NULL;
+
+// The console task running the command, woken by received data
+static TaskHandle_t session_task = NULL;
+
+static void cdc_rx_callback(int itf, cdcacm_event_t *event)
+{
+    if (session_task != NULL) {
+        xTaskNotifyGive(session_task);
+    }
+}
+
+// The bytes go around the console VFS, whose line ending conversion would
+// break the frames
+static size_t cdc_read(void *ctx, uint8_t *buf, size_t size,
+                       uint32_t timeout_ms)
+{
+    while (1) {
+        size_t n = 0;
+        if (tinyusb_cdcacm_read(UPLOAD_CDC_ITF, buf, size, &n) == ESP_OK &&
+            n > 0) {
+            return n;
+        }
+        if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(timeout_ms)) == 0) {
+            return 0;
+        }
+    }
+}
+
+static void cdc_write(void *ctx, const uint8_t *buf, size_t size)
+{
+    while (size > 0) {
+        size_t n = tinyusb_cdcacm_write_queue(UPLOAD_CDC_ITF, buf, size);
+        esp_err_t err = tinyusb_cdcacm_write_flush(
+            UPLOAD_CDC_ITF, pdMS_TO_TICKS(UPLOAD_CDC_WRITE_MS));
+        if (n == 0 && err != ESP_OK) {
+            return; // the host stopped reading, it resends the request
+        }
+        buf += n;
+        size -= n;
+    }
+}
+
+static int log_mute(const char *fmt, va_list args)
+{
+    return 0;
+}
+
+static int upload_cmd(int argc, char **argv)
+{
+    const upload_port_t port = {
+        .read = cdc_read,
+        .write = cdc_write,
+        .begin = begin_cb,
+    };
+
+    session_task = xTaskGetCurrentTaskHandle();
+    esp_err_t err = tinyusb_cdcacm_register_callback(
+        UPLOAD_CDC_ITF, CDC_EVENT_RX, cdc_rx_callback);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Cannot watch the CDC port: %s", esp_err_to_name(err));
+        session_task = NULL;
+        return 1;
+    }
+    // Logs of other tasks would land between the frames
+    vprintf_like_t log = esp_log_set_vprintf(log_mute);
+    bool committed = upload_serve(&port);
+    esp_log_set_vprintf(log);
+    tinyusb_cdcacm_unregister_callback(UPLOAD_CDC_ITF, CDC_EVENT_RX);
+    session_task = NULL;
+
+    ESP_LOGI(TAG, "Upload %s", committed ? "committed" : "dropped");
+    if (end_cb != NULL) {
+        end_cb(committed);
+    }
+    return committed ? 0 : 1;
+}
+
+void upload_cdc_init(bool (*begin)(void), void (*end)(bool committed))
+{
+    begin_cb = begin;
+    end_cb = end;
+    const esp_console_cmd_t cmd = {
+        .command = "upload",
+        .help = "Receive a job from tools/upload.py into the store",
+        .func = upload_cmd,
+    };
+    if (esp_console_cmd_register(&cmd) != ESP_OK) {
+        ESP_LOGE(TAG, "Cannot register the upload command");
+    }
+}
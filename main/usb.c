@@ -1,6 +1,14 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "usb.h"
+#include "diskio_wl.h"
 #include "esp_check.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "ff.h"
+#include "msc_cache.h"
 #include "tinyusb.h"
 #include "tusb_msc_storage.h"
 
@@ -20,6 +28,33 @@
 static const char *TAG = "usb";
 
 static usb_cb_t chg_cb = NULL;
+static usb_write_cb_t write_cb = NULL;
+#ifdef CONFIG_TINYUSB_CDC_ENABLED
+static usb_line_state_cb_t line_state_cb = NULL;
+#endif
+
+static wl_handle_t wl_handle = WL_INVALID_HANDLE;
+
+// Sectors the host wrote, one bit each. Sector numbers of the host and of
+// FATFS are the same, both sit on top of the wear levelling with its sector
+// size. The bits move on when the app gets the volume back, so a write of
+// the host while an ingest waits for its turn is kept for the next one.
+static uint32_t *written = NULL; // since the app last got the volume
+static uint32_t *pending = NULL; // not taken by an ingest yet
+static uint32_t *taken = NULL;   // by the running ingest
+static uint32_t written_sectors = 0;
+static uint32_t sector_size = 0;
+static bool written_any = true; // the first mount ingests everything
+static bool pending_any = true;
+static bool taken_any = false;
+static portMUX_TYPE written_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Bytes the host wrote since it took the volume, for the rate on eject
+static int64_t host_bytes = 0;
+static int64_t host_start_us = 0;
+
+// Fragments of a file looked up at a time, more are treated as written
+#define LINK_MAP_SIZE 64
 
 /* TinyUSB descriptors ********************************* */
 #ifdef CONFIG_TINYUSB_CDC_ENABLED
@@ -123,8 +158,199 @@ static esp_err_t storage_init_spiflash(wl_handle_t *wl_handle)
     return wl_mount(data_partition, wl_handle);
 }
 
+// The MSC class of esp_tinyusb owns the callbacks, the link of this
+// component wraps them to see the sectors go by and to put the cache of
+// msc_cache.c in front of the wear levelling
+int32_t __real_tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset,
+                                  uint8_t *buffer, uint32_t bufsize);
+int32_t __real_tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset,
+                                 void *buffer, uint32_t bufsize);
+bool __real_tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition,
+                                  bool start, bool load_eject);
+void __real_tud_umount_cb(void);
+
+int32_t __wrap_tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset,
+                                  uint8_t *buffer, uint32_t bufsize)
+{
+    if (written != NULL && bufsize > 0) {
+        uint32_t first = lba + offset / sector_size;
+        uint32_t last = lba + (offset + bufsize - 1) / sector_size;
+        for (uint32_t i = first; i <= last && i < written_sectors; i++) {
+            written[i / 32] |= 1u << i % 32;
+        }
+    }
+    if (!written_any && write_cb != NULL) {
+        write_cb();
+    }
+    written_any = true;
+    // The class refuses while the app has the volume mounted
+    if (tinyusb_msc_storage_in_use_by_usb_host()) {
+        if (host_bytes == 0) {
+            host_start_us = esp_timer_get_time();
+        }
+        host_bytes += bufsize;
+        esp_err_t err = msc_cache_write((size_t)lba * sector_size + offset,
+                                        buffer, bufsize);
+        if (err == ESP_OK) {
+            return bufsize;
+        } else if (err != ESP_ERR_NOT_SUPPORTED) {
+            return -1;
+        }
+    }
+    return __real_tud_msc_write10_cb(lun, lba, offset, buffer, bufsize);
+}
+
+int32_t __wrap_tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset,
+                                 void *buffer, uint32_t bufsize)
+{
+    if (tinyusb_msc_storage_in_use_by_usb_host()) {
+        esp_err_t err = msc_cache_read((size_t)lba * sector_size + offset,
+                                       buffer, bufsize);
+        if (err == ESP_OK) {
+            return bufsize;
+        } else if (err != ESP_ERR_NOT_SUPPORTED) {
+            return -1;
+        }
+    }
+    return __real_tud_msc_read10_cb(lun, lba, offset, buffer, bufsize);
+}
+
+// The class mounts the volume in the app right after, the cache goes first
+static void host_done(void)
+{
+    msc_cache_flush();
+    if (host_bytes > 0) {
+        int64_t ms = (esp_timer_get_time() - host_start_us) / 1000;
+        ESP_LOGI(TAG, "Host wrote %lld KiB in %lld ms, %lld KiB/s",
+                 host_bytes / 1024, ms,
+                 ms > 0 ? host_bytes * 1000 / 1024 / ms : 0);
+        host_bytes = 0;
+    }
+}
+
+// Eject
+bool __wrap_tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition,
+                                  bool start, bool load_eject)
+{
+    if (load_eject && !start) {
+        host_done();
+    }
+    return __real_tud_msc_start_stop_cb(lun, power_condition, start,
+                                        load_eject);
+}
+
+// Unplug or bus reset
+void __wrap_tud_umount_cb(void)
+{
+    host_done();
+    __real_tud_umount_cb();
+}
+
+static size_t written_words(void)
+{
+    return (written_sectors + 31) / 32;
+}
+
+bool usb_written(void)
+{
+    return taken_any || pending_any;
+}
+
+#if FF_USE_FASTSEEK
+static bool sector_written(LBA_t sector)
+{
+    uint32_t bit = 1u << sector % 32;
+    return sector >= written_sectors ||
+           ((taken[sector / 32] | pending[sector / 32]) & bit) != 0;
+}
+#endif
+
+bool usb_file_written(const char *path)
+{
+#if FF_USE_FASTSEEK
+    const char *base = CONFIG_TINYUSB_MSC_MOUNT_PATH;
+    size_t len = strlen(base);
+    if (written == NULL || strncmp(path, base, len) != 0) {
+        return true;
+    }
+    // FATFS names the volume by its drive number instead of the mount path
+    size_t s = strlen(path + len) + 8;
+    char *fpath = malloc(s);
+    if (fpath == NULL) {
+        return true;
+    }
+    snprintf(fpath, s, "%d:%s", ff_diskio_get_pdrv_wl(wl_handle), path + len);
+
+    FIL fil;
+    FRESULT res = f_open(&fil, fpath, FA_READ);
+    free(fpath);
+    if (res != FR_OK) {
+        return true;
+    }
+    // The directory entry holds the first cluster and the size, a file
+    // replaced, renamed or resized rewrites it
+    bool changed = sector_written(fil.dir_sect);
+    DWORD *map = malloc(LINK_MAP_SIZE * sizeof(DWORD));
+    if (map == NULL) {
+        changed = true;
+    } else if (!changed) {
+        map[0] = LINK_MAP_SIZE;
+        fil.cltbl = map;
+        if (f_lseek(&fil, CREATE_LINKMAP) != FR_OK) {
+            changed = true;
+        }
+        // Pairs of cluster count and first cluster, ended by a zero count
+        FATFS *fs = fil.obj.fs;
+        for (DWORD *m = map + 1; !changed && *m != 0; m += 2) {
+            LBA_t sector = fs->database + (LBA_t)fs->csize * (m[1] - 2);
+            for (DWORD i = 0; !changed && i < m[0] * fs->csize; i++) {
+                changed = sector_written(sector + i);
+            }
+        }
+        fil.cltbl = NULL;
+    }
+    f_close(&fil);
+    free(map);
+    return changed;
+#else
+    return true;
+#endif
+}
+
+void usb_written_take(void)
+{
+    taskENTER_CRITICAL(&written_mux);
+    if (written != NULL) {
+        memcpy(taken, pending, written_words() * sizeof(uint32_t));
+        memset(pending, 0, written_words() * sizeof(uint32_t));
+    }
+    taken_any = pending_any;
+    pending_any = false;
+    taskEXIT_CRITICAL(&written_mux);
+}
+
+void usb_written_done(void)
+{
+    if (written != NULL) {
+        memset(taken, 0, written_words() * sizeof(uint32_t));
+    }
+    taken_any = false;
+}
+
 static void storage_mount_changed(tinyusb_msc_event_t *event)
 {
+    if (event->mount_changed_data.is_mounted) {
+        taskENTER_CRITICAL(&written_mux);
+        if (written != NULL) {
+            for (size_t i = 0; i < written_words(); i++) {
+                pending[i] |= written[i];
+            }
+            memset(written, 0, written_words() * sizeof(uint32_t));
+        }
+        pending_any |= written_any;
+        written_any = false;
+        taskEXIT_CRITICAL(&written_mux);
+    }
     if (chg_cb != NULL) {
         chg_cb(event->mount_changed_data.is_mounted);
     }
@@ -160,6 +386,11 @@ static void tinyusb_cdc_line_state_changed_callback(int itf,
     dtr = event->line_state_changed_data.dtr;
     rts = event->line_state_changed_data.rts;
 
+    if (line_state_cb != NULL) {
+        line_state_cb(dtr, rts);
+        lineState = 0;
+        return;
+    }
     if (!dtr && rts) {
         if (lineState == 0) {
             lineState++;
@@ -188,15 +419,31 @@ static void tinyusb_cdc_line_state_changed_callback(int itf,
         }
     }
 }
+
+void usb_line_state_hook(usb_line_state_cb_t cb)
+{
+    line_state_cb = cb;
+}
 #endif
 
-void usb_init(usb_cb_t chg)
+void usb_init(usb_cb_t chg, usb_write_cb_t write)
 {
     ESP_LOGI(TAG, "Initializing storage...");
 
-    static wl_handle_t wl_handle = WL_INVALID_HANDLE;
     ESP_ERROR_CHECK(storage_init_spiflash(&wl_handle));
     chg_cb = chg;
+    write_cb = write;
+
+    sector_size = wl_sector_size(wl_handle);
+    written_sectors = wl_size(wl_handle) / sector_size;
+    written = calloc(3 * written_words(), sizeof(uint32_t));
+    if (written != NULL) {
+        pending = written + written_words();
+        taken = pending + written_words();
+    } else {
+        ESP_LOGW(TAG, "Cannot track the written sectors, rescan on mount");
+    }
+    msc_cache_init(wl_handle);
 
     const tinyusb_msc_spiflash_config_t config_spi = {
         .wl_handle = wl_handle,
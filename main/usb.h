@@ -3,8 +3,31 @@
 #include "tusb_msc_storage.h"
 
 typedef void (*usb_cb_t)(bool);
+// The first write of the host since the app last got the volume, before it
+// lands
+typedef void (*usb_write_cb_t)(void);
 
-void usb_init(usb_cb_t chg);
+void usb_init(usb_cb_t chg, usb_write_cb_t write);
+
+// Whether the host wrote to the volume, in the writes the running ingest
+// took or in those handed back to the app since
+bool usb_written(void);
+// Whether the host wrote the file or its directory entry, like
+// usb_written(), true when it cannot tell
+bool usb_file_written(const char *path);
+// An ingest takes the writes of the host up to the last time the app got
+// the volume back and is done with them at its end. The later ones are left
+// for the next ingest.
+void usb_written_take(void);
+void usb_written_done(void);
+
+#ifdef CONFIG_TINYUSB_CDC_ENABLED
+// DTR and RTS of the CDC port, from the tinyusb task
+typedef void (*usb_line_state_cb_t)(bool dtr, bool rts);
+// Hands DTR and RTS to cb instead of rebooting on the esptool sequences, NULL
+// gives them back
+void usb_line_state_hook(usb_line_state_cb_t cb);
+#endif
 
 bool inline usb_mounted(void)
 {
@@ -0,0 +1,64 @@
+#!/usr/bin/env python3
+"""Save the trace of the flasher as Chrome trace-event JSON, see main/trace.h.
+
+Needs CONFIG_FLASH_TRACE. The console command "trace" prints the events the
+flasher recorded since the last dump, the file opens in ui.perfetto.dev or
+chrome://tracing:
+
+    tools/trace.py -p /dev/ttyACM0 trace.json
+"""
+
+import argparse
+import json
+import sys
+import time
+
+from upload import Port
+
+BEGIN = b'{"displayTimeUnit"'
+END = b'\n]}'
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('-p', '--port', required=True,
+                        help='CDC port of the flasher')
+    parser.add_argument('--timeout', type=float, default=5.0,
+                        help='seconds to wait for the whole trace')
+    parser.add_argument('--clear', action='store_true',
+                        help='only drop the events recorded so far')
+    parser.add_argument('file', nargs='?', default='trace.json')
+    args = parser.parse_args()
+
+    port = Port(args.port)
+    try:
+        if args.clear:
+            port.write(b'\r\ntrace clear\r\n')
+            return 0
+        port.write(b'\r\ntrace\r\n')
+        rx = b''
+        deadline = time.monotonic() + args.timeout
+        while time.monotonic() < deadline:
+            rx += port.read(0.1)
+            start = rx.find(BEGIN)
+            end = rx.find(END, start) if start >= 0 else -1
+            if end >= 0:
+                break
+        else:
+            print('No trace, is CONFIG_FLASH_TRACE set?', file=sys.stderr)
+            return 1
+    finally:
+        port.close()
+
+    # The console may turn the line ends into CRLF
+    trace = rx[start:end + len(END)].replace(b'\r\n', b'\n')
+    events = json.loads(trace)['traceEvents']
+    with open(args.file, 'wb') as f:
+        f.write(trace)
+    spans = sum(1 for e in events if e['ph'] == 'B')
+    print('%d span(s) written to %s' % (spans, args.file))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
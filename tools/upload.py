@@ -0,0 +1,188 @@
+#!/usr/bin/env python3
+"""Upload a build to the flasher over its CDC port, see main/upload.h.
+
+The files of flasher_args.json and the file itself go into the "images"
+partition of the flasher, which flashes them at once without the USB storage
+being ejected. host/upload_sim stands in for the flasher on a pty:
+
+    tools/upload.py -p /dev/ttyACM0 build
+"""
+
+import argparse
+import hashlib
+import json
+import os
+import struct
+import sys
+import time
+import zlib
+
+MAGIC = b'\xa5\x5a'
+HELLO, BEGIN, FILE, DATA, END, COMMIT, QUIT, REPLY = b'HBFDECQR'
+STATUS = ['ok', 'bad frame', 'bad state', 'busy', 'no space', 'bad digest',
+          'I/O error', 'bad job']
+OK, BAD_FRAME, BAD_DIGEST = 0, 1, 5
+JOB_NAME = 'flasher_args.json'
+
+
+class Port:
+    """pyserial when it is installed, a raw POSIX terminal otherwise"""
+
+    def __init__(self, path):
+        try:
+            import serial
+            self.serial = serial.Serial(path, 115200, timeout=0.1)
+        except ImportError:
+            import termios
+            import tty
+            self.serial = None
+            self.fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+            tty.setraw(self.fd, termios.TCSANOW)
+
+    def write(self, data):
+        if self.serial:
+            self.serial.write(data)
+            return
+        while data:
+            data = data[os.write(self.fd, data):]
+
+    def read(self, timeout):
+        if self.serial:
+            self.serial.timeout = timeout
+            return self.serial.read(max(1, self.serial.in_waiting))
+        import select
+        if not select.select([self.fd], [], [], timeout)[0]:
+            return b''
+        return os.read(self.fd, 4096)
+
+    def close(self):
+        if self.serial:
+            self.serial.close()
+        else:
+            os.close(self.fd)
+
+
+class Uploader:
+    def __init__(self, port, timeout, retries):
+        self.port = port
+        self.timeout = timeout
+        self.retries = retries
+        self.seq = 0
+        self.rx = b''
+        self.resent = 0
+
+    def reply(self, seq, deadline):
+        """The reply of seq, None once the deadline passed"""
+        while True:
+            start = self.rx.find(MAGIC)
+            if start >= 0 and len(self.rx) >= start + 15:
+                frame = self.rx[start + 2:start + 15]
+                typ, rseq, length, status, value, crc = struct.unpack(
+                    '<BBHBII', frame)
+                if (typ == REPLY and length == 5 and
+                        zlib.crc32(frame[:9]) == crc):
+                    self.rx = self.rx[start + 15:]
+                    if rseq == seq or status == BAD_FRAME:
+                        return status, value
+                    continue  # late reply of a resent request
+                self.rx = self.rx[start + 2:]  # console output
+                continue
+            left = deadline - time.monotonic()
+            if left <= 0:
+                return None
+            self.rx += self.port.read(left)
+
+    def frame(self, typ, payload=b''):
+        self.seq = (self.seq + 1) & 0xff
+        head = struct.pack('<BBH', typ, self.seq, len(payload))
+        return MAGIC + head + payload + struct.pack(
+            '<I', zlib.crc32(head + payload))
+
+    def request(self, typ, payload=b''):
+        frame = self.frame(typ, payload)
+        for attempt in range(self.retries + 1):
+            if attempt > 0:
+                self.resent += 1
+            self.port.write(frame)
+            got = self.reply(self.seq, time.monotonic() + self.timeout)
+            if got is not None and got[0] != BAD_FRAME:
+                return got
+        raise IOError('no reply to %r' % chr(typ))
+
+    def check(self, typ, payload=b''):
+        status, value = self.request(typ, payload)
+        if status != OK:
+            raise IOError('%r refused: %s' % (chr(typ), STATUS[status]
+                                              if status < len(STATUS)
+                                              else status))
+        return value
+
+    def send_file(self, name, data, chunk):
+        """False if the flasher holds the content already"""
+        md5 = hashlib.md5(data).digest()
+        for _ in range(self.retries + 1):
+            if self.check(FILE, struct.pack('<I', len(data)) + md5 +
+                          name.encode()):
+                return False
+            for pos in range(0, len(data), chunk):
+                self.check(DATA, data[pos:pos + chunk])
+            status, _ = self.request(END)
+            if status == OK:
+                return True
+            if status != BAD_DIGEST:
+                raise IOError('%s refused: %s' % (name, STATUS[status]))
+            print('%s arrived damaged, sending it again' % name)
+        raise IOError('%s keeps arriving damaged' % name)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('-p', '--port', required=True,
+                        help='CDC port of the flasher, or the pty of '
+                        'host/upload_sim')
+    parser.add_argument('--timeout', type=float, default=2.0,
+                        help='seconds to wait for each reply')
+    parser.add_argument('--retries', type=int, default=3)
+    parser.add_argument('dir', nargs='?', default='build',
+                        help='directory of %s' % JOB_NAME)
+    args = parser.parse_args()
+
+    with open(os.path.join(args.dir, JOB_NAME), 'rb') as f:
+        job = f.read()
+    files = [(name, open(os.path.join(args.dir, name), 'rb').read())
+             for name in json.loads(job)['flash_files'].values()]
+    files.append((JOB_NAME, job))
+    total = sum(len(data) for _, data in files)
+
+    port = Port(args.port)
+    try:
+        port.write(b'\r\nupload\r\n')
+        up = Uploader(port, args.timeout, args.retries)
+        chunk = up.check(HELLO)
+        start = time.monotonic()
+        up.check(BEGIN, struct.pack('<I', total))
+        sent = 0
+        for name, data in files:
+            if up.send_file(name, data, chunk):
+                print('%-40s %8d bytes' % (name, len(data)))
+                sent += len(data)
+            else:
+                print('%-40s %8d bytes held' % (name, len(data)))
+        count = up.check(COMMIT)
+        # Not waited for, the session is over either way
+        port.write(up.frame(QUIT))
+        elapsed = time.monotonic() - start
+        print('Committed %d file(s), %d of %d KiB sent in %.1f s, %.1f KiB/s, '
+              '%d frame(s) resent' % (count, sent // 1024, total // 1024,
+                                      elapsed, sent / 1024 / elapsed,
+                                      up.resent))
+    except IOError as e:
+        print('Upload failed: %s' % e, file=sys.stderr)
+        return 1
+    finally:
+        port.close()
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())